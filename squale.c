@@ -159,6 +159,7 @@ squale_stats_client (SqualeClient *client, gpointer data, Squale *squale)
     struct timeval current_time;
     GList *joblists = NULL;
     char *joblists_string = NULL;
+    gulong memory_used = 0, memory_high_water = 0;
 
     g_return_if_fail (SQUALE_IS_CLIENT (client));
 
@@ -174,6 +175,15 @@ squale_stats_client (SqualeClient *client, gpointer data, Squale *squale)
     g_hash_table_insert (hash, g_strdup (_("connected_clients")),
                          g_strdup_printf ("%d", squale_listener_count_clients (squale->listener)));
 
+    squale_memory_budget_get_usage (squale_memory_budget_get_global (),
+                                    &memory_used, &memory_high_water);
+    g_hash_table_insert (hash, g_strdup (_("memory_budget")),
+                         g_strdup_printf ("%lu", squale_memory_budget_get_global ()->limit));
+    g_hash_table_insert (hash, g_strdup (_("memory_used")),
+                         g_strdup_printf ("%lu", memory_used));
+    g_hash_table_insert (hash, g_strdup (_("memory_high_water")),
+                         g_strdup_printf ("%lu", memory_high_water));
+
     joblists = squale->xml->joblists;
 
     while (joblists) {
@@ -270,8 +280,9 @@ squale_check_mem_block (char **data_pointer, gulong *allocated_bytes,
 
         new_pointer = g_try_realloc (*data_pointer, new_allocation);
         if (new_pointer == NULL) {
-            g_error ("Failed reallocating %lu bytes, that's very bad",
-                     new_allocation);
+            /* The caller fails its job, the other ones keep running */
+            g_warning ("Failed reallocating %lu bytes, that's very bad",
+                       new_allocation);
             return FALSE;
         }
         else {
@@ -488,6 +499,7 @@ main (int argc, const char **argv)
 
     g_type_init ();
     g_thread_init (NULL);
+    squale_memory_budget_init ();
 
     /* i18n initialization */
     setlocale (LC_MESSAGES, "");
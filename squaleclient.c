@@ -23,6 +23,11 @@
 #include "config.h"
 #endif
 
+/* For struct ucred */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "squale.h"
 #include "squaleclient.h"
 #include "squale-i18n.h"
@@ -33,6 +38,8 @@
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 
 #ifdef HAVE_DMALLOC
 #include <dmalloc.h>
@@ -106,6 +113,64 @@ squale_client_disconnected (SqualeClient *client)
     }
 }
 
+/* Write as much as possible of the header, resultset body and tail in one
+   system call, skipping what has already been written. A resultset spilled to
+   disk is sent on its own with sendfile. Returns the number of bytes written
+   and sets remaining to what is left to send. */
+static gssize
+squale_client_write_result (SqualeClient *client, gulong *remaining)
+{
+    struct iovec iov[3];
+    gint n_iov = 0, i, body = -1;
+    gulong skip = client->written_so_far, total = 0;
+    gboolean spilled = FALSE;
+
+    iov[n_iov].iov_base = client->out_buf;
+    iov[n_iov++].iov_len = client->out_buf_size;
+    if (client->out_resultset) {
+        spilled = client->out_resultset->spill_fd >= 0;
+        body = n_iov;
+        iov[n_iov].iov_base = spilled ? NULL : client->out_resultset->data +
+                SQUALE_RESULTSET_HEADER_SIZE;
+        iov[n_iov++].iov_len = squale_resultset_get_size (client->out_resultset) -
+                SQUALE_RESULTSET_HEADER_SIZE;
+    }
+    if (client->out_tail) {
+        iov[n_iov].iov_base = client->out_tail;
+        iov[n_iov++].iov_len = client->out_tail_size;
+    }
+
+    for (i = 0; i < n_iov; i++) {
+        total += iov[i].iov_len;
+    }
+
+    *remaining = total - client->written_so_far;
+
+    /* Skip the vectors we already sent */
+    i = 0;
+    while (i < n_iov && skip >= iov[i].iov_len) {
+        skip -= iov[i].iov_len;
+        i++;
+    }
+
+    if (i == n_iov)
+        return 0;
+
+    if (spilled && i == body) {
+        /* The file offset is ours, the spill file might be shared by several
+           clients */
+        off_t offset = SQUALE_RESULTSET_HEADER_SIZE + skip;
+        return sendfile (client->client_fd, client->out_resultset->spill_fd,
+                         &offset, iov[i].iov_len - skip);
+    }
+
+    iov[i].iov_base = (char *) iov[i].iov_base + skip;
+    iov[i].iov_len -= skip;
+
+    return writev (client->client_fd, iov + i,
+                   (spilled && i < body ? body : n_iov) - i);
+}
+
 /* Here we prepare the output buffer that will be written to the socket from
    the GSource dispatch function when the socket becomes writable. */
 static void
@@ -145,7 +210,21 @@ squale_client_send_result (SqualeClient *client)
         buf_pos += sizeof (gint32);
         *(gint32 *)(client->out_buf + buf_pos) = processing_time;
         buf_pos += sizeof (gint32);
-        *(char *)(client->out_buf + buf_pos) = 'E';
+        /* Errors the client should retry later get their own type */
+        if (g_error_matches (client->job->error, squale_resultset_error_quark (),
+                             SQUALE_RESULTSET_ERROR_BUDGET) ||
+            g_error_matches (client->job->error, squale_joblist_error_quark (),
+                             SQUALE_JOBLIST_ERROR_OVERLOADED)) {
+            *(char *)(client->out_buf + buf_pos) = 'T';
+        }
+        /* Rejected by the limits of the tenant, back off before retrying */
+        else if (g_error_matches (client->job->error, squale_joblist_error_quark (),
+                                  SQUALE_JOBLIST_ERROR_TENANT_LIMIT)) {
+            *(char *)(client->out_buf + buf_pos) = 'L';
+        }
+        else {
+            *(char *)(client->out_buf + buf_pos) = 'E';
+        }
         buf_pos += sizeof (char);
         *(gint32 *)(client->out_buf + buf_pos) = error_length;
         buf_pos += sizeof (gint32);
@@ -169,42 +248,46 @@ squale_client_send_result (SqualeClient *client)
         buf_pos += sizeof (char);
         *(gint32 *)(client->out_buf + buf_pos) = client->job->affected_rows;
     }
-    else if (client->job->resultset->data) {
+    else if (squale_resultset_has_data (client->job->resultset)) {
         g_message (_("Job %p generated a resultset"), client->job);
 
-        /* Here we will just put our integers and 'R' in the resultset buffer
-           indeed the worker preallocated a space for us. This way we just use the
-           data pointer of the resultset as out_buf and we save a lot of memory
-           operations */
-        *(gint32 *)(client->job->resultset->data + buf_pos) = assignation_time;
+        /* The resultset data block might be shared with other jobs which got
+           coalesced with ours. We never write into it and only build our own
+           header and warning tail around it */
+        client->out_buf_size = SQUALE_RESULTSET_HEADER_SIZE;
+
+        client->out_buf = g_malloc0 (client->out_buf_size);
+
+        *(gint32 *)(client->out_buf + buf_pos) = assignation_time;
         buf_pos += sizeof (gint32);
-        *(gint32 *)(client->job->resultset->data + buf_pos) = processing_time;
+        *(gint32 *)(client->out_buf + buf_pos) = processing_time;
         buf_pos += sizeof (gint32);
-        if (client->job->warning) {
-            *(char *)(client->job->resultset->data + buf_pos) = 'W';
+        if (client->job->resultset->encoding == SQUALE_RESULTSET_BINARY) {
+            /* Typed binary resultset, lower case if a warning follows */
+            *(char *)(client->out_buf + buf_pos) = client->job->warning ? 'b' : 'B';
+        }
+        else if (client->job->resultset->encoding == SQUALE_RESULTSET_COLUMNAR) {
+            /* Column by column resultset, lower case if a warning follows */
+            *(char *)(client->out_buf + buf_pos) = client->job->warning ? 'c' : 'C';
+        }
+        else if (client->job->warning) {
+            *(char *)(client->out_buf + buf_pos) = 'W';
         }
         else {
-            *(char *)(client->job->resultset->data + buf_pos) = 'R';
+            *(char *)(client->out_buf + buf_pos) = 'R';
         }
         buf_pos += sizeof (char);
 
-        client->out_buf_size = client->job->resultset->data_size;
-        /* resultset->data won't be freed when the job will be disposed anyway,
-           we will free that block of memory */
-        client->out_buf = client->job->resultset->data;
+        client->out_resultset = squale_resultset_ref (client->job->resultset);
+
         if (client->job->warning) {
-            gulong offset = client->job->resultset->data_size;
             gint32 warning_length = strlen (client->job->warning->message);
             /* We add the warning message's length and the warning message itself */
-            squale_check_mem_block (&(client->out_buf),
-                                    &(client->job->resultset->allocated_memory), offset,
-                                    sizeof (gint32) + warning_length);
-            *(gint32 *)(client->out_buf + offset) = warning_length;
-            offset += sizeof (gint32);
-            memcpy (client->out_buf + offset, client->job->warning->message,
-                    warning_length);
-            offset += warning_length;
-            client->out_buf_size = offset;
+            client->out_tail_size = sizeof (gint32) + warning_length;
+            client->out_tail = g_malloc0 (client->out_tail_size);
+            *(gint32 *)(client->out_tail) = warning_length;
+            memcpy (client->out_tail + sizeof (gint32),
+                    client->job->warning->message, warning_length);
         }
     }
     else {
@@ -313,6 +396,126 @@ squale_client_execute_system_order (SqualeClient *client)
     return TRUE;
 }
 
+/* Forget about the hedge of our job, cancelling it if it is running */
+static void
+squale_client_drop_hedge (SqualeClient *client)
+{
+    if (client->hedge_timeout) {
+        g_source_remove (client->hedge_timeout);
+        client->hedge_timeout = 0;
+    }
+
+    if (client->hedge_sourceid) {
+        g_source_remove (client->hedge_sourceid);
+        client->hedge_sourceid = 0;
+    }
+
+    if (client->hedge_io_channel) {
+        g_io_channel_shutdown (client->hedge_io_channel, TRUE, NULL);
+        g_io_channel_unref (client->hedge_io_channel);
+        client->hedge_io_channel = NULL;
+    }
+
+    if (SQUALE_IS_JOB (client->hedge_job)) {
+        squale_joblist_cancel_job (client->joblist, client->hedge_job);
+        /* The joblist stole our ref */
+        squale_joblist_remove_job (client->joblist, client->hedge_job);
+        client->hedge_job = NULL;
+    }
+}
+
+/* The hedge completed before our job. Its result is sent and our job takes
+   the place of the loser */
+static gboolean
+squale_client_hedge_io_watch (GIOChannel *source, GIOCondition condition,
+                              gpointer user_data)
+{
+    SqualeClient *client = NULL;
+    SqualeJob *hedge = NULL;
+    gchar c;
+
+    g_return_val_if_fail (SQUALE_IS_CLIENT (user_data), FALSE);
+
+    client = SQUALE_CLIENT (user_data);
+
+    read (client->hedge_job->control_socket[0], &c, 1);
+
+    if (client->hedge_job->status != SQUALE_JOB_COMPLETE) {
+        return TRUE;
+    }
+
+    /* The source will be removed when we return */
+    client->hedge_sourceid = 0;
+
+    /* A failing hedge does not tell anything about our job, keep waiting */
+    if (client->hedge_job->error) {
+        squale_client_drop_hedge (client);
+        return FALSE;
+    }
+
+    g_message (_("Hedge %p of job %p won for client %p"), client->hedge_job,
+               client->job, client);
+    client->joblist->nb_hedge_wins++;
+
+    if (client->job_sourceid) {
+        g_source_remove (client->job_sourceid);
+        client->job_sourceid = 0;
+    }
+
+    if (client->job_io_channel) {
+        g_io_channel_shutdown (client->job_io_channel, TRUE, NULL);
+        g_io_channel_unref (client->job_io_channel);
+        client->job_io_channel = NULL;
+    }
+
+    hedge = client->hedge_job;
+    client->hedge_job = NULL;
+
+    squale_joblist_cancel_job (client->joblist, client->job);
+    squale_joblist_detach_mirror (client->joblist, client->job);
+    squale_joblist_release_tenant (client->joblist, client->job);
+    squale_joblist_remove_job (client->joblist, client->job);
+
+    client->job = hedge;
+    client->job_io_channel = client->hedge_io_channel;
+    client->hedge_io_channel = NULL;
+
+    squale_client_send_result (client);
+
+    return FALSE;
+}
+
+/* Our read is still running after the p95 of the joblist, try another
+   endpoint */
+static gboolean
+squale_client_hedge_timeout (gpointer user_data)
+{
+    SqualeClient *client = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_CLIENT (user_data), FALSE);
+
+    client = SQUALE_CLIENT (user_data);
+
+    client->hedge_timeout = 0;
+
+    if (!SQUALE_IS_JOB (client->job) || !SQUALE_IS_JOBLIST (client->joblist)) {
+        return FALSE;
+    }
+
+    client->hedge_job = squale_joblist_hedge_job (client->joblist, client->job);
+
+    if (client->hedge_job) {
+        client->hedge_io_channel = g_io_channel_unix_new (
+                client->hedge_job->control_socket[0]);
+        client->hedge_sourceid = g_io_add_watch (client->hedge_io_channel,
+                                                 G_IO_IN,
+                                                 squale_client_hedge_io_watch,
+                                                 client);
+    }
+
+    return FALSE;
+}
+
 /* When we receive some data on the job's control socket that means something
    happened to our job. We check the status of the job and react accordingly */
 static gboolean
@@ -331,6 +534,7 @@ squale_client_job_io_watch (GIOChannel *source, GIOCondition condition,
     /* We only dispatch COMPLETE jobs */
     if (SQUALE_IS_JOB (client->job) &&
         client->job->status == SQUALE_JOB_COMPLETE) {
+        squale_client_drop_hedge (client);
         squale_client_send_result (client);
         /* The source will be removed when we return so mark it as deleted */
         client->job_sourceid = 0;
@@ -341,6 +545,39 @@ squale_client_job_io_watch (GIOChannel *source, GIOCondition condition,
     }
 }
 
+/* Our joblist shadows some of its reads on another one, find it and let the
+   joblist decide if this read is copied */
+static void
+squale_client_mirror_job (SqualeClient *client)
+{
+    SqualeJob *job = client->job;
+    GList *joblists = NULL;
+
+    if (!client->joblist->mirror || !client->joblist->mirror_percent ||
+        !job->read_only || job->job_type != SQUALE_JOB_NORMAL ||
+        job->nb_params || job->cursor_rows || job->pinned_worker ||
+        job->no_reply)
+        return;
+
+    for (joblists = client->joblists; joblists;
+         joblists = g_list_next (joblists)) {
+        SqualeJobList *joblist = SQUALE_JOBLIST (joblists->data);
+        char *joblist_name = NULL;
+
+        if (!SQUALE_IS_JOBLIST (joblist) || joblist == client->joblist)
+            continue;
+
+        joblist_name = squale_joblist_get_name (joblist);
+        if (joblist_name &&
+            !g_ascii_strcasecmp (joblist_name, client->joblist->mirror)) {
+            g_free (joblist_name);
+            squale_joblist_mirror_job (client->joblist, job, joblist);
+            return;
+        }
+        g_free (joblist_name);
+    }
+}
+
 /* This function searches for a matching joblist in the list we have been
    given by squale main loop. When a joblist is found we keep a ref to it,
    create a job with the query and put that job in the joblist */
@@ -357,13 +594,7 @@ squale_client_execute (SqualeClient *client)
         return TRUE;
     }
 
-    client->job = squale_job_new ();
-
-    if (SQUALE_IS_JOB (client->job)) {
-        g_message (_("Created job %p for client %p"), client->job, client);
-    }
-    else {
-        g_warning ("Failed creating a new job for client %p", client);
+    if (!SQUALE_IS_JOB (client->job)) {
         return FALSE;
     }
 
@@ -381,8 +612,12 @@ squale_client_execute (SqualeClient *client)
         g_warning ("Failed creating the GIOChannel for job %p", client->job);
     }
 
-    /* Defining the query for that job */
-    squale_job_set_query (client->job, client->incoming_order);
+    /* Invalid parameters were received, no need to go further */
+    if (client->job->error) {
+        squale_job_set_status_if_match (client->job, SQUALE_JOB_COMPLETE,
+                                        SQUALE_JOB_PENDING);
+        return TRUE;
+    }
 
     /* Try to find a matching joblist to attach that job to */
     joblists = client->joblists;
@@ -408,10 +643,45 @@ squale_client_execute (SqualeClient *client)
                 }
 
                 /* Check job type */
-                if (client->job->job_type == SQUALE_JOB_NORMAL) {
+                if (squale_job_needs_worker (client->job)) {
                     GError *error = NULL;
+                    gboolean added;
+
+                    /* Tenant limits apply to new orders, not to the rest
+                       of an open session */
+                    if (!client->job->pinned_worker &&
+                        !squale_joblist_admit_tenant (client->joblist,
+                                                      client->job, &error)) {
+                        added = FALSE;
+                    }
+                    /* Orders of a session need their worker right away */
+                    else if (client->job->no_reply && joblist->spool &&
+                        client->job->job_type == SQUALE_JOB_NORMAL &&
+                        !client->job->nb_params && !client->job->cursor_rows &&
+                        !client->job->pinned_worker) {
+                        added = squale_joblist_spool_job (client->joblist,
+                                                          client->job, &error);
+                    }
+                    else {
+                        added = squale_joblist_add_job (client->joblist,
+                                                        client->job, &error);
+                        if (added) {
+                            guint delay;
+
+                            squale_client_mirror_job (client);
+
+                            delay = squale_joblist_get_hedge_delay (client->joblist,
+                                                                    client->job);
+                            if (delay) {
+                                client->hedge_timeout =
+                                        g_timeout_add (delay,
+                                                       squale_client_hedge_timeout,
+                                                       client);
+                            }
+                        }
+                    }
 
-                    if (!squale_joblist_add_job (client->joblist, client->job, &error)) {
+                    if (!added) {
                         if (error) {
                             squale_job_set_error (client->job, error);
                         }
@@ -437,7 +707,7 @@ squale_client_execute (SqualeClient *client)
         joblists = g_list_next (joblists);
     }
 
-    if (client->job->job_type == SQUALE_JOB_NORMAL) {
+    if (squale_job_needs_worker (client->job)) {
         GError *error = g_error_new (squale_client_error_quark (), 0,
                                      _("Joblist %s does not exist in this SQuaLe instance"),
                                      client->order_joblist);
@@ -454,6 +724,125 @@ squale_client_execute (SqualeClient *client)
     }
 }
 
+/* Create the job as soon as the order is received so that the order header
+   tells us if parameters are following */
+static gboolean
+squale_client_create_job (SqualeClient *client)
+{
+    g_return_val_if_fail (SQUALE_IS_CLIENT (client), FALSE);
+
+    client->job = squale_job_new ();
+
+    if (SQUALE_IS_JOB (client->job)) {
+        g_message (_("Created job %p for client %p"), client->job, client);
+    }
+    else {
+        g_warning ("Failed creating a new job for client %p", client);
+        return FALSE;
+    }
+
+    /* Defining the query for that job */
+    squale_job_set_query (client->job, client->incoming_order);
+
+    /* Orders not naming their tenant are accounted to the peer */
+    if (!client->job->tenant) {
+        client->job->tenant = g_strdup (client->peer_tenant);
+    }
+
+    /* Fetch and close orders go to the worker holding our cursor, every
+       order of a transaction goes to the worker running it */
+    if (client->job->job_type == SQUALE_JOB_CURSOR_FETCH ||
+        client->job->job_type == SQUALE_JOB_CURSOR_CLOSE) {
+        if (!client->session_worker || client->in_transaction) {
+            squale_job_set_error (client->job,
+                                  g_error_new (squale_client_error_quark (), 0,
+                                               _("No open cursor")));
+        }
+        else {
+            client->job->pinned_worker = g_object_ref (client->session_worker);
+            client->job->session = client->session;
+            if (!client->job->cursor_rows) {
+                client->job->cursor_rows = client->cursor_rows;
+            }
+        }
+    }
+    else if (client->session_worker && client->in_transaction &&
+             squale_job_needs_worker (client->job)) {
+        client->job->pinned_worker = g_object_ref (client->session_worker);
+        client->job->session = client->session;
+    }
+    else if (client->session_worker && squale_job_needs_worker (client->job)) {
+        squale_job_set_error (client->job,
+                              g_error_new (squale_client_error_quark (), 0,
+                                           _("A cursor is still open, fetch or close it first")));
+    }
+
+    return TRUE;
+}
+
+/* The result of a job which left its cursor or transaction open has been
+   sent, get ready for the next order of the session */
+static void
+squale_client_continue_session (SqualeClient *client)
+{
+    g_return_if_fail (SQUALE_IS_CLIENT (client));
+    g_return_if_fail (SQUALE_IS_JOB (client->job));
+
+    if (!client->session_worker) {
+        client->session_worker = g_object_ref (client->job->pinned_worker);
+        client->session = client->job->session;
+        client->cursor_rows = client->job->cursor_rows;
+    }
+    client->in_transaction = client->job->in_transaction;
+
+    if (client->out_buf) {
+        g_free (client->out_buf);
+        client->out_buf = NULL;
+        client->out_buf_size = 0;
+    }
+
+    if (client->out_resultset) {
+        squale_resultset_unref (client->out_resultset);
+        client->out_resultset = NULL;
+    }
+
+    if (client->out_tail) {
+        g_free (client->out_tail);
+        client->out_tail = NULL;
+        client->out_tail_size = 0;
+    }
+
+    client->written_so_far = 0;
+
+    if (client->job_sourceid) {
+        g_source_remove (client->job_sourceid);
+        client->job_sourceid = 0;
+    }
+
+    if (client->job_io_channel) {
+        g_io_channel_shutdown (client->job_io_channel, TRUE, NULL);
+        g_io_channel_unref (client->job_io_channel);
+        client->job_io_channel = NULL;
+    }
+
+    if (SQUALE_IS_JOBLIST (client->joblist)) {
+        squale_joblist_detach_mirror (client->joblist, client->job);
+        squale_joblist_release_tenant (client->joblist, client->job);
+        squale_joblist_remove_job (client->joblist, client->job);
+        g_object_unref (client->joblist);
+        client->joblist = NULL;
+    }
+    client->job = NULL;
+
+    if (client->incoming_order) {
+        g_free (client->incoming_order);
+        client->incoming_order = NULL;
+    }
+    client->params_read = 0;
+
+    client->status = SQUALE_CLIENT_CONNECTION;
+}
+
 /* That function get called when the client is taking too much time to send
    the order. It might be dead so we consider it as disconnected */
 static gboolean
@@ -608,6 +997,55 @@ squale_client_client_io_watch (GIOChannel *source, GIOCondition condition,
                 ret = squale_client_read_string (client, &(client->incoming_order));
                 switch (ret) {
                     case SQUALE_CLIENT_READ_OK:
+                        if (!squale_client_create_job (client)) {
+                            g_signal_emit (client, client_signals[DISCONNECTED], 0, NULL);
+                            return FALSE;
+                        }
+
+                        if (client->job->nb_params) {
+                            /* Bind parameters are following */
+                            client->status = SQUALE_CLIENT_PARAMS;
+                            break;
+                        }
+
+                        if (client->client_timeout) {
+                            g_source_remove (client->client_timeout);
+                            client->client_timeout = 0;
+                        }
+
+                        client->status = SQUALE_CLIENT_ORDER;
+                        squale_client_execute (client);
+                        break;
+                    case SQUALE_CLIENT_READ_PARTIAL:
+                        return TRUE;
+                    case SQUALE_CLIENT_READ_DISCONNECTED:
+                        return FALSE;
+                }
+                break;
+            case SQUALE_CLIENT_PARAMS:
+                ret = squale_client_read_string (client, &(client->incoming_param));
+                switch (ret) {
+                    case SQUALE_CLIENT_READ_OK:
+                    {
+                        GError *error = NULL;
+
+                        /* We keep reading the parameters after an invalid one to
+                           stay in sync with the protocol */
+                        if (!client->job->error &&
+                            !squale_job_add_param (client->job, client->incoming_param,
+                                                   &error)) {
+                            squale_job_set_error (client->job, error);
+                        }
+
+                        g_free (client->incoming_param);
+                        client->incoming_param = NULL;
+
+                        client->params_read++;
+
+                        if (client->params_read < client->job->nb_params) {
+                            break;
+                        }
+
                         if (client->client_timeout) {
                             g_source_remove (client->client_timeout);
                             client->client_timeout = 0;
@@ -616,6 +1054,7 @@ squale_client_client_io_watch (GIOChannel *source, GIOCondition condition,
                         client->status = SQUALE_CLIENT_ORDER;
                         squale_client_execute (client);
                         break;
+                    }
                     case SQUALE_CLIENT_READ_PARTIAL:
                         return TRUE;
                     case SQUALE_CLIENT_READ_DISCONNECTED:
@@ -644,20 +1083,29 @@ squale_client_client_io_watch (GIOChannel *source, GIOCondition condition,
 
     /* The socket becomes writable */
     if (condition & G_IO_OUT) {
-        gint32 wrote_bytes;
+        gssize wrote_bytes;
+        gulong remaining = 0;
         switch (client->status) {
             case SQUALE_CLIENT_SEND_RESULT:
-                wrote_bytes = write (client->client_fd,
-                                     client->out_buf + client->written_so_far,
-                                     client->out_buf_size - client->written_so_far);
+                wrote_bytes = squale_client_write_result (client, &remaining);
                 if (wrote_bytes > 0) {
                     client->written_so_far += wrote_bytes;
 
-                    if (client->written_so_far >= client->out_buf_size) {
+                    if ((gulong) wrote_bytes >= remaining) {
                         /* We wrote everything we wanted to send */
                         client->status = SQUALE_CLIENT_RESULT_SENT;
                         g_message (_("Data transfer to client %p completed successfully"),
                                    client);
+                        if (client->job->session_open) {
+                            /* More pages to fetch or more orders in the transaction,
+                               back to watching for input only */
+                            squale_client_continue_session (client);
+                            client->in_sourceid = g_io_add_watch (client->client_io_channel,
+                                                                  G_IO_IN | G_IO_ERR | G_IO_HUP,
+                                                                  squale_client_client_io_watch,
+                                                                  client);
+                            return FALSE;
+                        }
                         g_signal_emit (client, client_signals[DISCONNECTED], 0, NULL);
                         return FALSE;
                     }
@@ -713,6 +1161,17 @@ squale_client_dispose (GObject *object)
         client->out_buf_size = 0;
     }
 
+    if (client->out_resultset) {
+        squale_resultset_unref (client->out_resultset);
+        client->out_resultset = NULL;
+    }
+
+    if (client->out_tail) {
+        g_free (client->out_tail);
+        client->out_tail = NULL;
+        client->out_tail_size = 0;
+    }
+
     if (client->job_sourceid) {
         /* Remove the IOChannel from the main loop */
         g_source_remove (client->job_sourceid);
@@ -739,10 +1198,16 @@ squale_client_dispose (GObject *object)
         client->client_io_channel = NULL;
     }
 
-    /* We remove normal jobs from the joblist */
+    squale_client_drop_hedge (client);
+
+    /* We remove normal jobs from the joblist, a pending one won't be run and
+       a running one is cancelled */
     if (SQUALE_IS_JOB (client->job) &&
         SQUALE_IS_JOBLIST (client->joblist) &&
-        client->job->job_type == SQUALE_JOB_NORMAL) {
+        squale_job_needs_worker (client->job)) {
+        squale_joblist_cancel_job (client->joblist, client->job);
+        squale_joblist_detach_mirror (client->joblist, client->job);
+        squale_joblist_release_tenant (client->joblist, client->job);
         squale_joblist_remove_job (client->joblist, client->job);
         /* We don't touch the job as the joblist stole our ref */
         client->job = NULL;
@@ -753,6 +1218,13 @@ squale_client_dispose (GObject *object)
         client->joblist = NULL;
     }
 
+    /* We went away with a cursor or transaction still open */
+    if (client->session_worker) {
+        squale_worker_release (client->session_worker, client->session);
+        g_object_unref (client->session_worker);
+        client->session_worker = NULL;
+    }
+
     /* That was an internal job, unrefing it */
     if (SQUALE_IS_JOB (client->job)) {
         g_object_unref (client->job);
@@ -769,6 +1241,16 @@ squale_client_dispose (GObject *object)
         client->incoming_order = NULL;
     }
 
+    if (client->incoming_param) {
+        g_free (client->incoming_param);
+        client->incoming_param = NULL;
+    }
+
+    if (client->peer_tenant) {
+        g_free (client->peer_tenant);
+        client->peer_tenant = NULL;
+    }
+
 #ifdef HAVE_DMALLOC
     dmalloc_log_changed (client->dmalloc_mark,
       1 /* log unfreed pointers */,
@@ -794,8 +1276,13 @@ squale_client_init (SqualeClient *client)
     /* Structure to receive order */
     client->order_joblist = NULL;
     client->incoming_order = NULL;
+    client->incoming_param = NULL;
+    client->params_read = 0;
     client->out_buf = NULL;
     client->out_buf_size = 0;
+    client->out_resultset = NULL;
+    client->out_tail = NULL;
+    client->out_tail_size = 0;
     client->written_so_far = 0;
     client->read_so_far = 0;
     client->string_length = 0;
@@ -805,6 +1292,17 @@ squale_client_init (SqualeClient *client)
     client->joblist = NULL;
     client->job = NULL;
 
+    client->hedge_job = NULL;
+    client->hedge_io_channel = NULL;
+    client->hedge_sourceid = client->hedge_timeout = 0;
+
+    client->session_worker = NULL;
+    client->session = 0;
+    client->cursor_rows = 0;
+    client->in_transaction = FALSE;
+
+    client->peer_tenant = NULL;
+
 #ifdef HAVE_DMALLOC
     /* get the current dmalloc position */
   client->dmalloc_mark = dmalloc_mark () ;
@@ -844,6 +1342,10 @@ squale_client_class_init (SqualeClientClass *klass)
 void
 squale_client_set_fd (SqualeClient *client, gint client_fd)
 {
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t cred_len = sizeof (cred);
+#endif
     gint val;
 
     g_return_if_fail (SQUALE_IS_CLIENT (client));
@@ -860,6 +1362,20 @@ squale_client_set_fd (SqualeClient *client, gint client_fd)
 
     client->client_io_channel = g_io_channel_unix_new (client_fd);
     client->client_fd = client_fd;
+
+    /* Clients of the same user share their fair queuing tenant, failing
+       that each connection is a tenant of its own */
+    g_free (client->peer_tenant);
+    client->peer_tenant = NULL;
+#ifdef SO_PEERCRED
+    if (getsockopt (client_fd, SOL_SOCKET, SO_PEERCRED, &cred,
+                    &cred_len) == 0) {
+        client->peer_tenant = g_strdup_printf ("uid:%u", (guint) cred.uid);
+    }
+#endif
+    if (!client->peer_tenant) {
+        client->peer_tenant = g_strdup_printf ("client:%p", client);
+    }
 }
 
 void
@@ -41,6 +41,7 @@ typedef enum {
     SQUALE_CLIENT_CONNECTION_HEADER,
     SQUALE_CLIENT_CONNECTION,
     SQUALE_CLIENT_ORDER_HEADER,
+    SQUALE_CLIENT_PARAMS,
     SQUALE_CLIENT_ORDER,
     SQUALE_CLIENT_SEND_RESULT,
     SQUALE_CLIENT_RESULT_SENT
@@ -61,19 +62,45 @@ struct _SqualeClient
     guint job_sourceid;
 
     gint read_so_far;
-    gint written_so_far;
+    gulong written_so_far;
     gint string_length;
+    guint params_read;
 
     gint32 out_buf_size;
+    gint32 out_tail_size;
 
     char *order_joblist;
     char *incoming_order;
+    char *incoming_param;
+
+    /* The result is sent as a client specific header, an optional shared
+       resultset body and an optional client specific tail */
     char *out_buf;
+    SqualeResultSet *out_resultset;
+    char *out_tail;
 
     GList *joblists;
     SqualeJobList *joblist;
     SqualeJob *job;
 
+    /* Copy of a slow read sent to another endpoint, whichever of the two
+       completes first answers the client */
+    SqualeJob *hedge_job;
+    GIOChannel *hedge_io_channel;
+    guint hedge_sourceid;
+    guint hedge_timeout;
+
+    /* Worker keeping the cursor or transaction opened by one of our orders.
+       The connection stays open for the next orders of the session until the
+       cursor is exhausted or the transaction ends */
+    SqualeWorker *session_worker;
+    guint session;
+    guint cursor_rows;
+    gboolean in_transaction;
+
+    /* Tenant of orders not naming one */
+    char *peer_tenant;
+
     unsigned long dmalloc_mark;
 };
 
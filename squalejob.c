@@ -33,6 +33,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
 
 #ifdef HAVE_DMALLOC
 #include <dmalloc.h>
@@ -46,37 +47,27 @@ static GObjectClass *parent_class = NULL;
 /*                                                               */
 /* ============================================================= */
 
+static GQuark
+squale_job_error_quark (void)
+{
+    static GQuark quark = 0;
+    if (quark == 0)
+        quark = g_quark_from_static_string ("SQuaLe-job");
+    return quark;
+}
+
 static void
 squale_job_resultset_from_hash_foreach (gpointer key,
                                         gpointer value,
                                         gpointer user_data)
 {
-    gulong offset = 0;
-    gint32 field_length = 0;
     SqualeResultSet *resultset = (SqualeResultSet *) user_data;
 
-    offset = resultset->data_size;
-
-    /* We pack key and value and update data_size */
-    field_length = strlen ((char *)key);
-    squale_check_mem_block (&(resultset->data),
-                            &(resultset->allocated_memory), offset,
-                            sizeof (gint32) + field_length);
-    *(gint32 *)(resultset->data + offset) = field_length;
-    offset += sizeof (gint32);
-    memcpy (resultset->data + offset, key, field_length);
-    offset += field_length;
-
-    field_length = strlen ((char *)value);
-    squale_check_mem_block (&(resultset->data),
-                            &(resultset->allocated_memory), offset,
-                            sizeof (gint32) + field_length);
-    *(gint32 *)(resultset->data + offset) = field_length;
-    offset += sizeof (gint32);
-    memcpy (resultset->data + offset, value, field_length);
-    offset += field_length;
-
-    resultset->data_size = offset;
+    /* We pack key and value as a row */
+    squale_resultset_add_value (resultset, (char *) key, strlen ((char *) key));
+    squale_resultset_add_value (resultset, (char *) value,
+                                strlen ((char *) value));
+    squale_resultset_end_row (resultset);
 }
 
 static gint32
@@ -85,6 +76,501 @@ squale_job_diff_millitime (struct timeval begin, struct timeval end)
     return ((end.tv_sec - begin.tv_sec) * 1000) + ((end.tv_usec - begin.tv_usec) / 1000);
 }
 
+/* Words which can be followed by a parenthesis in a read-only SELECT:
+   keywords and functions without side effects whose result only depends on
+   their arguments */
+static const char *squale_job_read_only_calls[] = {
+    "select", "from", "join", "on", "using", "where", "having", "as", "in",
+    "exists", "not", "and", "or", "any", "all", "some", "union", "values",
+    "over", "when", "then", "else", "by", "is", "like", "between",
+    "distinct",
+    "count", "sum", "min", "max", "avg", "group_concat", "coalesce",
+    "ifnull", "nvl", "nullif", "if", "decode", "greatest", "least", "cast",
+    "convert", "lower", "upper", "length", "char_length", "concat",
+    "concat_ws", "substring", "substr", "trim", "ltrim", "rtrim", "lpad",
+    "rpad", "left", "right", "replace", "instr", "locate", "abs", "round",
+    "floor", "ceil", "ceiling", "mod", "date", "year", "month", "day",
+    "hour", "minute", "date_format", "to_char", "to_date", "to_number",
+    "row_number", "rank", "dense_rank",
+    NULL
+};
+
+/* Words making a SELECT lock, write or depend on the session or the clock */
+static const char *squale_job_read_only_forbidden[] = {
+    "for", "lock", "into", "current_timestamp", "current_date",
+    "current_time", "localtime", "localtimestamp", "sysdate",
+    "systimestamp", "nextval", "currval",
+    NULL
+};
+
+static gboolean
+squale_job_word_in (const char *word, const char **words)
+{
+    for (; *words; words++) {
+        if (!strcmp (word, *words))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* We only consider plain SELECT statements as read-only: the query is
+   split in words, skipping literals and comments, and any locking clause,
+   INTO, session variable, second statement or call to a function which is
+   not known to be deterministic excludes it. Hedges, retries, mirrors and
+   coalescing run or share such a query so we rather miss a few. */
+static gboolean
+squale_job_query_is_read_only (const char *query)
+{
+    const char *walk = query;
+    gboolean first = TRUE;
+
+    while (*walk) {
+        if (g_ascii_isspace (*walk)) {
+            walk++;
+        }
+        else if (*walk == '\'' || *walk == '"' || *walk == '`') {
+            char quote = *walk;
+
+            for (walk++; *walk && *walk != quote; walk++) {
+                if (*walk == '\\' && walk[1])
+                    walk++;
+            }
+            if (!*walk)
+                return FALSE;
+            walk++;
+        }
+        else if ((!strncmp (walk, "--", 2) &&
+                  (!walk[2] || g_ascii_isspace (walk[2]))) || *walk == '#') {
+            while (*walk && *walk != '\n')
+                walk++;
+        }
+        else if (!strncmp (walk, "/*", 2)) {
+            const char *end = strstr (walk + 2, "*/");
+
+            /* Executable comments are run by MySQL */
+            if (!end || walk[2] == '!')
+                return FALSE;
+            walk = end + 2;
+        }
+        else if (g_ascii_isalpha (*walk) || *walk == '_') {
+            const char *start = walk;
+            char *word = NULL;
+            gboolean allowed = TRUE;
+
+            while (g_ascii_isalnum (*walk) || *walk == '_' || *walk == '$')
+                walk++;
+
+            word = g_ascii_strdown (start, walk - start);
+
+            if (first) {
+                allowed = !strcmp (word, "select");
+                first = FALSE;
+            }
+            else if (squale_job_word_in (word, squale_job_read_only_forbidden)) {
+                allowed = FALSE;
+            }
+            else {
+                const char *next = walk;
+
+                while (g_ascii_isspace (*next))
+                    next++;
+                if (*next == '(' &&
+                    !squale_job_word_in (word, squale_job_read_only_calls))
+                    allowed = FALSE;
+            }
+
+            g_free (word);
+
+            if (!allowed)
+                return FALSE;
+        }
+        else if (*walk == '@') {
+            return FALSE;
+        }
+        else if (*walk == ';') {
+            /* Only a trailing semicolon */
+            for (walk++; g_ascii_isspace (*walk); walk++);
+            if (*walk)
+                return FALSE;
+        }
+        else {
+            if (first)
+                return FALSE;
+            walk++;
+        }
+    }
+
+    return !first;
+}
+
+/* Transaction control statements are run by the worker itself so that it
+   can pin the client session. Only the plain statements are recognized,
+   "BEGIN" opening a PL/SQL block or "ROLLBACK TO SAVEPOINT" are normal
+   orders. */
+static SqualeJobType
+squale_job_query_transaction_type (const char *query)
+{
+    SqualeJobType type = SQUALE_JOB_NORMAL;
+    char *statement = NULL;
+
+    statement = g_ascii_strdown (query, -1);
+    g_strstrip (statement);
+
+    /* Optional trailing semicolon */
+    if (g_str_has_suffix (statement, ";")) {
+        statement[strlen (statement) - 1] = '\0';
+        g_strchomp (statement);
+    }
+
+    if (!strcmp (statement, "begin") || !strcmp (statement, "begin work") ||
+        !strcmp (statement, "begin transaction") ||
+        !strcmp (statement, "start transaction")) {
+        type = SQUALE_JOB_TRANSACTION_BEGIN;
+    }
+    else if (!strcmp (statement, "commit") ||
+             !strcmp (statement, "commit work")) {
+        type = SQUALE_JOB_TRANSACTION_COMMIT;
+    }
+    else if (!strcmp (statement, "rollback") ||
+             !strcmp (statement, "rollback work")) {
+        type = SQUALE_JOB_TRANSACTION_ROLLBACK;
+    }
+
+    g_free (statement);
+
+    return type;
+}
+
+/* Check if a resultset cell matches the literal key of a batch member.
+   Numeric keys are compared as numbers so that "07" matches 7. */
+static gboolean
+squale_job_batch_key_match (const char *key, const char *cell, gint32 length)
+{
+    gboolean match = FALSE;
+
+    if (*key == '\'') {
+        /* String literal, compare without the quotes */
+        if (strlen (key) - 2 == (gsize) length && !memcmp (key + 1, cell, length)) {
+            match = TRUE;
+        }
+    }
+    else if (strlen (key) == (gsize) length && !memcmp (key, cell, length)) {
+        match = TRUE;
+    }
+    else if (length > 0 && length < 64 &&
+             (g_ascii_isdigit (*key) || *key == '-')) {
+        char buffer[64], *end = NULL;
+        gdouble value;
+        memcpy (buffer, cell, length);
+        buffer[length] = '\0';
+        value = g_ascii_strtod (buffer, &end);
+        if (*end == '\0' && value == g_ascii_strtod (key, NULL)) {
+            match = TRUE;
+        }
+    }
+
+    return match;
+}
+
+/* Extract the rows matching the key of a batch member from the resultset of
+   the merged query. The fields block is copied as is. */
+static gboolean
+squale_job_split_batch_result (SqualeJob *member, SqualeJob *batch)
+{
+    SqualeResultSet *resultset = batch->resultset;
+    gint32 num_fields = 0, key_index = -1, i;
+    gulong offset = SQUALE_RESULTSET_HEADER_SIZE, fields_end = 0, rows_start = 0;
+    gulong num_rows = 0, matching_rows = 0, matching_size = 0, j;
+    gulong out_offset = 0;
+    gsize key_column_length = strlen (batch->batch_template->key_column);
+
+    /* Batch jobs are never spilled to disk */
+    if (!resultset->data) {
+        squale_job_set_error (member, g_error_new (squale_job_error_quark (), 0,
+                                                   _("Batched query did not return a resultset")));
+        return FALSE;
+    }
+
+    num_fields = *(gint32 *)(resultset->data + offset);
+    offset += sizeof (gint32);
+
+    for (i = 0; i < num_fields; i++) {
+        gint32 field_length = *(gint32 *)(resultset->data + offset);
+        offset += sizeof (gint32);
+        if ((gsize) field_length == key_column_length &&
+            !g_ascii_strncasecmp (resultset->data + offset,
+                                  batch->batch_template->key_column,
+                                  field_length)) {
+            key_index = i;
+        }
+        offset += field_length;
+    }
+
+    if (key_index == -1) {
+        squale_job_set_error (member, g_error_new (squale_job_error_quark (), 0,
+                                                   _("Batched query did not return key column %s"),
+                                                   batch->batch_template->key_column));
+        return FALSE;
+    }
+
+    fields_end = offset;
+    num_rows = *(gulong *)(resultset->data + offset);
+    offset += sizeof (gulong);
+    rows_start = offset;
+
+    /* First pass to compute how much memory we need */
+    for (j = 0; j < num_rows; j++) {
+        gulong row_start = offset;
+        gboolean match = FALSE;
+
+        for (i = 0; i < num_fields; i++) {
+            gint32 field_length = *(gint32 *)(resultset->data + offset);
+            offset += sizeof (gint32);
+            if (i == key_index) {
+                match = squale_job_batch_key_match (member->batch_key,
+                                                    resultset->data + offset,
+                                                    field_length);
+            }
+            offset += field_length;
+        }
+
+        if (match) {
+            matching_rows++;
+            matching_size += offset - row_start;
+        }
+    }
+
+    member->resultset->allocated_memory = fields_end + sizeof (gulong) +
+            matching_size;
+    member->resultset->data = g_malloc0 (member->resultset->allocated_memory);
+    squale_resultset_update_budget (member->resultset);
+
+    memcpy (member->resultset->data, resultset->data, fields_end);
+    out_offset = fields_end;
+    *(gulong *)(member->resultset->data + out_offset) = matching_rows;
+    out_offset += sizeof (gulong);
+
+    /* Second pass copying the matching rows */
+    offset = rows_start;
+    for (j = 0; j < num_rows && matching_rows; j++) {
+        gulong row_start = offset;
+        gboolean match = FALSE;
+
+        for (i = 0; i < num_fields; i++) {
+            gint32 field_length = *(gint32 *)(resultset->data + offset);
+            offset += sizeof (gint32);
+            if (i == key_index) {
+                match = squale_job_batch_key_match (member->batch_key,
+                                                    resultset->data + offset,
+                                                    field_length);
+            }
+            offset += field_length;
+        }
+
+        if (match) {
+            memcpy (member->resultset->data + out_offset,
+                    resultset->data + row_start, offset - row_start);
+            out_offset += offset - row_start;
+        }
+    }
+
+    member->resultset->data_size = out_offset;
+
+    return TRUE;
+}
+
+/* Parse the options of the order header and return a pointer to the query
+   following it. Unknown options are ignored. */
+static const char *
+squale_job_parse_order_header (SqualeJob *job, const char *query)
+{
+    const char *walk = query, *end = NULL;
+    char *header = NULL, **options = NULL;
+    guint i;
+
+    while (g_ascii_isspace (*walk))
+        walk++;
+
+    if (!g_str_has_prefix (walk, SQUALE_ORDER_HEADER_START))
+        return query;
+
+    walk += strlen (SQUALE_ORDER_HEADER_START);
+
+    end = strstr (walk, SQUALE_ORDER_HEADER_END);
+    if (!end) {
+        g_warning (_("Unterminated order header in job %p"), job);
+        return query;
+    }
+
+    header = g_strndup (walk, end - walk);
+    options = g_strsplit (g_strstrip (header), " ", 0);
+
+    for (i = 0; options[i] != NULL; i++) {
+        char *value = strchr (options[i], '=');
+
+        if (*options[i] == '\0')
+            continue;
+
+        if (value)
+            *value++ = '\0';
+
+        if (!strcmp (options[i], "params") && value) {
+            job->nb_params = atoi (value);
+        }
+        else if (!strcmp (options[i], "noreply")) {
+            job->no_reply = value ? atoi (value) != 0 : TRUE;
+        }
+        else if (!strcmp (options[i], "deadline") && value) {
+            /* Milliseconds from now, our clocks might not agree */
+            gint32 budget = atoi (value);
+
+            if (budget > 0) {
+                job->deadline_ts.tv_sec = job->creation_ts.tv_sec + budget / 1000;
+                job->deadline_ts.tv_usec = job->creation_ts.tv_usec +
+                                           (budget % 1000) * 1000;
+                if (job->deadline_ts.tv_usec >= 1000000) {
+                    job->deadline_ts.tv_sec++;
+                    job->deadline_ts.tv_usec -= 1000000;
+                }
+            }
+        }
+        else if (!strcmp (options[i], "affinity") && value) {
+            g_free (job->affinity);
+            job->affinity = g_strdup (value);
+            job->affinity_hash = g_str_hash (value);
+        }
+        else if (!strcmp (options[i], "tenant") && value) {
+            g_free (job->tenant);
+            job->tenant = g_strdup (value);
+        }
+        else if (!strcmp (options[i], "priority") && value) {
+            if (!strcmp (value, "interactive")) {
+                job->priority = SQUALE_PRIORITY_INTERACTIVE;
+            }
+            else if (!strcmp (value, "batch")) {
+                job->priority = SQUALE_PRIORITY_BATCH;
+            }
+            else if (!strcmp (value, "maintenance")) {
+                job->priority = SQUALE_PRIORITY_MAINTENANCE;
+            }
+            else {
+                g_warning (_("Unknown priority '%s' in job %p"), value, job);
+            }
+        }
+        else if (!strcmp (options[i], "cursor") && value) {
+            job->cursor_rows = atoi (value);
+        }
+        else if (!strcmp (options[i], "encoding") && value) {
+            if (!strcmp (value, "binary")) {
+                job->encoding = SQUALE_RESULTSET_BINARY;
+            }
+            else if (!strcmp (value, "columnar")) {
+                job->encoding = SQUALE_RESULTSET_COLUMNAR;
+            }
+            else if (!strcmp (value, "text")) {
+                job->encoding = SQUALE_RESULTSET_TEXT;
+            }
+            else {
+                g_warning (_("Unknown encoding '%s' in job %p"), value, job);
+            }
+        }
+        else {
+            g_warning (_("Unknown order header option '%s' in job %p"),
+                       options[i], job);
+        }
+    }
+
+    g_strfreev (options);
+    g_free (header);
+
+    walk = end + strlen (SQUALE_ORDER_HEADER_END);
+    while (g_ascii_isspace (*walk))
+        walk++;
+
+    return walk;
+}
+
+static void
+squale_job_param_free (gpointer data, gpointer user_data)
+{
+    SqualeJobParam *param = (SqualeJobParam *) data;
+
+    g_free (param->value);
+    g_free (param);
+}
+
+/* Copy the result of a completed leader to one of its followers. The
+   resultset data is shared, not duplicated, unless the leader is a batch in
+   which case the follower only gets its own rows. */
+static void
+squale_job_copy_result (SqualeJob *follower, SqualeJob *leader)
+{
+    if (leader->error) {
+        squale_job_set_error (follower, g_error_copy (leader->error));
+    }
+    else if (leader->is_batch &&
+             leader->batch_template->kind == SQUALE_BATCH_INSERT) {
+        /* A multi-row insert either inserts every row or fails */
+        follower->affected_rows = 1;
+    }
+    else if (leader->is_batch &&
+             leader->batch_template->kind == SQUALE_BATCH_COUNTER) {
+        /* Every increment touched the same rows */
+        follower->affected_rows = leader->affected_rows;
+    }
+    else if (leader->is_batch) {
+        squale_job_split_batch_result (follower, leader);
+    }
+    else {
+        if (follower->resultset) {
+            squale_resultset_unref (follower->resultset);
+        }
+        follower->resultset = squale_resultset_ref (leader->resultset);
+    }
+    if (leader->warning) {
+        squale_job_set_warning (follower, g_error_copy (leader->warning));
+    }
+
+    if (!leader->is_batch) {
+        follower->affected_rows = leader->affected_rows;
+    }
+
+    /* The follower has been waiting since the leader was assigned, or since it
+       was created if it attached to an already processing leader */
+    if (timercmp (&(leader->assign_ts), &(follower->creation_ts), >)) {
+        follower->assign_ts = leader->assign_ts;
+    }
+    else {
+        follower->assign_ts = follower->creation_ts;
+    }
+}
+
+static void
+squale_job_complete_followers (SqualeJob *job, GList *followers)
+{
+    GList *walk = followers;
+
+    while (walk) {
+        SqualeJob *follower = SQUALE_JOB (walk->data);
+
+        if (SQUALE_IS_JOB (follower)) {
+            g_message (_("Completing %s job %p with the result of job %p"),
+                       job->is_batch ? _("batch member") : _("follower"),
+                       follower, job);
+            squale_job_copy_result (follower, job);
+            squale_job_set_status_if_match (follower, SQUALE_JOB_COMPLETE,
+                                            SQUALE_JOB_PENDING);
+            /* Release the reference taken in squale_job_add_follower */
+            g_object_unref (follower);
+        }
+
+        walk = g_list_next (walk);
+    }
+
+    g_list_free (followers);
+}
+
 /* =========================================== */
 /*                                             */
 /*              Init & Class init              */
@@ -104,11 +590,82 @@ squale_job_dispose (GObject *object)
     }
 
     if (job->resultset) {
-        g_message (_("Freeing resultset memory of job %p"), job);
-        g_free (job->resultset);
+        squale_resultset_unref (job->resultset);
         job->resultset = NULL;
     }
 
+    if (job->followers) {
+        g_list_foreach (job->followers, (GFunc) g_object_unref, NULL);
+        g_list_free (job->followers);
+        job->followers = NULL;
+    }
+
+    if (job->leader) {
+        g_object_unref (job->leader);
+        job->leader = NULL;
+    }
+
+    if (job->pinned_worker) {
+        g_object_unref (job->pinned_worker);
+        job->pinned_worker = NULL;
+    }
+
+    if (job->spool) {
+        squale_spool_unref (job->spool);
+        job->spool = NULL;
+    }
+
+    if (job->batch_key) {
+        g_free (job->batch_key);
+        job->batch_key = NULL;
+    }
+
+    if (job->tenant) {
+        g_free (job->tenant);
+        job->tenant = NULL;
+    }
+
+    if (job->fingerprint) {
+        g_free (job->fingerprint);
+        job->fingerprint = NULL;
+    }
+
+    if (job->endpoint) {
+        g_free (job->endpoint);
+        job->endpoint = NULL;
+    }
+
+    if (job->affinity) {
+        g_free (job->affinity);
+        job->affinity = NULL;
+    }
+
+    if (job->mirror) {
+        g_object_unref (job->mirror);
+        job->mirror = NULL;
+    }
+
+    if (job->mirror_of) {
+        g_object_unref (job->mirror_of);
+        job->mirror_of = NULL;
+    }
+
+    if (job->mirror_source) {
+        g_object_unref (job->mirror_source);
+        job->mirror_source = NULL;
+    }
+
+    if (job->avoid_endpoint) {
+        g_free (job->avoid_endpoint);
+        job->avoid_endpoint = NULL;
+    }
+
+    if (job->params) {
+        g_ptr_array_foreach (job->params, squale_job_param_free, NULL);
+        g_ptr_array_free (job->params, TRUE);
+        job->params = NULL;
+    }
+
     if (job->error) {
         g_error_free (job->error);
         job->error = NULL;
@@ -146,11 +703,48 @@ squale_job_init (SqualeJob *job)
     }
 
     job->query = NULL;
-
-    job->resultset = g_new0 (SqualeResultSet, 1);
-    job->resultset->data = NULL;
-    job->resultset->data_size = 0;
-    job->resultset->allocated_memory = 0;
+    job->read_only = FALSE;
+
+    job->nb_params = 0;
+    job->params = NULL;
+    job->encoding = SQUALE_RESULTSET_TEXT;
+    job->priority = SQUALE_PRIORITY_INTERACTIVE;
+    job->tenant = NULL;
+    job->fair_tag = 0;
+    job->tenant_admitted = FALSE;
+    job->fingerprint = NULL;
+    job->slow = FALSE;
+    job->endpoint = NULL;
+    job->avoid_endpoint = NULL;
+    job->nb_retries = 0;
+    timerclear (&(job->retry_ts));
+    job->affinity = NULL;
+    job->affinity_hash = 0;
+    job->mirror = NULL;
+    job->mirror_of = NULL;
+    job->mirror_source = NULL;
+    job->is_mirror = FALSE;
+
+    job->resultset = squale_resultset_new ();
+
+    job->leader = NULL;
+    job->followers = NULL;
+
+    job->batch_template = NULL;
+    job->batch_key = NULL;
+    job->is_batch = FALSE;
+
+    job->cursor_rows = 0;
+    job->pinned_worker = NULL;
+    job->session = 0;
+    job->session_open = FALSE;
+    job->in_transaction = FALSE;
+
+    job->no_reply = FALSE;
+    job->spool = NULL;
+    job->spool_record = 0;
+
+    timerclear (&(job->deadline_ts));
 
     job->error = NULL;
     job->warning = NULL;
@@ -180,64 +774,24 @@ squale_job_class_init (SqualeJobClass *klass)
 gboolean
 squale_job_complete_from_hashtable (SqualeJob *job, GHashTable *hash)
 {
-    gint32 num_fields = 2, field_length;
-    gulong offset = 0, num_rows = 0;
-
     g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
     g_return_val_if_fail (hash != NULL, FALSE);
 
     g_message (_("Generating resultset from hashtable %p for job %p"),
                hash, job);
 
-    num_rows = (gulong) g_hash_table_size (hash);
-
-    /* Let's allocate the needed memory in the resultset data buffer.
-       We need 2 gint32 and a char for the header then we can start packing
-       our data */
-    job->resultset->allocated_memory = 1024;
-    job->resultset->data = g_malloc0 (job->resultset->allocated_memory);
-
-    /* Packing number of fields */
-    squale_check_mem_block (&(job->resultset->data),
-                            &(job->resultset->allocated_memory), offset,
-                            3 * sizeof (gint32) + sizeof (char));
-
-    offset = 2 * sizeof (gint32) + sizeof (char);
-
-    *(gint32 *)(job->resultset->data + offset) = num_fields;
-    offset += sizeof (gint32);
-
-    /* Packing columns names */
-    field_length = strlen ("Name");
-    squale_check_mem_block (&(job->resultset->data),
-                            &(job->resultset->allocated_memory), offset,
-                            sizeof (gint32) + field_length);
-    *(gint32 *)(job->resultset->data + offset) = field_length;
-    offset += sizeof (gint32);
-    memcpy (job->resultset->data + offset, "Name", field_length);
-    offset += field_length;
-    field_length = strlen ("Value");
-    squale_check_mem_block (&(job->resultset->data),
-                            &(job->resultset->allocated_memory), offset,
-                            sizeof (gint32) + field_length);
-    *(gint32 *)(job->resultset->data + offset) = field_length;
-    offset += sizeof (gint32);
-    memcpy (job->resultset->data + offset, "Value", field_length);
-    offset += field_length;
-
-    /* Packing number of rows */
-    squale_check_mem_block (&(job->resultset->data),
-                            &(job->resultset->allocated_memory), offset,
-                            sizeof (gulong));
-    *(gulong *)(job->resultset->data + offset) = num_rows;
-    offset += sizeof (gulong);
-
-    job->resultset->data_size = offset;
+    squale_resultset_begin (job->resultset, job->encoding, 2);
+    squale_resultset_add_column (job->resultset, "Name", strlen ("Name"),
+                                 SQUALE_COLUMN_TEXT);
+    squale_resultset_add_column (job->resultset, "Value", strlen ("Value"),
+                                 SQUALE_COLUMN_TEXT);
 
     /* Foreach row of hash table insert in data table  */
     g_hash_table_foreach (hash, squale_job_resultset_from_hash_foreach,
                           job->resultset);
 
+    squale_resultset_finish (job->resultset);
+
     squale_job_set_status_if_match (job, SQUALE_JOB_COMPLETE,
                                     SQUALE_JOB_PENDING);
 
@@ -258,6 +812,26 @@ squale_job_get_processing_time (SqualeJob *job) {
     return squale_job_diff_millitime (job->assign_ts, job->complete_ts);
 }
 
+/* Milliseconds left before the deadline of the job, 0 once it has passed
+   and G_MAXINT32 if it has none */
+gint32
+squale_job_get_time_left (SqualeJob *job)
+{
+    struct timeval now;
+    gint32 left;
+
+    g_return_val_if_fail (SQUALE_IS_JOB (job), G_MAXINT32);
+
+    if (!timerisset (&(job->deadline_ts)))
+        return G_MAXINT32;
+
+    gettimeofday (&now, NULL);
+
+    left = squale_job_diff_millitime (now, job->deadline_ts);
+
+    return MAX (left, 0);
+}
+
 gboolean
 squale_job_set_query (SqualeJob *job, const char *query)
 {
@@ -271,6 +845,8 @@ squale_job_set_query (SqualeJob *job, const char *query)
 
     g_message (_("Job %p received query %s"), job, query);
 
+    query = squale_job_parse_order_header (job, query);
+
     job->query = g_strdup (query);
 
     if (g_str_has_prefix (query, SQUALE_GLOBAL_STATS_ORDER)) {
@@ -288,13 +864,76 @@ squale_job_set_query (SqualeJob *job, const char *query)
     else if (g_str_has_prefix (query, SQUALE_STARTUP_ORDER)) {
         job->job_type = SQUALE_JOB_STARTUP;
     }
+    else if (g_str_has_prefix (query, SQUALE_CURSOR_FETCH_ORDER)) {
+        job->job_type = SQUALE_JOB_CURSOR_FETCH;
+    }
+    else if (g_str_has_prefix (query, SQUALE_CURSOR_CLOSE_ORDER)) {
+        job->job_type = SQUALE_JOB_CURSOR_CLOSE;
+    }
     else {
-        job->job_type = SQUALE_JOB_NORMAL;
+        job->job_type = squale_job_query_transaction_type (query);
+    }
+
+    if (job->job_type == SQUALE_JOB_NORMAL) {
+        job->read_only = squale_job_query_is_read_only (query);
+    }
+    else {
+        job->read_only = FALSE;
     }
 
     return TRUE;
 }
 
+/* Jobs going through a joblist to be run by a worker, the other ones are
+   system orders run by the client itself */
+gboolean
+squale_job_needs_worker (SqualeJob *job)
+{
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    return job->job_type == SQUALE_JOB_NORMAL ||
+           job->job_type == SQUALE_JOB_CURSOR_FETCH ||
+           job->job_type == SQUALE_JOB_CURSOR_CLOSE ||
+           job->job_type == SQUALE_JOB_TRANSACTION_BEGIN ||
+           job->job_type == SQUALE_JOB_TRANSACTION_COMMIT ||
+           job->job_type == SQUALE_JOB_TRANSACTION_ROLLBACK;
+}
+
+/* Add a bind parameter received from the client. The first character of
+   the string is the parameter type. */
+gboolean
+squale_job_add_param (SqualeJob *job, const char *param, GError **error)
+{
+    SqualeJobParam *job_param = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+    g_return_val_if_fail (param != NULL, FALSE);
+
+    switch (*param) {
+        case SQUALE_PARAM_NULL:
+        case SQUALE_PARAM_INT:
+        case SQUALE_PARAM_DOUBLE:
+        case SQUALE_PARAM_STRING:
+            break;
+        default:
+            g_set_error (error, squale_job_error_quark (), 0,
+                         _("Invalid parameter type '%c'"), *param);
+            return FALSE;
+    }
+
+    if (!job->params)
+        job->params = g_ptr_array_sized_new (job->nb_params);
+
+    job_param = g_new0 (SqualeJobParam, 1);
+    job_param->type = (SqualeParamType) *param;
+    if (job_param->type != SQUALE_PARAM_NULL)
+        job_param->value = g_strdup (param + 1);
+
+    g_ptr_array_add (job->params, job_param);
+
+    return TRUE;
+}
+
 gboolean
 squale_job_set_error (SqualeJob *job, GError *error)
 {
@@ -323,10 +962,786 @@ squale_job_set_warning (SqualeJob *job, GError *warning)
     return TRUE;
 }
 
+/* Attach a follower to that job. The follower will be completed with our
+   result when we complete. This fails if we are already complete. */
+gboolean
+squale_job_add_follower (SqualeJob *job, SqualeJob *follower)
+{
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (follower), FALSE);
+    g_return_val_if_fail (follower->leader == NULL, FALSE);
+
+    g_mutex_lock (job->status_mutex);
+
+    if (job->status == SQUALE_JOB_COMPLETE) {
+        g_mutex_unlock (job->status_mutex);
+        return FALSE;
+    }
+
+    job->followers = g_list_append (job->followers, g_object_ref (follower));
+    follower->leader = g_object_ref (job);
+
+    g_mutex_unlock (job->status_mutex);
+
+    return TRUE;
+}
+
+/* Detach a follower that is going away before its leader completed */
+gboolean
+squale_job_remove_follower (SqualeJob *job, SqualeJob *follower)
+{
+    gboolean found = FALSE;
+
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (follower), FALSE);
+
+    g_mutex_lock (job->status_mutex);
+
+    if (g_list_find (job->followers, follower)) {
+        job->followers = g_list_remove (job->followers, follower);
+        found = TRUE;
+    }
+
+    g_mutex_unlock (job->status_mutex);
+
+    if (found) {
+        g_object_unref (follower);
+    }
+
+    return found;
+}
+
+/* When a pending leader is removed before being processed, its first follower
+   takes over and inherits the other followers. Returns the new leader which
+   has to be queued in place of the old one, or NULL if there was no
+   follower. The joblist has to be locked. */
+SqualeJob *
+squale_job_promote_follower (SqualeJob *job)
+{
+    SqualeJob *new_leader = NULL;
+    GList *followers = NULL, *walk = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_JOB (job), NULL);
+
+    g_mutex_lock (job->status_mutex);
+    followers = job->followers;
+    job->followers = NULL;
+    g_mutex_unlock (job->status_mutex);
+
+    if (followers == NULL)
+        return NULL;
+
+    new_leader = SQUALE_JOB (followers->data);
+    followers = g_list_delete_link (followers, followers);
+
+    walk = followers;
+    while (walk) {
+        SqualeJob *follower = SQUALE_JOB (walk->data);
+        g_object_unref (follower->leader);
+        follower->leader = g_object_ref (new_leader);
+        walk = g_list_next (walk);
+    }
+
+    g_mutex_lock (new_leader->status_mutex);
+    new_leader->followers = followers;
+    g_mutex_unlock (new_leader->status_mutex);
+
+    g_object_unref (new_leader->leader);
+    new_leader->leader = NULL;
+
+    g_message (_("Job %p is taking over %d followers of job %p"), new_leader,
+               g_list_length (followers), job);
+
+    /* Drop the reference the old leader held, the joblist does not own one */
+    g_object_unref (new_leader);
+
+    return new_leader;
+}
+
+/* Parse a batch template query. The placeholder has to be the right side of
+   an equality, the head is stored without the equal sign. */
+SqualeBatchTemplate *
+squale_batch_template_new (const char *query, const char *key_column,
+                           GError **error)
+{
+    SqualeBatchTemplate *template = NULL;
+    const char *placeholder = NULL;
+    char *head = NULL;
+
+    g_return_val_if_fail (query != NULL, NULL);
+    g_return_val_if_fail (key_column != NULL, NULL);
+
+    placeholder = strchr (query, '?');
+
+    if (!placeholder || strchr (placeholder + 1, '?')) {
+        g_set_error (error, squale_job_error_quark (), 0,
+                     _("Batch template '%s' needs exactly one placeholder"), query);
+        return NULL;
+    }
+
+    head = g_strndup (query, placeholder - query);
+    g_strchomp (head);
+
+    if (!g_str_has_suffix (head, "=")) {
+        g_set_error (error, squale_job_error_quark (), 0,
+                     _("Batch template '%s' placeholder is not part of an equality"),
+                     query);
+        g_free (head);
+        return NULL;
+    }
+
+    head[strlen (head) - 1] = '\0';
+    g_strchomp (head);
+
+    template = g_new0 (SqualeBatchTemplate, 1);
+    template->kind = SQUALE_BATCH_LOOKUP;
+    template->head = head;
+    template->tail = g_strdup (placeholder + 1);
+    template->key_column = g_strdup (key_column);
+    template->window = 1;
+    template->max_size = 100;
+
+    return template;
+}
+
+/* Template for the single row inserts starting with that head, the window
+   and max_size are set by the joblist */
+SqualeBatchTemplate *
+squale_insert_template_new (const char *head)
+{
+    SqualeBatchTemplate *template = NULL;
+
+    g_return_val_if_fail (head != NULL, NULL);
+
+    template = g_new0 (SqualeBatchTemplate, 1);
+    template->kind = SQUALE_BATCH_INSERT;
+    template->head = g_strdup (head);
+    template->tail = g_strdup ("");
+    template->key_column = NULL;
+    template->window = 1;
+    template->max_size = 100;
+
+    return template;
+}
+
+/* Template for the increments of the counter updated by head on the rows
+   selected by tail, the window and max_size are set by the joblist */
+SqualeBatchTemplate *
+squale_counter_template_new (const char *head, const char *tail)
+{
+    SqualeBatchTemplate *template = NULL;
+
+    g_return_val_if_fail (head != NULL, NULL);
+    g_return_val_if_fail (tail != NULL, NULL);
+
+    template = g_new0 (SqualeBatchTemplate, 1);
+    template->kind = SQUALE_BATCH_COUNTER;
+    template->head = g_strdup (head);
+    template->tail = g_strdup (tail);
+    template->key_column = NULL;
+    template->window = 10;
+    template->max_size = 100;
+
+    return template;
+}
+
+void
+squale_batch_template_free (SqualeBatchTemplate *template)
+{
+    g_return_if_fail (template != NULL);
+
+    g_free (template->head);
+    g_free (template->tail);
+    g_free (template->key_column);
+    g_free (template);
+}
+
+/* Check if the job query is an instance of that template. On success the
+   literal key is stored in the job as written in the query. */
+gboolean
+squale_job_match_batch_template (SqualeJob *job, SqualeBatchTemplate *template)
+{
+    const char *walk = NULL, *key_start = NULL, *key_end = NULL;
+    gsize head_length = 0;
+
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+    g_return_val_if_fail (template != NULL, FALSE);
+
+    if (!job->read_only || !job->query || job->nb_params ||
+        job->cursor_rows || job->encoding != SQUALE_RESULTSET_TEXT ||
+        template->kind != SQUALE_BATCH_LOOKUP)
+        return FALSE;
+
+    head_length = strlen (template->head);
+
+    if (g_ascii_strncasecmp (job->query, template->head, head_length))
+        return FALSE;
+
+    walk = job->query + head_length;
+    while (g_ascii_isspace (*walk))
+        walk++;
+    if (*walk != '=')
+        return FALSE;
+    walk++;
+    while (g_ascii_isspace (*walk))
+        walk++;
+
+    if (*walk == '\'') {
+        /* String literal, we refuse escaped quotes */
+        key_start = walk++;
+        while (*walk && *walk != '\'' && *walk != '\\')
+            walk++;
+        if (*walk != '\'')
+            return FALSE;
+        key_end = ++walk;
+    }
+    else {
+        key_start = walk;
+        if (*walk == '-')
+            walk++;
+        while (g_ascii_isdigit (*walk))
+            walk++;
+        key_end = walk;
+        if (key_end == key_start || !g_ascii_isdigit (*(key_end - 1)))
+            return FALSE;
+    }
+
+    if (strcmp (walk, template->tail))
+        return FALSE;
+
+    if (job->batch_key)
+        g_free (job->batch_key);
+
+    job->batch_key = g_strndup (key_start, key_end - key_start);
+    job->batch_template = template;
+
+    return TRUE;
+}
+
+/* Check if the job is a plain single row insert with a column list, like
+   "INSERT INTO t (a, b) VALUES (1, 'x')". On success the values tuple is
+   stored as the job batch key and the head up to VALUES is returned. Inserts
+   with anything after the tuple (ON DUPLICATE KEY, RETURNING...), several
+   tuples or a subquery are left alone. */
+char *
+squale_job_match_insert (SqualeJob *job)
+{
+    const char *walk = NULL, *values = NULL, *tuple = NULL;
+    char quote = 0;
+    gint depth = 0;
+
+    g_return_val_if_fail (SQUALE_IS_JOB (job), NULL);
+
+    if (!job->query || job->job_type != SQUALE_JOB_NORMAL || job->nb_params ||
+        job->cursor_rows || job->pinned_worker)
+        return NULL;
+
+    walk = job->query;
+    while (g_ascii_isspace (*walk))
+        walk++;
+
+    if (g_ascii_strncasecmp (walk, "insert into ", strlen ("insert into ")))
+        return NULL;
+
+    /* The column list comes before VALUES */
+    for (values = walk; *values; values++) {
+        if (!g_ascii_strncasecmp (values, " values", strlen (" values")) &&
+            (g_ascii_isspace (values[strlen (" values")]) ||
+             values[strlen (" values")] == '('))
+            break;
+    }
+    if (!*values || !memchr (walk, '(', values - walk))
+        return NULL;
+
+    values += strlen (" values");
+    tuple = values;
+    while (g_ascii_isspace (*tuple))
+        tuple++;
+    if (*tuple != '(')
+        return NULL;
+
+    /* Find the end of the tuple, skipping quoted strings */
+    for (walk = tuple; *walk; walk++) {
+        if (quote) {
+            if (*walk == '\\' && walk[1])
+                walk++;
+            else if (*walk == quote)
+                quote = 0;
+        }
+        else if (*walk == '\'' || *walk == '"') {
+            quote = *walk;
+        }
+        else if (*walk == '(') {
+            depth++;
+        }
+        else if (*walk == ')' && --depth == 0) {
+            break;
+        }
+    }
+    if (!*walk)
+        return NULL;
+    walk++;
+
+    /* Nothing but an optional semicolon after the tuple */
+    while (g_ascii_isspace (*walk))
+        walk++;
+    if (*walk == ';')
+        walk++;
+    while (g_ascii_isspace (*walk))
+        walk++;
+    if (*walk)
+        return NULL;
+
+    if (job->batch_key)
+        g_free (job->batch_key);
+
+    job->batch_key = g_strndup (tuple, walk - tuple);
+    g_strchomp (job->batch_key);
+    if (g_str_has_suffix (job->batch_key, ";")) {
+        job->batch_key[strlen (job->batch_key) - 1] = '\0';
+        g_strchomp (job->batch_key);
+    }
+
+    return g_strndup (job->query, values - job->query);
+}
+
+/* Skip an identifier, optionally qualified or quoted, and return where it
+   ends or NULL if there is none */
+static const char *
+squale_job_skip_identifier (const char *walk)
+{
+    const char *start = walk;
+
+    while (*walk) {
+        if (*walk == '`' || *walk == '"') {
+            const char *end = strchr (walk + 1, *walk);
+
+            if (!end)
+                return NULL;
+            walk = end + 1;
+        }
+        else if (g_ascii_isalnum (*walk) || *walk == '_' || *walk == '$' ||
+                 *walk == '.') {
+            walk++;
+        }
+        else {
+            break;
+        }
+    }
+
+    return walk == start ? NULL : walk;
+}
+
+/* Return the lowercased column name of an identifier, without its table
+   qualification and quotes */
+static char *
+squale_job_identifier_name (const char *start, const char *end)
+{
+    const char *dot = NULL;
+
+    for (dot = end; dot > start; dot--) {
+        if (*(dot - 1) == '.')
+            break;
+    }
+    start = dot;
+
+    if (end - start >= 2 && (*start == '`' || *start == '"') &&
+        *(end - 1) == *start) {
+        start++;
+        end--;
+    }
+
+    return g_ascii_strdown (start, end - start);
+}
+
+/* Skip a numeric or quoted string literal and return where it ends or NULL
+   if there is none */
+static const char *
+squale_job_skip_literal (const char *walk)
+{
+    const char *start = NULL;
+
+    if (*walk == '\'') {
+        for (walk++; *walk; walk++) {
+            if (*walk == '\\' && walk[1])
+                walk++;
+            else if (*walk == '\'' && walk[1] == '\'')
+                walk++;
+            else if (*walk == '\'')
+                return walk + 1;
+        }
+        return NULL;
+    }
+
+    if (*walk == '-' || *walk == '+')
+        walk++;
+    start = walk;
+    while (g_ascii_isdigit (*walk) || *walk == '.')
+        walk++;
+
+    if (walk == start || g_ascii_isalpha (*walk) || *walk == '_')
+        return NULL;
+
+    return walk;
+}
+
+/* Check that a WHERE clause only holds "col = literal" equalities joined by
+   AND, none of them on the counter column. Anything else (ranges, OR,
+   ORDER BY, LIMIT, subqueries) could depend on the value being updated and
+   would not give the same rows once increments are summed. */
+static gboolean
+squale_job_match_equalities (const char *walk, const char *counter)
+{
+    while (TRUE) {
+        const char *column = walk, *column_end = NULL;
+        char *name = NULL;
+        gboolean same;
+
+        if (!(column_end = squale_job_skip_identifier (column)))
+            return FALSE;
+
+        name = squale_job_identifier_name (column, column_end);
+        same = !strcmp (name, counter);
+        g_free (name);
+        if (same)
+            return FALSE;
+
+        walk = column_end;
+        while (g_ascii_isspace (*walk))
+            walk++;
+        if (*walk != '=')
+            return FALSE;
+        walk++;
+        while (g_ascii_isspace (*walk))
+            walk++;
+
+        if (!(walk = squale_job_skip_literal (walk)))
+            return FALSE;
+
+        if (!*walk)
+            return TRUE;
+        if (!g_ascii_isspace (*walk))
+            return FALSE;
+        while (g_ascii_isspace (*walk))
+            walk++;
+        if (!*walk)
+            return TRUE;
+
+        if (g_ascii_strncasecmp (walk, "and", strlen ("and")) ||
+            !g_ascii_isspace (walk[strlen ("and")]))
+            return FALSE;
+        walk += strlen ("and");
+        while (g_ascii_isspace (*walk))
+            walk++;
+    }
+}
+
+/* Check if the job is a counter increment like
+   "UPDATE t SET hits = hits + 1 WHERE id = 42". On success the signed
+   increment is stored as the job batch key, the " WHERE ..." tail without
+   trailing semicolon is returned in tail and the "UPDATE t SET hits = hits"
+   head is returned. Updates of several columns, with anything but an
+   integer literal or with a WHERE clause which is not a plain list of
+   equalities on other columns are left alone. */
+char *
+squale_job_match_counter (SqualeJob *job, char **tail)
+{
+    const char *walk = NULL, *column = NULL, *column_end = NULL;
+    const char *head_end = NULL, *where = NULL, *end = NULL;
+    char *counter = NULL, *clause = NULL;
+    gboolean equalities;
+    gint64 increment = 0;
+    gboolean negative = FALSE;
+    gint digits = 0;
+
+    g_return_val_if_fail (SQUALE_IS_JOB (job), NULL);
+    g_return_val_if_fail (tail != NULL, NULL);
+
+    if (!job->query || job->job_type != SQUALE_JOB_NORMAL || job->nb_params ||
+        job->cursor_rows || job->pinned_worker)
+        return NULL;
+
+    walk = job->query;
+    while (g_ascii_isspace (*walk))
+        walk++;
+
+    if (g_ascii_strncasecmp (walk, "update ", strlen ("update ")))
+        return NULL;
+    walk += strlen ("update ");
+    while (g_ascii_isspace (*walk))
+        walk++;
+
+    if (!(walk = squale_job_skip_identifier (walk)) || !g_ascii_isspace (*walk))
+        return NULL;
+    while (g_ascii_isspace (*walk))
+        walk++;
+
+    if (g_ascii_strncasecmp (walk, "set ", strlen ("set ")))
+        return NULL;
+    walk += strlen ("set ");
+    while (g_ascii_isspace (*walk))
+        walk++;
+
+    /* c = c */
+    column = walk;
+    if (!(column_end = squale_job_skip_identifier (column)))
+        return NULL;
+    walk = column_end;
+    while (g_ascii_isspace (*walk))
+        walk++;
+    if (*walk != '=')
+        return NULL;
+    walk++;
+    while (g_ascii_isspace (*walk))
+        walk++;
+    if (strncmp (walk, column, column_end - column))
+        return NULL;
+    walk += column_end - column;
+    head_end = walk;
+    if (g_ascii_isalnum (*walk) || *walk == '_' || *walk == '$' || *walk == '.')
+        return NULL;
+    while (g_ascii_isspace (*walk))
+        walk++;
+
+    /* + k or - k */
+    if (*walk == '-')
+        negative = TRUE;
+    else if (*walk != '+')
+        return NULL;
+    walk++;
+    while (g_ascii_isspace (*walk))
+        walk++;
+    while (g_ascii_isdigit (*walk)) {
+        increment = increment * 10 + (*walk - '0');
+        /* Keep sums far from overflowing */
+        if (++digits > 9)
+            return NULL;
+        walk++;
+    }
+    if (!digits)
+        return NULL;
+
+    /* Only a WHERE clause after it */
+    where = walk;
+    while (g_ascii_isspace (*walk))
+        walk++;
+    if (walk == where ||
+        g_ascii_strncasecmp (walk, "where ", strlen ("where ")))
+        return NULL;
+
+    walk += strlen ("where ");
+    while (g_ascii_isspace (*walk))
+        walk++;
+
+    end = where + strlen (where);
+    while (end > where && (g_ascii_isspace (*(end - 1)) || *(end - 1) == ';'))
+        end--;
+    if (end <= walk)
+        return NULL;
+
+    counter = squale_job_identifier_name (column, column_end);
+    clause = g_strndup (walk, end - walk);
+    equalities = squale_job_match_equalities (clause, counter);
+    g_free (clause);
+    g_free (counter);
+    if (!equalities)
+        return NULL;
+
+    if (job->batch_key)
+        g_free (job->batch_key);
+
+    job->batch_key = g_strdup_printf ("%" G_GINT64_FORMAT,
+                                      negative ? -increment : increment);
+
+    *tail = g_strndup (where, end - where);
+
+    return g_strndup (job->query, head_end - job->query);
+}
+
+/* The fingerprint of a query is the query with literals replaced by ?,
+   lists of literals collapsed to one, keywords and identifiers lowercased
+   and blanks squeezed, so that the same statement with other values gets
+   the same fingerprint. It is computed once and kept in the job. */
+const char *
+squale_job_get_fingerprint (SqualeJob *job)
+{
+    GString *fingerprint = NULL;
+    const char *walk = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_JOB (job), NULL);
+
+    if (job->fingerprint || !job->query)
+        return job->fingerprint;
+
+    fingerprint = g_string_sized_new (strlen (job->query));
+
+    walk = job->query;
+    while (*walk && fingerprint->len < SQUALE_FINGERPRINT_LENGTH) {
+        gboolean literal = FALSE;
+
+        if (*walk == '\'') {
+            /* Quoted string, quotes are escaped by doubling or backslash */
+            for (walk++; *walk; walk++) {
+                if (*walk == '\\' && walk[1]) {
+                    walk++;
+                }
+                else if (*walk == '\'') {
+                    if (walk[1] != '\'')
+                        break;
+                    walk++;
+                }
+            }
+            if (*walk)
+                walk++;
+            literal = TRUE;
+        }
+        else if (g_ascii_isdigit (*walk) &&
+                 (!fingerprint->len ||
+                  !(g_ascii_isalnum (fingerprint->str[fingerprint->len - 1]) ||
+                    fingerprint->str[fingerprint->len - 1] == '_'))) {
+            while (g_ascii_isalnum (*walk) || *walk == '.')
+                walk++;
+            literal = TRUE;
+        }
+        else if (g_ascii_isspace (*walk)) {
+            while (g_ascii_isspace (*walk))
+                walk++;
+            if (fingerprint->len && *walk)
+                g_string_append_c (fingerprint, ' ');
+            continue;
+        }
+        else {
+            g_string_append_c (fingerprint, g_ascii_tolower (*walk));
+            walk++;
+            continue;
+        }
+
+        /* IN (1, 2, 3) and IN (4) are the same statement */
+        if (literal) {
+            if (fingerprint->len >= 3 &&
+                !strcmp (fingerprint->str + fingerprint->len - 3, "?, ")) {
+                g_string_truncate (fingerprint, fingerprint->len - 2);
+            }
+            else if (fingerprint->len >= 2 &&
+                     !strcmp (fingerprint->str + fingerprint->len - 2, "?,")) {
+                g_string_truncate (fingerprint, fingerprint->len - 1);
+            }
+            else {
+                g_string_append_c (fingerprint, '?');
+            }
+        }
+    }
+
+    job->fingerprint = g_string_free (fingerprint, FALSE);
+
+    return job->fingerprint;
+}
+
+/* Build the merged IN (...) job, multi-row insert or summed increment, for a
+   list of pending members. The members become followers of the batch job which is returned in processing state.
+   The joblist has to be locked. */
+SqualeJob *
+squale_job_new_batch (SqualeBatchTemplate *template, GList *members)
+{
+    SqualeJob *batch = NULL;
+    GString *query = NULL;
+    GList *walk = NULL;
+
+    g_return_val_if_fail (template != NULL, NULL);
+    g_return_val_if_fail (members != NULL, NULL);
+
+    query = g_string_new (template->head);
+    if (template->kind == SQUALE_BATCH_COUNTER) {
+        gint64 sum = 0;
+
+        for (walk = members; walk; walk = g_list_next (walk)) {
+            sum += g_ascii_strtoll (SQUALE_JOB (walk->data)->batch_key,
+                                    NULL, 10);
+        }
+        g_string_append_printf (query, " %c %" G_GINT64_FORMAT,
+                                sum < 0 ? '-' : '+', sum < 0 ? -sum : sum);
+    }
+    else {
+        if (template->kind == SQUALE_BATCH_INSERT)
+            g_string_append (query, " ");
+        else
+            g_string_append (query, " IN (");
+
+        walk = members;
+        while (walk) {
+            SqualeJob *member = SQUALE_JOB (walk->data);
+
+            if (walk != members)
+                g_string_append (query, ", ");
+            g_string_append (query, member->batch_key);
+            walk = g_list_next (walk);
+        }
+
+        if (template->kind == SQUALE_BATCH_LOOKUP)
+            g_string_append (query, ")");
+    }
+    g_string_append (query, template->tail);
+
+    batch = squale_job_new ();
+    squale_job_set_query (batch, query->str);
+    g_string_free (query, TRUE);
+
+    batch->is_batch = TRUE;
+    batch->batch_template = template;
+
+    /* The batch waited as long as its oldest member */
+    walk = members;
+    while (walk) {
+        SqualeJob *member = SQUALE_JOB (walk->data);
+
+        if (timercmp (&(member->creation_ts), &(batch->creation_ts), <))
+            batch->creation_ts = member->creation_ts;
+        squale_job_add_follower (batch, member);
+        walk = g_list_next (walk);
+    }
+
+    squale_job_set_status_if_match (batch, SQUALE_JOB_PROCESSING,
+                                    SQUALE_JOB_PENDING);
+
+    g_message (_("Merged %d jobs in batch job %p: %s"), g_list_length (members),
+               batch, batch->query);
+
+    return batch;
+}
+
+/* Give the members of a batch that could not be processed back to the
+   joblist as independent pending jobs. The joblist has to be locked. */
+void
+squale_job_dissolve_batch (SqualeJob *job)
+{
+    GList *followers = NULL, *walk = NULL;
+
+    g_return_if_fail (SQUALE_IS_JOB (job));
+    g_return_if_fail (job->is_batch);
+
+    g_mutex_lock (job->status_mutex);
+    followers = job->followers;
+    job->followers = NULL;
+    g_mutex_unlock (job->status_mutex);
+
+    walk = followers;
+    while (walk) {
+        SqualeJob *member = SQUALE_JOB (walk->data);
+        g_object_unref (member->leader);
+        member->leader = NULL;
+        g_object_unref (member);
+        walk = g_list_next (walk);
+    }
+
+    g_list_free (followers);
+}
+
 gboolean
 squale_job_set_status_if_match (SqualeJob *job, SqualeJobStatus status,
                                 SqualeJobStatus match)
 {
+    GList *followers = NULL;
+
     g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
 
     g_mutex_lock (job->status_mutex);
@@ -343,6 +1758,9 @@ squale_job_set_status_if_match (SqualeJob *job, SqualeJobStatus status,
             {
                 gchar c = 'c';
                 gettimeofday (&(job->complete_ts), NULL);
+                /* No follower can attach anymore now that we are complete */
+                followers = job->followers;
+                job->followers = NULL;
                 /* Let the main thread now we are complete */
                 write (job->control_socket[1], &c, 1);
             }
@@ -351,6 +1769,17 @@ squale_job_set_status_if_match (SqualeJob *job, SqualeJobStatus status,
                 break;
         }
         g_mutex_unlock (job->status_mutex);
+        if (followers) {
+            squale_job_complete_followers (job, followers);
+        }
+        if (status == SQUALE_JOB_COMPLETE && job->spool) {
+            /* Nobody is waiting for that result, an error is only logged */
+            if (job->error) {
+                g_warning (_("Spooled order failed and is dropped: %s (%s)"),
+                           job->query, job->error->message);
+            }
+            squale_spool_done (job->spool, job->spool_record);
+        }
         return TRUE;
     }
     else {
@@ -401,3 +1830,47 @@ squale_job_new (void)
 
     return job;
 }
+
+/* Copy of a read which is taking too long, to be run on another endpoint.
+   The joblist has to be locked as the endpoint is set on assignment. */
+SqualeJob *
+squale_job_new_hedge (SqualeJob *job)
+{
+    SqualeJob *hedge = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_JOB (job), NULL);
+    g_return_val_if_fail (job->endpoint != NULL, NULL);
+
+    hedge = squale_job_new ();
+
+    hedge->query = g_strdup (job->query);
+    hedge->read_only = job->read_only;
+    hedge->encoding = job->encoding;
+    hedge->priority = job->priority;
+    hedge->tenant = g_strdup (job->tenant);
+    hedge->deadline_ts = job->deadline_ts;
+    hedge->avoid_endpoint = g_strdup (job->endpoint);
+
+    return hedge;
+}
+
+/* Copy of a read sent to the mirror joblist, it is shed before any other
+   job and its result is discarded */
+SqualeJob *
+squale_job_new_mirror (SqualeJob *job)
+{
+    SqualeJob *mirror = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_JOB (job), NULL);
+
+    mirror = squale_job_new ();
+
+    mirror->query = g_strdup (job->query);
+    mirror->read_only = job->read_only;
+    mirror->encoding = job->encoding;
+    mirror->priority = SQUALE_PRIORITY_MAINTENANCE;
+    mirror->tenant = g_strdup (job->tenant);
+    mirror->is_mirror = TRUE;
+
+    return mirror;
+}
@@ -25,6 +25,9 @@
 #include <glib-object.h>
 #include <sys/time.h>
 
+#include "squaleresultset.h"
+#include "squalespool.h"
+
 #define SQUALE_TYPE_JOB            (squale_job_get_type ())
 #define SQUALE_JOB(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), SQUALE_TYPE_JOB, SqualeJob))
 #define SQUALE_JOB_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), SQUALE_TYPE_JOB, SqualeJobClass))
@@ -34,13 +37,24 @@
 
 typedef struct _SqualeJob SqualeJob;
 typedef struct _SqualeJobClass SqualeJobClass;
-typedef struct _SqualeResultSet SqualeResultSet;
+typedef struct _SqualeBatchTemplate SqualeBatchTemplate;
 
 #define SQUALE_GLOBAL_STATS_ORDER     "squale_global_stats"
 #define SQUALE_LOCAL_STATS_ORDER      "squale_local_stats"
 #define SQUALE_SHUTDOWN_ORDER         "squale_shutdown"
 #define SQUALE_GLOBAL_SHUTDOWN_ORDER  "squale_global_shutdown"
 #define SQUALE_STARTUP_ORDER          "squale_startup"
+#define SQUALE_CURSOR_FETCH_ORDER     "squale_fetch"
+#define SQUALE_CURSOR_CLOSE_ORDER     "squale_close"
+
+/* Orders can start with a comment giving options to SQuaLe. It starts with
+   SQUALE_ORDER_HEADER_START followed by space separated key=value options
+   and ends with SQUALE_ORDER_HEADER_END. It is stripped from the query. */
+#define SQUALE_ORDER_HEADER_START     "/*squale"
+#define SQUALE_ORDER_HEADER_END       "*/"
+
+/* Queries are only fingerprinted up to that length */
+#define SQUALE_FINGERPRINT_LENGTH 1024
 
 typedef enum {
     SQUALE_JOB_NORMAL,
@@ -48,20 +62,74 @@ typedef enum {
     SQUALE_JOB_LOCAL_STATS,
     SQUALE_JOB_SHUTDOWN,
     SQUALE_JOB_GLOBAL_SHUTDOWN,
-    SQUALE_JOB_STARTUP
+    SQUALE_JOB_STARTUP,
+    SQUALE_JOB_CURSOR_FETCH,
+    SQUALE_JOB_CURSOR_CLOSE,
+    SQUALE_JOB_TRANSACTION_BEGIN,
+    SQUALE_JOB_TRANSACTION_COMMIT,
+    SQUALE_JOB_TRANSACTION_ROLLBACK
 } SqualeJobType;
 
+/* Bind parameters are sent after the order as strings starting with their
+   type character */
+typedef enum {
+    SQUALE_PARAM_NULL = 'n',
+    SQUALE_PARAM_INT = 'i',
+    SQUALE_PARAM_DOUBLE = 'd',
+    SQUALE_PARAM_STRING = 's'
+} SqualeParamType;
+
+typedef struct _SqualeJobParam SqualeJobParam;
+
+struct _SqualeJobParam
+{
+    SqualeParamType type;
+    char *value;
+};
+
 typedef enum {
     SQUALE_JOB_PENDING,
     SQUALE_JOB_PROCESSING,
     SQUALE_JOB_COMPLETE
 } SqualeJobStatus;
 
-struct _SqualeResultSet
+/* Priority classes, from the most to the least urgent */
+typedef enum {
+    SQUALE_PRIORITY_INTERACTIVE,
+    SQUALE_PRIORITY_BATCH,
+    SQUALE_PRIORITY_MAINTENANCE
+} SqualePriority;
+
+typedef enum {
+    SQUALE_BATCH_LOOKUP,
+    SQUALE_BATCH_INSERT,
+    SQUALE_BATCH_COUNTER
+} SqualeBatchKind;
+
+/* A batch template is a point lookup with a single '?' placeholder on the
+   right side of an equality, like "SELECT * FROM t WHERE id = ?". Concurrent
+   jobs matching it are merged into one "WHERE id IN (...)" query and the rows
+   are split back by the value of key_column.
+
+   Insert templates are created by the joblist for each "INSERT INTO t (...)
+   VALUES" head it sees. Single row inserts sharing it are merged into one
+   multi-row insert and each member gets one affected row. The key of the
+   members is their values tuple and the tail is empty.
+
+   Counter templates are created the same way for each
+   "UPDATE t SET c = c" head and " WHERE ..." tail. Increments of the same
+   row are summed in one update whose affected rows are copied to every
+   member. The key of the members is their signed increment. */
+struct _SqualeBatchTemplate
 {
-    char *data;
-    gulong data_size;
-    gulong allocated_memory;
+    SqualeBatchKind kind;
+
+    char *head;
+    char *tail;
+    char *key_column;
+
+    guint window;
+    guint max_size;
 };
 
 struct _SqualeJob
@@ -76,11 +144,92 @@ struct _SqualeJob
     gint control_socket[2];
 
     char *query;
+    gboolean read_only;
+
+    /* Parameterized orders: the query is a statement text with placeholders
+       and the values are bound by the worker */
+    guint nb_params;
+    GPtrArray *params;
+
+    /* How the client wants the resultset to be packed */
+    SqualeResultSetEncoding encoding;
+
+    SqualePriority priority;
+
+    /* Who the job is run for, from the order header or the client peer
+       credentials, and its start tag under the fair queue discipline */
+    char *tenant;
+    gdouble fair_tag;
+    /* Counted in the in flight jobs of its tenant on the joblist */
+    gboolean tenant_admitted;
+
+    /* Normalized query, see squale_job_get_fingerprint, and whether its
+       history puts it in the slow lane of the joblist */
+    char *fingerprint;
+    gboolean slow;
+
+    /* Endpoint of the worker the job was assigned to. A hedge is a copy of
+       a slow read which must run on another endpoint than the original */
+    char *endpoint;
+    char *avoid_endpoint;
+
+    /* A read given back after its connection died is not assigned again
+       before retry_ts */
+    guint nb_retries;
+    struct timeval retry_ts;
+
+    /* Jobs with the same affinity key prefer the same worker */
+    char *affinity;
+    guint affinity_hash;
+
+    /* Shadow traffic: a sampled read keeps a ref to its copy sent to the
+       mirror joblist until it is detached, the copy keeps a ref to the read
+       until both have been compared. Only touched from the main loop */
+    SqualeJob *mirror;
+    SqualeJob *mirror_of;
+    struct _SqualeJobList *mirror_source;
+    gboolean is_mirror;
+
     SqualeResultSet *resultset;
     GError *error;
     GError *warning;
     gint32 affected_rows;
 
+    /* Single-flight coalescing: a follower is never queued, it waits for its
+       leader and gets completed with a copy of the leader's result */
+    SqualeJob *leader;
+    GList *followers;
+
+    /* Point lookup batching: members keep the template and their key, the
+       merged job is flagged as a batch and has the members as followers */
+    SqualeBatchTemplate *batch_template;
+    char *batch_key;
+    gboolean is_batch;
+
+    /* Server side cursors: an order with cursor_rows set opens a cursor and
+       gets its first page. The worker then stays pinned to the client
+       session, fetch and close orders are routed to it with the session
+       number. Orders between BEGIN and COMMIT or ROLLBACK are pinned the
+       same way. session_open tells the client if the cursor or transaction
+       survived the job */
+    guint cursor_rows;
+    struct _SqualeWorker *pinned_worker;
+    guint session;
+    gboolean session_open;
+    gboolean in_transaction;
+
+    /* The client only wants an ack once the order is in the joblist spool.
+       Jobs drained from the spool keep a ref to it to mark their record as
+       done */
+    gboolean no_reply;
+    SqualeSpool *spool;
+    gulong spool_record;
+
+    /* The client gives up on the job after deadline_ts, a job still pending
+       then is completed with an error and a running one is cancelled. Not
+       set when the client has no deadline */
+    struct timeval deadline_ts;
+
     struct timeval creation_ts;
     struct timeval assign_ts;
     struct timeval complete_ts;
@@ -94,11 +243,18 @@ struct _SqualeJobClass
 GType squale_job_get_type (void);
 
 SqualeJob *squale_job_new (void);
+SqualeJob *squale_job_new_hedge (SqualeJob *job);
+SqualeJob *squale_job_new_mirror (SqualeJob *job);
 
 gint32 squale_job_get_assignation_delay (SqualeJob *job);
 gint32 squale_job_get_processing_time (SqualeJob *job);
+gint32 squale_job_get_time_left (SqualeJob *job);
 
 gboolean squale_job_set_query (SqualeJob *job, const char *query);
+gboolean squale_job_add_param (SqualeJob *job, const char *param,
+                               GError **error);
+
+gboolean squale_job_needs_worker (SqualeJob *job);
 
 gboolean squale_job_set_status_if_match (SqualeJob *job, SqualeJobStatus status,
                                          SqualeJobStatus match);
@@ -108,4 +264,24 @@ gboolean squale_job_complete_from_hashtable (SqualeJob *job, GHashTable *hash);
 gboolean squale_job_set_error (SqualeJob *job, GError *error);
 gboolean squale_job_set_warning (SqualeJob *job, GError *warning);
 
+gboolean squale_job_add_follower (SqualeJob *job, SqualeJob *follower);
+gboolean squale_job_remove_follower (SqualeJob *job, SqualeJob *follower);
+SqualeJob *squale_job_promote_follower (SqualeJob *job);
+
+SqualeBatchTemplate *squale_insert_template_new (const char *head);
+SqualeBatchTemplate *squale_counter_template_new (const char *head,
+                                                  const char *tail);
+SqualeBatchTemplate *squale_batch_template_new (const char *query,
+                                                const char *key_column,
+                                                GError **error);
+void squale_batch_template_free (SqualeBatchTemplate *template);
+
+gboolean squale_job_match_batch_template (SqualeJob *job,
+                                          SqualeBatchTemplate *template);
+char *squale_job_match_insert (SqualeJob *job);
+char *squale_job_match_counter (SqualeJob *job, char **tail);
+const char *squale_job_get_fingerprint (SqualeJob *job);
+SqualeJob *squale_job_new_batch (SqualeBatchTemplate *template, GList *members);
+void squale_job_dissolve_batch (SqualeJob *job);
+
 #endif /* __SQUALE_JOB_H__ */
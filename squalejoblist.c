@@ -25,6 +25,9 @@
 
 #include "squalejoblist.h"
 #include "squale-i18n.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #ifdef HAVE_DMALLOC
 #include <dmalloc.h>
@@ -41,13 +44,25 @@ enum
 static GObjectClass *parent_class = NULL;
 static guint joblist_signals[LAST_SIGNAL] = { 0 };
 
+/* Threads syncing the spools of all joblists */
+static GThreadPool *sync_pool = NULL;
+
+typedef struct
+{
+    SqualeJobList *joblist;
+    SqualeSpool *spool;
+    GList *waiting;
+    gboolean synced;
+    GError *error;
+} SqualeJobListSync;
+
 /* ============================================================= */
 /*                                                               */
 /*                       Private Methods                         */
 /*                                                               */
 /* ============================================================= */
 
-static GQuark
+GQuark
 squale_joblist_error_quark (void)
 {
     static GQuark quark = 0;
@@ -56,535 +71,2637 @@ squale_joblist_error_quark (void)
     return quark;
 }
 
-/* =========================================== */
-/*                                             */
-/*              Init & Class init              */
-/*                                             */
-/* =========================================== */
+static gboolean squale_joblist_sync_spool (gpointer data);
 
-static void
-squale_joblist_dispose (GObject *object)
+/* Back in the main loop once the spool has been synced, ack the orders
+   which were waiting for it and start syncing those received meanwhile */
+static gboolean
+squale_joblist_spool_synced (gpointer data)
 {
-    GList *workers = NULL, *jobs = NULL;
-    SqualeJobList *joblist = NULL;
-
-    joblist = SQUALE_JOBLIST (object);
-
-    squale_joblist_clear (joblist);
+    SqualeJobListSync *sync = data;
+    SqualeJobList *joblist = sync->joblist;
+    GList *walk = NULL;
 
-    if (joblist->list_mutex) {
-        g_mutex_free (joblist->list_mutex);
-        joblist->list_mutex = NULL;
+    if (!sync->synced) {
+        g_warning (_("Joblist %s: %s"), joblist->name, sync->error->message);
     }
 
-    workers = joblist->workers;
+    for (walk = sync->waiting; walk; walk = g_list_next (walk)) {
+        SqualeJob *job = SQUALE_JOB (walk->data);
 
-    while (workers) {
-        SqualeWorker *worker = SQUALE_WORKER (workers->data);
-        if (SQUALE_IS_WORKER (worker)) {
-            g_object_unref (worker);
+        if (sync->synced) {
+            job->affected_rows = 0;
         }
-        workers = g_list_next (workers);
-    }
-
-    if (joblist->workers) {
-        g_list_free (joblist->workers);
-        joblist->workers = NULL;
-    }
-
-    jobs = joblist->jobs;
-
-    while (jobs) {
-        SqualeJob *job = SQUALE_JOB (jobs->data);
-        if (SQUALE_IS_JOB (job)) {
-            g_object_unref (job);
+        else {
+            squale_job_set_error (job, g_error_copy (sync->error));
         }
-        jobs = g_list_next (jobs);
+        squale_job_set_status_if_match (job, SQUALE_JOB_COMPLETE,
+                                        SQUALE_JOB_PENDING);
+        g_object_unref (job);
     }
 
-    if (joblist->jobs) {
-        g_list_free (joblist->jobs);
-        joblist->jobs = NULL;
-    }
+    g_list_free (sync->waiting);
 
-    if (joblist->cond) {
-        g_cond_free (joblist->cond);
-        joblist->cond = NULL;
-    }
+    if (sync->error)
+        g_error_free (sync->error);
 
-    if (joblist->name) {
-        g_free (joblist->name);
-        joblist->name = NULL;
-    }
+    joblist->spool_syncing = FALSE;
 
-    if (joblist->backend) {
-        g_free (joblist->backend);
-        joblist->backend = NULL;
+    if (joblist->spool_waiting && !joblist->spool_sync_id) {
+        joblist->spool_sync_id = g_idle_add (squale_joblist_sync_spool, joblist);
     }
 
-    if (G_OBJECT_CLASS (parent_class)->dispose)
-        G_OBJECT_CLASS (parent_class)->dispose (object);
-}
+    /* Wake up the workers to drain what we just synced */
+    g_mutex_lock (joblist->list_mutex);
+    g_cond_broadcast (joblist->cond);
+    g_mutex_unlock (joblist->list_mutex);
 
-static void
-squale_joblist_init (SqualeJobList *joblist)
-{
-    joblist->name = NULL;
-    joblist->backend = NULL;
-    joblist->list_mutex = g_mutex_new ();
-    joblist->cond = g_cond_new ();
-    joblist->jobs = NULL;
-    joblist->workers = NULL;
-    joblist->max_pending_warn = 0;
-    joblist->max_pending_block = 0;
-    joblist->assign_total_time = 0;
-    joblist->nb_assign = 0;
-    joblist->process_total_time = 0;
-    joblist->nb_process = 0;
-    joblist->nb_errors = 0;
-    joblist->status = SQUALE_JOBLIST_OPENED;
-    gettimeofday (&(joblist->startup_ts), NULL);
+    squale_spool_unref (sync->spool);
+    g_object_unref (joblist);
+    g_free (sync);
+
+    return FALSE;
 }
 
+/* Runs in the sync pool, a disk flush would stall every client if it was
+   done from the main loop */
 static void
-squale_joblist_class_init (SqualeJobListClass *klass)
+squale_joblist_sync_func (gpointer data, gpointer user_data)
 {
-    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
-
-    parent_class = g_type_class_peek_parent (klass);
+    SqualeJobListSync *sync = data;
 
-    gobject_class->dispose = squale_joblist_dispose;
+    sync->synced = squale_spool_sync (sync->spool, &(sync->error));
 
-    joblist_signals[SHUTDOWN] =
-            g_signal_new ("shutdown",
-                          G_TYPE_FROM_CLASS (klass),
-                          G_SIGNAL_RUN_FIRST,
-                          G_STRUCT_OFFSET (SqualeJobListClass, shutdown),
-                          NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
-    joblist_signals[STARTUP] =
-            g_signal_new ("startup",
-                          G_TYPE_FROM_CLASS (klass),
-                          G_SIGNAL_RUN_FIRST,
-                          G_STRUCT_OFFSET (SqualeJobListClass, startup),
-                          NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
-    joblist_signals[STATS] =
-            g_signal_new ("stats",
-                          G_TYPE_FROM_CLASS (klass),
-                          G_SIGNAL_RUN_FIRST,
-                          G_STRUCT_OFFSET (SqualeJobListClass, stats),
-                          NULL, NULL, g_cclosure_marshal_VOID__POINTER, G_TYPE_NONE,
-                          1, G_TYPE_POINTER);
+    g_idle_add (squale_joblist_spool_synced, sync);
 }
 
-/* ============================================================= */
-/*                                                               */
-/*                       Public Methods                          */
-/*                                                               */
-/* ============================================================= */
-
-gboolean
-squale_joblist_set_status (SqualeJobList *joblist, SqualeJobListStatus status)
+/* Idle callback handing the orders appended to the spool since the last
+   sync to the sync pool. Only one sync runs at a time for a joblist, the
+   orders received meanwhile wait for the next one. */
+static gboolean
+squale_joblist_sync_spool (gpointer data)
 {
-    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
+    SqualeJobList *joblist = SQUALE_JOBLIST (data);
+    SqualeJobListSync *sync = NULL;
 
-    if (joblist->status == SQUALE_JOBLIST_CLOSED &&
-        status == SQUALE_JOBLIST_OPENED) {
-        /* Resetting some stats */
-        gettimeofday (&(joblist->startup_ts), NULL);
-        joblist->nb_process = joblist->nb_assign = joblist->nb_errors = 0;
-        joblist->assign_total_time = joblist->process_total_time = 0;
+    joblist->spool_sync_id = 0;
+
+    if (joblist->spool_syncing || !joblist->spool_waiting)
+        return FALSE;
+
+    if (!sync_pool) {
+        sync_pool = g_thread_pool_new (squale_joblist_sync_func, NULL,
+                                       SQUALE_JOBLIST_SYNC_THREADS, FALSE,
+                                       NULL);
     }
 
-    joblist->status = status;
+    sync = g_new0 (SqualeJobListSync, 1);
+    sync->joblist = g_object_ref (joblist);
+    sync->spool = squale_spool_ref (joblist->spool);
+    sync->waiting = joblist->spool_waiting;
+    joblist->spool_waiting = NULL;
+    joblist->spool_syncing = TRUE;
 
-    return TRUE;
+    g_thread_pool_push (sync_pool, sync, NULL);
+
+    return FALSE;
 }
 
-gboolean
-squale_joblist_get_stats (SqualeJobList *joblist, GHashTable *hash)
+/* Turn the next order of the spool into a job owned by the worker. The
+   joblist has to be locked. */
+static SqualeJob *
+squale_joblist_drain_spool (SqualeJobList *joblist)
 {
-    GList *jobs = NULL, *workers = NULL;
-    guint pending_jobs = 0, nb_jobs = 0, nb_workers = 0;
-    struct timeval current_time;
+    SqualeJob *job = NULL;
+    char *order = NULL;
+    gulong record = 0;
 
-    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
-    g_return_val_if_fail (hash != NULL, FALSE);
+    if (!squale_spool_next (joblist->spool, &order, &record))
+        return NULL;
 
-    g_message (_("Generating local joblist stats for joblist %s"), joblist->name);
+    job = squale_job_new ();
+    squale_job_set_query (job, order);
+    job->spool = squale_spool_ref (joblist->spool);
+    job->spool_record = record;
 
-    g_mutex_lock (joblist->list_mutex);
+    g_free (order);
 
-    nb_jobs = g_list_length (joblist->jobs);
+    squale_job_set_status_if_match (job, SQUALE_JOB_PROCESSING,
+                                    SQUALE_JOB_PENDING);
+
+    return job;
+}
+
+/* Look for an identical read-only job which has not completed yet and attach
+   the new job to it as a follower. The joblist has to be locked. */
+static gboolean
+squale_joblist_coalesce_job (SqualeJobList *joblist, SqualeJob *job)
+{
+    GList *jobs = NULL;
+
+    if (!joblist->coalesce_reads || !job->read_only || !job->query ||
+        job->nb_params || job->cursor_rows || job->followers || job->leader ||
+        job->avoid_endpoint || job->is_mirror || job->pinned_worker)
+        return FALSE;
 
     jobs = joblist->jobs;
 
     while (jobs) {
-        SqualeJob *job = SQUALE_JOB (jobs->data);
-        if (job->status == SQUALE_JOB_PENDING)
-            pending_jobs++;
+        SqualeJob *leader = SQUALE_JOB (jobs->data);
+
+        if (SQUALE_IS_JOB (leader) && leader != job && leader->read_only &&
+            !leader->nb_params && !leader->cursor_rows && leader->encoding == job->encoding &&
+            leader->status != SQUALE_JOB_COMPLETE &&
+            !leader->avoid_endpoint && !leader->is_mirror &&
+            !leader->pinned_worker && leader->priority <= job->priority &&
+            !strcmp (leader->query, job->query)) {
+            if (squale_job_add_follower (leader, job)) {
+                g_message (_("Coalescing job %p with job %p in joblist %s"), job,
+                           leader, joblist->name);
+                joblist->nb_coalesced++;
+                return TRUE;
+            }
+        }
+
         jobs = g_list_next (jobs);
     }
 
-    g_mutex_unlock (joblist->list_mutex);
+    return FALSE;
+}
 
-    workers = joblist->workers;
+/* Collect the pending jobs sharing that template and merge them in a batch
+   job. Returns NULL if the batch is held to give other lookups a chance to
+   join, the oldest member if it is alone or the new batch job. The joblist
+   has to be locked. */
+static SqualeJob *
+squale_joblist_build_batch (SqualeJobList *joblist,
+                            SqualeBatchTemplate *template, struct timeval *now)
+{
+    SqualeJob *job = NULL, *batch = NULL;
+    GList *members = NULL, *jobs = NULL;
+    struct timeval deadline;
+    guint nb_members = 0;
 
-    while (workers) {
-        SqualeWorker *worker = SQUALE_WORKER (workers->data);
+    jobs = joblist->jobs;
 
-        if (SQUALE_IS_WORKER (worker)) {
-            nb_workers++;
-            g_hash_table_insert (hash,
-                                 g_strdup_printf ("%s_%d_%s", _("worker"), nb_workers,
-                                                  _("reconnections")),
-                                 g_strdup_printf ("%lu", worker->nb_db_conn_cycles));
-            g_hash_table_insert (hash,
-                                 g_strdup_printf ("%s_%d_%s", _("worker"), nb_workers, _("errors")),
-                                 g_strdup_printf ("%lu", worker->nb_errors));
-            g_hash_table_insert (hash,
-                                 g_strdup_printf ("%s_%d_%s", _("worker"), nb_workers,
-                                                  _("processed_jobs")),
-                                 g_strdup_printf ("%lu", worker->nb_jobs_processed));
-            g_hash_table_insert (hash,
-                                 g_strdup_printf ("%s_%d_%s", _("worker"), nb_workers, _("status")),
-                                 squale_worker_get_status (worker));
+    while (jobs && nb_members < template->max_size) {
+        SqualeJob *member = SQUALE_JOB (jobs->data);
+
+        /* Retried members back off on their own */
+        if (SQUALE_IS_JOB (member) && member->batch_template == template &&
+            member->status == SQUALE_JOB_PENDING && !member->leader &&
+            (!timerisset (&(member->retry_ts)) ||
+             !timercmp (now, &(member->retry_ts), <))) {
+            members = g_list_append (members, member);
+            nb_members++;
         }
-        workers = g_list_next (workers);
-    }
 
-    g_hash_table_insert (hash, g_strdup (_("nb_workers")),
-                         g_strdup_printf ("%d", nb_workers));
+        jobs = g_list_next (jobs);
+    }
 
-    g_hash_table_insert (hash, g_strdup (_("pending_jobs")),
-                         g_strdup_printf ("%d", pending_jobs));
-    g_hash_table_insert (hash, g_strdup (_("jobs_in_list")),
-                         g_strdup_printf ("%d", nb_jobs));
-    g_hash_table_insert (hash, g_strdup (_("processed_jobs")),
-                         g_strdup_printf ("%lu", joblist->nb_process));
-    g_hash_table_insert (hash, g_strdup (_("errors")),
-                         g_strdup_printf ("%lu", joblist->nb_errors));
-    g_hash_table_insert (hash, g_strdup (_("backend")),
-                         g_strdup (joblist->backend));
+    if (!members)
+        return NULL;
 
-    if (joblist->nb_assign) {
-        g_hash_table_insert (hash, g_strdup (_("avg_assign_delay (ms)")),
-                             g_strdup_printf ("%lu",
-                                              joblist->assign_total_time / joblist->nb_assign));
-    }
-    else {
-        g_hash_table_insert (hash, g_strdup (_("avg_assign_delay (ms)")), g_strdup ("0"));
+    /* The oldest member waits at most the template window */
+    job = SQUALE_JOB (members->data);
+    deadline.tv_sec = job->creation_ts.tv_sec + template->window / 1000;
+    deadline.tv_usec = job->creation_ts.tv_usec + (template->window % 1000) * 1000;
+    if (deadline.tv_usec >= 1000000) {
+        deadline.tv_sec++;
+        deadline.tv_usec -= 1000000;
     }
-    if (joblist->nb_process) {
-        g_hash_table_insert (hash, g_strdup (_("avg_process_time (ms)")),
-                             g_strdup_printf ("%lu",
-                                              joblist->process_total_time / joblist->nb_process));
+
+    if (nb_members < template->max_size && timercmp (now, &deadline, <)) {
+        if (!timerisset (&(joblist->batch_wakeup_ts)) ||
+            timercmp (&deadline, &(joblist->batch_wakeup_ts), <)) {
+            joblist->batch_wakeup_ts = deadline;
+        }
+        g_list_free (members);
+        return NULL;
     }
-    else {
-        g_hash_table_insert (hash, g_strdup (_("avg_process_time (ms)")),
-                             g_strdup ("0"));
+
+    if (nb_members == 1) {
+        g_list_free (members);
+        return job;
     }
 
-    /* If the main loop wants to hook up some more stats */
-    g_signal_emit (joblist, joblist_signals[STATS], 0, hash, NULL);
+    batch = squale_job_new_batch (template, members);
+    squale_resultset_set_budget (batch->resultset, &(joblist->memory_budget));
 
-    /* Calculating uptime */
-    gettimeofday (&(current_time), NULL);
+    joblist->nb_batches++;
+    joblist->nb_batched += nb_members;
 
-    g_hash_table_insert (hash, g_strdup (_("uptime (s)")),
-                         g_strdup_printf ("%lu",
-                                          current_time.tv_sec - joblist->startup_ts.tv_sec));
+    g_list_free (members);
 
-    return TRUE;
+    return batch;
 }
 
-void
-squale_joblist_startup (SqualeJobList *joblist)
+/* Check if a job of a lower priority class can take one more worker
+   without eating into those reserved for interactive jobs. The joblist has
+   to be locked. */
+static gboolean
+squale_joblist_has_spare_worker (SqualeJobList *joblist)
 {
-    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+    GList *jobs = NULL;
+    guint nb_workers = 0, nb_busy = 0;
 
-    g_signal_emit (joblist, joblist_signals[STARTUP], 0, NULL);
-}
+    if (!joblist->reserved_workers)
+        return TRUE;
 
-void
-squale_joblist_shutdown (SqualeJobList *joblist)
-{
-    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+    nb_workers = g_list_length (joblist->workers);
+    if (nb_workers <= joblist->reserved_workers)
+        return FALSE;
 
-    g_signal_emit (joblist, joblist_signals[SHUTDOWN], 0, NULL);
+    for (jobs = joblist->jobs; jobs; jobs = g_list_next (jobs)) {
+        SqualeJob *job = SQUALE_JOB (jobs->data);
+
+        if (job->status == SQUALE_JOB_PROCESSING &&
+            job->priority > SQUALE_PRIORITY_INTERACTIVE)
+            nb_busy++;
+    }
+
+    return nb_busy < nb_workers - joblist->reserved_workers;
 }
 
-char *
-squale_joblist_get_name (SqualeJobList *joblist)
+/* CoDel control law: the next drop is due interval / sqrt (count) ms after
+   this one, so that drops get closer while the queue keeps standing */
+static void
+squale_joblist_codel_schedule_drop (SqualeJobList *joblist,
+                                    struct timeval *now)
 {
-    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), NULL);
+    guint root = 1, delay;
 
-    if (joblist->name) {
-        return g_strdup (joblist->name);
-    }
-    else {
-        return NULL;
+    while ((root + 1) * (root + 1) <= joblist->codel_count)
+        root++;
+
+    delay = MAX (joblist->codel_interval / root, 1);
+
+    joblist->codel_drop_ts.tv_sec = now->tv_sec + delay / 1000;
+    joblist->codel_drop_ts.tv_usec = now->tv_usec + (delay % 1000) * 1000;
+    if (joblist->codel_drop_ts.tv_usec >= 1000000) {
+        joblist->codel_drop_ts.tv_sec++;
+        joblist->codel_drop_ts.tv_usec -= 1000000;
     }
 }
 
-void
-squale_joblist_set_name (SqualeJobList *joblist, const char *name)
+/* Time a job has spent in the queue in ms */
+static gint32
+squale_joblist_sojourn (SqualeJob *job, struct timeval *now)
 {
-    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
-    g_return_if_fail (name != NULL);
-
-    if (joblist->name)
-        g_free (joblist->name);
+    return (now->tv_sec - job->creation_ts.tv_sec) * 1000 +
+           (now->tv_usec - job->creation_ts.tv_usec) / 1000;
+}
 
-    joblist->name = g_strdup (name);
+/* Tells if a pending job waited longer than the CoDel target */
+static gboolean
+squale_joblist_codel_late (SqualeJobList *joblist, SqualeJob *job,
+                           struct timeval *now)
+{
+    return squale_joblist_sojourn (job, now) > (gint32) joblist->codel_target;
 }
 
-char *
-squale_joblist_get_backend (SqualeJobList *joblist)
+/* Find a late mirror copy to drop instead of a real job */
+static SqualeJob *
+squale_joblist_codel_late_mirror (SqualeJobList *joblist, struct timeval *now)
 {
+    GList *jobs = NULL;
+
+    for (jobs = joblist->jobs; jobs; jobs = g_list_next (jobs)) {
+        SqualeJob *job = SQUALE_JOB (jobs->data);
+
+        if (SQUALE_IS_JOB (job) && job->is_mirror &&
+            job->status == SQUALE_JOB_PENDING && !job->followers &&
+            squale_joblist_codel_late (joblist, job, now))
+            return job;
+    }
+
+    return NULL;
+}
+
+/* Feed CoDel with the time that job spent in the queue. At the end of each
+   interval the queue is considered standing if no job went through below
+   the target. The joblist has to be locked. */
+static void
+squale_joblist_codel_sample (SqualeJobList *joblist, SqualeJob *job,
+                             struct timeval *now)
+{
+    gint32 sojourn, elapsed;
+
+    if (!joblist->codel_target)
+        return;
+
+    sojourn = (now->tv_sec - job->creation_ts.tv_sec) * 1000 +
+              (now->tv_usec - job->creation_ts.tv_usec) / 1000;
+
+    joblist->codel_min_sojourn = MIN (joblist->codel_min_sojourn, sojourn);
+
+    /* One good job is enough to stop dropping */
+    if (joblist->codel_dropping && sojourn < joblist->codel_target) {
+        g_message (_("Joblist %s queueing delay is back under %u ms"),
+                   joblist->name, joblist->codel_target);
+        joblist->codel_dropping = FALSE;
+    }
+
+    if (!timerisset (&(joblist->codel_interval_ts)))
+        joblist->codel_interval_ts = *now;
+
+    elapsed = (now->tv_sec - joblist->codel_interval_ts.tv_sec) * 1000 +
+              (now->tv_usec - joblist->codel_interval_ts.tv_usec) / 1000;
+
+    if (elapsed >= (gint32) joblist->codel_interval) {
+        if (!joblist->codel_dropping &&
+            joblist->codel_min_sojourn > (gint32) joblist->codel_target) {
+            g_warning (_("Joblist %s has had a standing queue of at least %d ms " \
+          "for %d ms, dropping late jobs"), joblist->name,
+                       joblist->codel_min_sojourn, elapsed);
+            joblist->codel_dropping = TRUE;
+            /* First drop right away */
+            joblist->codel_count = 1;
+            joblist->codel_drop_ts = *now;
+        }
+        joblist->codel_min_sojourn = G_MAXINT32;
+        joblist->codel_interval_ts = *now;
+    }
+}
+
+/* Rendezvous hashing: the worker of a key is the live one scoring best for
+   it, so that only the keys of a worker going away move. The joblist has to
+   be locked. */
+static SqualeWorker *
+squale_joblist_affinity_worker (SqualeJobList *joblist, SqualeJob *job)
+{
+    SqualeWorker *best = NULL;
+    GList *workers = NULL;
+    guint32 best_score = 0;
+
+    for (workers = joblist->workers; workers; workers = g_list_next (workers)) {
+        SqualeWorker *worker = SQUALE_WORKER (workers->data);
+        guint32 score;
+
+        if (!squale_worker_is_running (worker) || worker->pinned)
+            continue;
+
+        /* Mix the key with the worker, murmur3 finalizer */
+        score = job->affinity_hash ^ GPOINTER_TO_UINT (worker);
+        score ^= score >> 16;
+        score *= 0x85ebca6b;
+        score ^= score >> 13;
+        score *= 0xc2b2ae35;
+        score ^= score >> 16;
+
+        if (!best || score > best_score) {
+            best = worker;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+/* Both a read and its mirror are complete. A mirror which did not run
+   because its joblist was overloaded is not compared. */
+static void
+squale_joblist_compare_mirror (SqualeJobList *joblist, SqualeJob *job,
+                               SqualeJob *mirror)
+{
+    if (mirror->error &&
+        mirror->error->domain == squale_joblist_error_quark ()) {
+        joblist->nb_mirror_dropped++;
+        return;
+    }
+
+    joblist->nb_mirror_compared++;
+    joblist->mirror_primary_time += MAX (squale_job_get_processing_time (job), 0);
+    joblist->mirror_time += MAX (squale_job_get_processing_time (mirror), 0);
+
+    if (mirror->error && !job->error) {
+        g_message (_("Mirror %p of job %p in joblist %s failed: %s"), mirror,
+                   job, joblist->name, mirror->error->message);
+        joblist->nb_mirror_errors++;
+    }
+    else if (!mirror->error && job->error) {
+        joblist->nb_mirror_fixes++;
+    }
+}
+
+typedef struct
+{
+    SqualeJobList *target;
+    SqualeJob *mirror;
+} SqualeMirrorWatch;
+
+static void
+squale_joblist_mirror_watch_free (gpointer data)
+{
+    SqualeMirrorWatch *watch = data;
+
+    g_object_unref (watch->target);
+    g_object_unref (watch->mirror);
+    g_free (watch);
+}
+
+/* Nobody waits for the result of a mirror, we complete it here */
+static gboolean
+squale_joblist_mirror_io_watch (GIOChannel *source, GIOCondition condition,
+                                gpointer data)
+{
+    SqualeMirrorWatch *watch = data;
+    SqualeJob *mirror = watch->mirror, *job = NULL;
+    gchar c;
+
+    read (mirror->control_socket[0], &c, 1);
+
+    if (mirror->status != SQUALE_JOB_COMPLETE)
+        return TRUE;
+
+    if (mirror->mirror_source->nb_mirrors_running)
+        mirror->mirror_source->nb_mirrors_running--;
+
+    /* A read still attached to its mirror compares when it is detached */
+    job = mirror->mirror_of;
+    if (job && job->mirror != mirror) {
+        if (job->status == SQUALE_JOB_COMPLETE) {
+            squale_joblist_compare_mirror (mirror->mirror_source, job, mirror);
+        }
+        mirror->mirror_of = NULL;
+        g_object_unref (job);
+    }
+
+    squale_joblist_remove_job (watch->target, mirror);
+
+    return FALSE;
+}
+
+/* Tells why the mirror joblist can't take a copy right now, a copy would
+   only be declined or shed there and the read should not pay for it */
+static const char *
+squale_joblist_mirror_saturation (SqualeJobList *joblist, SqualeJobList *target)
+{
+    const char *reason = NULL;
+
+    if (target->status == SQUALE_JOBLIST_CLOSED)
+        return _("it is closed");
+
+    if (squale_memory_budget_exhausted (&(target->memory_budget)) ||
+        squale_memory_budget_exhausted (squale_memory_budget_get_global ()))
+        return _("its memory budget is exhausted");
+
+    g_mutex_lock (target->list_mutex);
+
+    if (joblist->nb_mirrors_running >= g_list_length (target->workers))
+        reason = _("all its workers are running copies");
+    /* Running jobs count too, that is close enough and cheaper than
+       finding the pending ones */
+    else if (target->max_pending_block &&
+             g_list_length (target->jobs) >= target->max_pending_block)
+        reason = _("it has too many pending jobs");
+    else if (target->codel_dropping)
+        reason = _("its queue is standing");
+    else if (target->adaptive_concurrency && target->concurrency_limit >= 1 &&
+             target->nb_in_flight >= (guint) target->concurrency_limit)
+        reason = _("its concurrency limit is reached");
+
+    g_mutex_unlock (target->list_mutex);
+
+    return reason;
+}
+
+/* Account for a job being handed to a worker. The joblist has to be
+   locked. */
+static void
+squale_joblist_take_job (SqualeJobList *joblist, SqualeWorker *worker,
+                         SqualeJob *job, struct timeval *now)
+{
+    squale_joblist_codel_sample (joblist, job, now);
+
+    worker->in_flight = TRUE;
+    joblist->nb_in_flight++;
+
+    if (job->slow) {
+        worker->slow_lane = TRUE;
+        joblist->nb_slow_running++;
+    }
+
+    if (job->read_only && worker->endpoint) {
+        g_free (job->endpoint);
+        job->endpoint = g_strdup (worker->endpoint);
+    }
+
+    if (job->affinity) {
+        if (squale_joblist_affinity_worker (joblist, job) == worker)
+            joblist->nb_affinity_hits++;
+        else
+            joblist->nb_affinity_misses++;
+    }
+}
+
+static gint
+squale_joblist_compare_latencies (gconstpointer a, gconstpointer b)
+{
+    return *(const gint32 *) a - *(const gint32 *) b;
+}
+
+static void
+squale_joblist_tenant_limit_stats (gpointer key, gpointer value, gpointer data)
+{
+    SqualeTenantLimit *limit = value;
+    GHashTable *hash = data;
+
+    if (limit->rate) {
+        g_hash_table_insert (hash, g_strdup_printf (_("tenant_tokens:%s"),
+                                                    (char *) key),
+                             g_strdup_printf ("%.1f", limit->tokens));
+    }
+    if (limit->max_in_flight) {
+        g_hash_table_insert (hash, g_strdup_printf (_("tenant_in_flight:%s"),
+                                                    (char *) key),
+                             g_strdup_printf ("%u", limit->in_flight));
+    }
+}
+
+static gboolean
+squale_joblist_tenant_limit_is_idle (gpointer key, gpointer value,
+                                     gpointer data)
+{
+    SqualeTenantLimit *limit = value;
+
+    return !limit->configured && !limit->in_flight &&
+           limit->tokens >= MAX (limit->rate, 1);
+}
+
+/* Processing time of a query fingerprint and when it was last sampled,
+   counted in samples of the joblist */
+typedef struct
+{
+    gdouble cost;
+    gulong sampled;
+} SqualeFingerprintCost;
+
+/* Fingerprints not sampled during the last half history are forgotten when
+   the history is full, at least half of it is freed that way */
+static gboolean
+squale_joblist_fingerprint_is_stale (gpointer key, gpointer value,
+                                     gpointer user_data)
+{
+    SqualeFingerprintCost *cost = value;
+    gulong clock = *((gulong *) user_data);
+
+    return clock - cost->sampled >= SQUALE_FINGERPRINT_HISTORY / 2;
+}
+
+static gboolean
+squale_joblist_true_func (gpointer key, gpointer value, gpointer user_data)
+{
+    return TRUE;
+}
+
+/* Add the tokens earned since the last refill */
+static void
+squale_joblist_refill_tenant_limit (SqualeTenantLimit *limit,
+                                    const struct timeval *now)
+{
+    gdouble elapsed;
+
+    if (!limit->rate)
+        return;
+
+    elapsed = (now->tv_sec - limit->refill_ts.tv_sec) +
+              (now->tv_usec - limit->refill_ts.tv_usec) / 1000000.0;
+    if (elapsed > 0) {
+        limit->tokens = MIN (MAX (limit->rate, 1),
+                             limit->tokens + elapsed * limit->rate);
+    }
+    limit->refill_ts = *now;
+}
+
+/* Find the limits of a tenant. Tenants which are not configured get a copy
+   of the default limits if there are any, those are forgotten once idle
+   when too many tenants are known. */
+static SqualeTenantLimit *
+squale_joblist_get_tenant_limit (SqualeJobList *joblist, const char *tenant,
+                                 gboolean create)
+{
+    SqualeTenantLimit *limit = NULL;
+
+    limit = g_hash_table_lookup (joblist->tenant_limits, tenant);
+    if (limit || !create)
+        return limit;
+
+    if (!joblist->default_tenant_limit.rate &&
+        !joblist->default_tenant_limit.max_in_flight)
+        return NULL;
+
+    if (g_hash_table_size (joblist->tenant_limits) >= SQUALE_QUEUE_MAX_TENANTS) {
+        g_hash_table_foreach_remove (joblist->tenant_limits,
+                                     squale_joblist_tenant_limit_is_idle, NULL);
+    }
+
+    limit = g_new0 (SqualeTenantLimit, 1);
+    limit->rate = joblist->default_tenant_limit.rate;
+    limit->tokens = MAX (limit->rate, 1);
+    limit->max_in_flight = joblist->default_tenant_limit.max_in_flight;
+    gettimeofday (&(limit->refill_ts), NULL);
+    g_hash_table_insert (joblist->tenant_limits, g_strdup (tenant), limit);
+
+    return limit;
+}
+
+/* Limits set from the configuration, "*" sets the default ones */
+static SqualeTenantLimit *
+squale_joblist_configure_tenant_limit (SqualeJobList *joblist,
+                                       const char *tenant)
+{
+    SqualeTenantLimit *limit = NULL;
+
+    if (!strcmp (tenant, "*"))
+        return &(joblist->default_tenant_limit);
+
+    limit = g_hash_table_lookup (joblist->tenant_limits, tenant);
+    if (!limit) {
+        limit = g_new0 (SqualeTenantLimit, 1);
+        gettimeofday (&(limit->refill_ts), NULL);
+        g_hash_table_insert (joblist->tenant_limits, g_strdup (tenant), limit);
+    }
+    limit->configured = TRUE;
+
+    return limit;
+}
+
+/* =========================================== */
+/*                                             */
+/*              Init & Class init              */
+/*                                             */
+/* =========================================== */
+
+static void
+squale_joblist_dispose (GObject *object)
+{
+    GList *workers = NULL, *jobs = NULL;
+    SqualeJobList *joblist = NULL;
+
+    joblist = SQUALE_JOBLIST (object);
+
+    squale_joblist_clear (joblist);
+
+    if (joblist->list_mutex) {
+        g_mutex_free (joblist->list_mutex);
+        joblist->list_mutex = NULL;
+    }
+
+    workers = joblist->workers;
+
+    while (workers) {
+        SqualeWorker *worker = SQUALE_WORKER (workers->data);
+        if (SQUALE_IS_WORKER (worker)) {
+            g_object_unref (worker);
+        }
+        workers = g_list_next (workers);
+    }
+
+    if (joblist->workers) {
+        g_list_free (joblist->workers);
+        joblist->workers = NULL;
+    }
+
+    jobs = joblist->jobs;
+
+    while (jobs) {
+        SqualeJob *job = SQUALE_JOB (jobs->data);
+        if (SQUALE_IS_JOB (job)) {
+            g_object_unref (job);
+        }
+        jobs = g_list_next (jobs);
+    }
+
+    if (joblist->jobs) {
+        g_list_free (joblist->jobs);
+        joblist->jobs = NULL;
+    }
+
+    if (joblist->cond) {
+        g_cond_free (joblist->cond);
+        joblist->cond = NULL;
+    }
+
+    if (joblist->name) {
+        g_free (joblist->name);
+        joblist->name = NULL;
+    }
+
+    if (joblist->mirror) {
+        g_free (joblist->mirror);
+        joblist->mirror = NULL;
+    }
+
+    if (joblist->backend) {
+        g_free (joblist->backend);
+        joblist->backend = NULL;
+    }
+
+    if (joblist->batch_templates) {
+        g_list_foreach (joblist->batch_templates,
+                        (GFunc) squale_batch_template_free, NULL);
+        g_list_free (joblist->batch_templates);
+        joblist->batch_templates = NULL;
+    }
+
+    if (joblist->write_templates) {
+        g_hash_table_destroy (joblist->write_templates);
+        joblist->write_templates = NULL;
+    }
+
+    if (joblist->tenant_weights) {
+        g_hash_table_destroy (joblist->tenant_weights);
+        joblist->tenant_weights = NULL;
+    }
+
+    if (joblist->tenant_finish) {
+        g_hash_table_destroy (joblist->tenant_finish);
+        joblist->tenant_finish = NULL;
+    }
+
+    if (joblist->tenant_limits) {
+        g_hash_table_destroy (joblist->tenant_limits);
+        joblist->tenant_limits = NULL;
+    }
+
+    if (joblist->fingerprint_costs) {
+        g_hash_table_destroy (joblist->fingerprint_costs);
+        joblist->fingerprint_costs = NULL;
+    }
+
+    if (joblist->spool_sync_id) {
+        g_source_remove (joblist->spool_sync_id);
+        joblist->spool_sync_id = 0;
+    }
+
+    if (joblist->spool_waiting) {
+        g_list_foreach (joblist->spool_waiting, (GFunc) g_object_unref, NULL);
+        g_list_free (joblist->spool_waiting);
+        joblist->spool_waiting = NULL;
+    }
+
+    if (joblist->spool) {
+        squale_spool_unref (joblist->spool);
+        joblist->spool = NULL;
+    }
+
+    if (joblist->spool_path) {
+        g_free (joblist->spool_path);
+        joblist->spool_path = NULL;
+    }
+
+    if (G_OBJECT_CLASS (parent_class)->dispose)
+        G_OBJECT_CLASS (parent_class)->dispose (object);
+}
+
+static void
+squale_joblist_init (SqualeJobList *joblist)
+{
+    joblist->name = NULL;
+    joblist->backend = NULL;
+    joblist->list_mutex = g_mutex_new ();
+    joblist->cond = g_cond_new ();
+    joblist->jobs = NULL;
+    joblist->discipline = squale_queue_discipline_default ();
+    joblist->lifo_threshold = SQUALE_QUEUE_LIFO_THRESHOLD;
+    joblist->tenant_weights = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, NULL);
+    joblist->tenant_finish = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, g_free);
+    joblist->fair_virtual_time = 0;
+    joblist->tenant_limits = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, g_free);
+    memset (&(joblist->default_tenant_limit), 0, sizeof (SqualeTenantLimit));
+    joblist->fingerprint_costs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                        g_free, g_free);
+    joblist->fingerprint_clock = 0;
+    joblist->slow_threshold = 0;
+    joblist->slow_lane_workers = 0;
+    joblist->nb_slow_running = 0;
+    joblist->hedge_percent = 0;
+    joblist->hedge_tokens = 0;
+    joblist->hedge_delay = 0;
+    joblist->nb_read_latencies = 0;
+    joblist->retry_percent = SQUALE_RETRY_PERCENT;
+    joblist->retry_tokens = 0;
+    joblist->affinity_wait = SQUALE_AFFINITY_WAIT;
+    joblist->mirror = NULL;
+    joblist->mirror_percent = 0;
+    joblist->nb_mirrors_running = 0;
+    joblist->mirror_saturated = FALSE;
+    joblist->workers = NULL;
+    joblist->max_pending_warn = 0;
+    joblist->max_pending_block = 0;
+    joblist->reserved_workers = 0;
+    joblist->codel_target = 0;
+    joblist->codel_interval = SQUALE_CODEL_INTERVAL;
+    joblist->codel_min_sojourn = G_MAXINT32;
+    timerclear (&(joblist->codel_interval_ts));
+    joblist->codel_dropping = FALSE;
+    joblist->codel_count = 0;
+    timerclear (&(joblist->codel_drop_ts));
+    joblist->adaptive_concurrency = FALSE;
+    joblist->concurrency_limit = 0;
+    joblist->nb_in_flight = 0;
+    joblist->latency_baseline = 0;
+    joblist->latency_window_min = G_MAXINT64;
+    joblist->latency_average = 0;
+    joblist->nb_latency_samples = 0;
+    joblist->nb_since_decrease = 0;
+    joblist->coalesce_reads = FALSE;
+    joblist->batch_templates = NULL;
+    timerclear (&(joblist->batch_wakeup_ts));
+    joblist->insert_batch_size = 0;
+    joblist->insert_batch_linger = 1;
+    joblist->counter_batch_size = 0;
+    joblist->counter_batch_linger = 10;
+    joblist->write_templates = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                      g_free,
+                                                      (GDestroyNotify) squale_batch_template_free);
+    joblist->spill_threshold = 0;
+    joblist->nb_pinned = 0;
+    joblist->transaction_timeout = SQUALE_TRANSACTION_TIMEOUT;
+    joblist->spool_path = NULL;
+    joblist->spool_size = SQUALE_SPOOL_SIZE;
+    joblist->spool = NULL;
+    joblist->spool_waiting = NULL;
+    joblist->spool_sync_id = 0;
+    joblist->spool_syncing = FALSE;
+    memset (&(joblist->memory_budget), 0, sizeof (SqualeMemoryBudget));
+    joblist->assign_total_time = 0;
+    joblist->nb_assign = 0;
+    joblist->process_total_time = 0;
+    joblist->nb_process = 0;
+    joblist->nb_errors = 0;
+    joblist->nb_coalesced = 0;
+    joblist->nb_batches = 0;
+    joblist->nb_batched = 0;
+    joblist->nb_budget_rejections = 0;
+    joblist->nb_transaction_timeouts = 0;
+    joblist->nb_deadline_expired = 0;
+    joblist->nb_abandoned = 0;
+    joblist->nb_shed = 0;
+    joblist->nb_codel_drops = 0;
+    joblist->nb_tenant_rejections = 0;
+    joblist->nb_slow_jobs = 0;
+    joblist->nb_hedges = 0;
+    joblist->nb_hedge_wins = 0;
+    joblist->nb_retries = 0;
+    joblist->nb_affinity_hits = 0;
+    joblist->nb_affinity_misses = 0;
+    joblist->nb_mirrored = joblist->nb_mirror_dropped = 0;
+    joblist->nb_mirror_compared = 0;
+    joblist->nb_mirror_errors = joblist->nb_mirror_fixes = 0;
+    joblist->mirror_primary_time = joblist->mirror_time = 0;
+    joblist->status = SQUALE_JOBLIST_OPENED;
+    gettimeofday (&(joblist->startup_ts), NULL);
+}
+
+static void
+squale_joblist_class_init (SqualeJobListClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+    parent_class = g_type_class_peek_parent (klass);
+
+    gobject_class->dispose = squale_joblist_dispose;
+
+    joblist_signals[SHUTDOWN] =
+            g_signal_new ("shutdown",
+                          G_TYPE_FROM_CLASS (klass),
+                          G_SIGNAL_RUN_FIRST,
+                          G_STRUCT_OFFSET (SqualeJobListClass, shutdown),
+                          NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+    joblist_signals[STARTUP] =
+            g_signal_new ("startup",
+                          G_TYPE_FROM_CLASS (klass),
+                          G_SIGNAL_RUN_FIRST,
+                          G_STRUCT_OFFSET (SqualeJobListClass, startup),
+                          NULL, NULL, g_cclosure_marshal_VOID__VOID, G_TYPE_NONE, 0);
+    joblist_signals[STATS] =
+            g_signal_new ("stats",
+                          G_TYPE_FROM_CLASS (klass),
+                          G_SIGNAL_RUN_FIRST,
+                          G_STRUCT_OFFSET (SqualeJobListClass, stats),
+                          NULL, NULL, g_cclosure_marshal_VOID__POINTER, G_TYPE_NONE,
+                          1, G_TYPE_POINTER);
+}
+
+/* ============================================================= */
+/*                                                               */
+/*                       Public Methods                          */
+/*                                                               */
+/* ============================================================= */
+
+gboolean
+squale_joblist_set_status (SqualeJobList *joblist, SqualeJobListStatus status)
+{
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
+
+    if (joblist->status == SQUALE_JOBLIST_CLOSED &&
+        status == SQUALE_JOBLIST_OPENED) {
+        /* Resetting some stats */
+        gettimeofday (&(joblist->startup_ts), NULL);
+        joblist->nb_process = joblist->nb_assign = joblist->nb_errors = 0;
+        joblist->nb_coalesced = joblist->nb_batches = joblist->nb_batched = 0;
+        joblist->assign_total_time = joblist->process_total_time = 0;
+
+        g_mutex_lock (joblist->list_mutex);
+
+        joblist->nb_budget_rejections = joblist->nb_transaction_timeouts = 0;
+        joblist->nb_deadline_expired = joblist->nb_abandoned = 0;
+        joblist->nb_shed = joblist->nb_codel_drops = 0;
+        joblist->nb_tenant_rejections = joblist->nb_slow_jobs = 0;
+        joblist->nb_hedges = joblist->nb_hedge_wins = joblist->nb_retries = 0;
+        joblist->nb_affinity_hits = joblist->nb_affinity_misses = 0;
+        joblist->nb_mirrored = joblist->nb_mirror_dropped = 0;
+        joblist->nb_mirror_compared = 0;
+        joblist->nb_mirror_errors = joblist->nb_mirror_fixes = 0;
+        joblist->mirror_primary_time = joblist->mirror_time = 0;
+
+        /* The database might have changed while we were closed, what we
+           learnt about it starts again from scratch */
+        g_hash_table_foreach_remove (joblist->fingerprint_costs,
+                                     squale_joblist_true_func, NULL);
+        joblist->fingerprint_clock = 0;
+        joblist->hedge_delay = 0;
+        joblist->nb_read_latencies = 0;
+        joblist->codel_min_sojourn = G_MAXINT32;
+        timerclear (&(joblist->codel_interval_ts));
+        joblist->codel_dropping = FALSE;
+        joblist->codel_count = 0;
+        if (joblist->adaptive_concurrency)
+            joblist->concurrency_limit = g_list_length (joblist->workers);
+        joblist->latency_baseline = 0;
+        joblist->latency_window_min = G_MAXINT64;
+        joblist->latency_average = 0;
+        joblist->nb_latency_samples = 0;
+        joblist->nb_since_decrease = 0;
+
+        g_mutex_unlock (joblist->list_mutex);
+    }
+
+    joblist->status = status;
+
+    return TRUE;
+}
+
+gboolean
+squale_joblist_get_stats (SqualeJobList *joblist, GHashTable *hash)
+{
+    GList *jobs = NULL, *workers = NULL;
+    guint pending_jobs = 0, nb_jobs = 0, nb_workers = 0;
+    gulong memory_used = 0, memory_high_water = 0;
+    struct timeval current_time;
+
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
+    g_return_val_if_fail (hash != NULL, FALSE);
+
+    g_message (_("Generating local joblist stats for joblist %s"), joblist->name);
+
+    g_mutex_lock (joblist->list_mutex);
+
+    nb_jobs = g_list_length (joblist->jobs);
+
+    jobs = joblist->jobs;
+
+    while (jobs) {
+        SqualeJob *job = SQUALE_JOB (jobs->data);
+        if (job->status == SQUALE_JOB_PENDING)
+            pending_jobs++;
+        jobs = g_list_next (jobs);
+    }
+
+    g_mutex_unlock (joblist->list_mutex);
+
+    workers = joblist->workers;
+
+    while (workers) {
+        SqualeWorker *worker = SQUALE_WORKER (workers->data);
+
+        if (SQUALE_IS_WORKER (worker)) {
+            nb_workers++;
+            g_hash_table_insert (hash,
+                                 g_strdup_printf ("%s_%d_%s", _("worker"), nb_workers,
+                                                  _("reconnections")),
+                                 g_strdup_printf ("%lu", worker->nb_db_conn_cycles));
+            g_hash_table_insert (hash,
+                                 g_strdup_printf ("%s_%d_%s", _("worker"), nb_workers, _("errors")),
+                                 g_strdup_printf ("%lu", worker->nb_errors));
+            g_hash_table_insert (hash,
+                                 g_strdup_printf ("%s_%d_%s", _("worker"), nb_workers,
+                                                  _("cancellations")),
+                                 g_strdup_printf ("%lu", worker->nb_cancels));
+            g_hash_table_insert (hash,
+                                 g_strdup_printf ("%s_%d_%s", _("worker"), nb_workers,
+                                                  _("processed_jobs")),
+                                 g_strdup_printf ("%lu", worker->nb_jobs_processed));
+            g_hash_table_insert (hash,
+                                 g_strdup_printf ("%s_%d_%s", _("worker"), nb_workers, _("status")),
+                                 squale_worker_get_status (worker));
+        }
+        workers = g_list_next (workers);
+    }
+
+    g_hash_table_insert (hash, g_strdup (_("nb_workers")),
+                         g_strdup_printf ("%d", nb_workers));
+
+    g_hash_table_insert (hash, g_strdup (_("pending_jobs")),
+                         g_strdup_printf ("%d", pending_jobs));
+    g_hash_table_insert (hash, g_strdup (_("jobs_in_list")),
+                         g_strdup_printf ("%d", nb_jobs));
+    g_hash_table_insert (hash, g_strdup (_("processed_jobs")),
+                         g_strdup_printf ("%lu", joblist->nb_process));
+    g_hash_table_insert (hash, g_strdup (_("errors")),
+                         g_strdup_printf ("%lu", joblist->nb_errors));
+    g_hash_table_insert (hash, g_strdup (_("coalesced_jobs")),
+                         g_strdup_printf ("%lu", joblist->nb_coalesced));
+    g_hash_table_insert (hash, g_strdup (_("batches")),
+                         g_strdup_printf ("%lu", joblist->nb_batches));
+    g_hash_table_insert (hash, g_strdup (_("batched_jobs")),
+                         g_strdup_printf ("%lu", joblist->nb_batched));
+    g_hash_table_insert (hash, g_strdup (_("budget_rejections")),
+                         g_strdup_printf ("%lu", joblist->nb_budget_rejections));
+    g_hash_table_insert (hash, g_strdup (_("transaction_timeouts")),
+                         g_strdup_printf ("%lu", joblist->nb_transaction_timeouts));
+    g_hash_table_insert (hash, g_strdup (_("deadline_expired")),
+                         g_strdup_printf ("%lu", joblist->nb_deadline_expired));
+    g_hash_table_insert (hash, g_strdup (_("abandoned_jobs")),
+                         g_strdup_printf ("%lu", joblist->nb_abandoned));
+    g_hash_table_insert (hash, g_strdup (_("shed_jobs")),
+                         g_strdup_printf ("%lu", joblist->nb_shed));
+    g_hash_table_insert (hash, g_strdup (_("codel_drops")),
+                         g_strdup_printf ("%lu", joblist->nb_codel_drops));
+    if (joblist->slow_lane_workers) {
+        g_hash_table_insert (hash, g_strdup (_("slow_jobs")),
+                             g_strdup_printf ("%lu", joblist->nb_slow_jobs));
+        g_hash_table_insert (hash, g_strdup (_("slow_lane_running")),
+                             g_strdup_printf ("%u", joblist->nb_slow_running));
+    }
+    if (joblist->hedge_percent) {
+        g_hash_table_insert (hash, g_strdup (_("hedge_delay")),
+                             g_strdup_printf ("%u", joblist->hedge_delay));
+        g_hash_table_insert (hash, g_strdup (_("hedges")),
+                             g_strdup_printf ("%lu", joblist->nb_hedges));
+        g_hash_table_insert (hash, g_strdup (_("hedge_wins")),
+                             g_strdup_printf ("%lu", joblist->nb_hedge_wins));
+    }
+    g_hash_table_insert (hash, g_strdup (_("retries")),
+                         g_strdup_printf ("%lu", joblist->nb_retries));
+    g_hash_table_insert (hash, g_strdup (_("affinity_hits")),
+                         g_strdup_printf ("%lu", joblist->nb_affinity_hits));
+    g_hash_table_insert (hash, g_strdup (_("affinity_misses")),
+                         g_strdup_printf ("%lu", joblist->nb_affinity_misses));
+    if (joblist->mirror && joblist->mirror_percent) {
+        g_hash_table_insert (hash, g_strdup (_("mirrored")),
+                             g_strdup_printf ("%lu", joblist->nb_mirrored));
+        g_hash_table_insert (hash, g_strdup (_("mirror_dropped")),
+                             g_strdup_printf ("%lu", joblist->nb_mirror_dropped));
+        g_hash_table_insert (hash, g_strdup (_("mirror_compared")),
+                             g_strdup_printf ("%lu", joblist->nb_mirror_compared));
+        g_hash_table_insert (hash, g_strdup (_("mirror_errors")),
+                             g_strdup_printf ("%lu", joblist->nb_mirror_errors));
+        g_hash_table_insert (hash, g_strdup (_("mirror_fixes")),
+                             g_strdup_printf ("%lu", joblist->nb_mirror_fixes));
+        if (joblist->nb_mirror_compared) {
+            g_hash_table_insert (hash, g_strdup (_("mirror_primary_avg_process_time")),
+                                 g_strdup_printf ("%" G_GUINT64_FORMAT,
+                                                  joblist->mirror_primary_time /
+                                                  joblist->nb_mirror_compared));
+            g_hash_table_insert (hash, g_strdup (_("mirror_avg_process_time")),
+                                 g_strdup_printf ("%" G_GUINT64_FORMAT,
+                                                  joblist->mirror_time /
+                                                  joblist->nb_mirror_compared));
+        }
+    }
+    g_hash_table_insert (hash, g_strdup (_("tenant_rejections")),
+                         g_strdup_printf ("%lu", joblist->nb_tenant_rejections));
+    g_hash_table_foreach (joblist->tenant_limits,
+                          squale_joblist_tenant_limit_stats, hash);
+    if (joblist->adaptive_concurrency) {
+        g_hash_table_insert (hash, g_strdup (_("concurrency_limit")),
+                             g_strdup_printf ("%.1f", joblist->concurrency_limit));
+        g_hash_table_insert (hash, g_strdup (_("in_flight_jobs")),
+                             g_strdup_printf ("%u", joblist->nb_in_flight));
+    }
+    if (joblist->spool) {
+        g_hash_table_insert (hash, g_strdup (_("spool_appended")),
+                             g_strdup_printf ("%lu", joblist->spool->nb_appended));
+        g_hash_table_insert (hash, g_strdup (_("spool_drained")),
+                             g_strdup_printf ("%lu", joblist->spool->nb_drained));
+        g_hash_table_insert (hash, g_strdup (_("spool_syncs")),
+                             g_strdup_printf ("%lu", joblist->spool->nb_syncs));
+        g_hash_table_insert (hash, g_strdup (_("spool_pending_bytes")),
+                             g_strdup_printf ("%lu",
+                                              squale_spool_get_pending (joblist->spool)));
+    }
+    squale_memory_budget_get_usage (&(joblist->memory_budget), &memory_used,
+                                    &memory_high_water);
+    g_hash_table_insert (hash, g_strdup (_("memory_budget")),
+                         g_strdup_printf ("%lu", joblist->memory_budget.limit));
+    g_hash_table_insert (hash, g_strdup (_("memory_used")),
+                         g_strdup_printf ("%lu", memory_used));
+    g_hash_table_insert (hash, g_strdup (_("memory_high_water")),
+                         g_strdup_printf ("%lu", memory_high_water));
+    g_hash_table_insert (hash, g_strdup (_("backend")),
+                         g_strdup (joblist->backend));
+
+    if (joblist->nb_assign) {
+        g_hash_table_insert (hash, g_strdup (_("avg_assign_delay (ms)")),
+                             g_strdup_printf ("%lu",
+                                              joblist->assign_total_time / joblist->nb_assign));
+    }
+    else {
+        g_hash_table_insert (hash, g_strdup (_("avg_assign_delay (ms)")), g_strdup ("0"));
+    }
+    if (joblist->nb_process) {
+        g_hash_table_insert (hash, g_strdup (_("avg_process_time (ms)")),
+                             g_strdup_printf ("%lu",
+                                              joblist->process_total_time / joblist->nb_process));
+    }
+    else {
+        g_hash_table_insert (hash, g_strdup (_("avg_process_time (ms)")),
+                             g_strdup ("0"));
+    }
+
+    /* If the main loop wants to hook up some more stats */
+    g_signal_emit (joblist, joblist_signals[STATS], 0, hash, NULL);
+
+    /* Calculating uptime */
+    gettimeofday (&(current_time), NULL);
+
+    g_hash_table_insert (hash, g_strdup (_("uptime (s)")),
+                         g_strdup_printf ("%lu",
+                                          current_time.tv_sec - joblist->startup_ts.tv_sec));
+
+    return TRUE;
+}
+
+void
+squale_joblist_startup (SqualeJobList *joblist)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    g_signal_emit (joblist, joblist_signals[STARTUP], 0, NULL);
+}
+
+void
+squale_joblist_shutdown (SqualeJobList *joblist)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    g_signal_emit (joblist, joblist_signals[SHUTDOWN], 0, NULL);
+}
+
+char *
+squale_joblist_get_name (SqualeJobList *joblist)
+{
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), NULL);
+
+    if (joblist->name) {
+        return g_strdup (joblist->name);
+    }
+    else {
+        return NULL;
+    }
+}
+
+void
+squale_joblist_set_name (SqualeJobList *joblist, const char *name)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+    g_return_if_fail (name != NULL);
+
+    if (joblist->name)
+        g_free (joblist->name);
+
+    joblist->name = g_strdup (name);
+}
+
+char *
+squale_joblist_get_backend (SqualeJobList *joblist)
+{
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), NULL);
+
+    if (joblist->backend) {
+        return g_strdup (joblist->backend);
+    }
+    else {
+        return NULL;
+    }
+}
+
+void
+squale_joblist_set_backend (SqualeJobList *joblist, const char *backend)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+    g_return_if_fail (backend != NULL);
+
+    if (joblist->backend)
+        g_free (joblist->backend);
+
+    joblist->backend = g_strdup (backend);
+}
+
+gboolean
+squale_joblist_add_job (SqualeJobList *joblist, SqualeJob *job, GError **error)
+{
+    GList *jobs = NULL, *workers = NULL;
+    gboolean running_workers = FALSE;
+
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    /* Check if we have some running workers to process that job */
+    workers = joblist->workers;
+
+    while (workers) {
+        SqualeWorker *worker = SQUALE_WORKER (workers->data);
+        if (SQUALE_IS_WORKER (worker)) {
+            if (squale_worker_is_running (worker)) {
+                running_workers = TRUE;
+            }
+        }
+        workers = g_list_next (workers);
+    }
+
+    if ((joblist->status == SQUALE_JOBLIST_CLOSED) || (!running_workers)) {
+        g_set_error (error, squale_joblist_error_quark (), 0,
+                     _("Joblist %s is currently in closed state"), joblist->name);
+        g_message (_("Declining addition of job %p to joblist %s because " \
+        "it's closed"), job, joblist->name);
+        return FALSE;
+    }
+
+    /* Results are piling up faster than clients read them, asking the client
+       to come back later is better than getting killed by the OOM killer */
+    if (squale_memory_budget_exhausted (&(joblist->memory_budget)) ||
+        squale_memory_budget_exhausted (squale_memory_budget_get_global ())) {
+        g_set_error (error, squale_resultset_error_quark (),
+                     SQUALE_RESULTSET_ERROR_BUDGET,
+                     _("Memory budget of joblist %s is exhausted, retry later"),
+                     joblist->name);
+        g_warning (_("Declining addition of job %p to joblist %s because " \
+        "its memory budget is exhausted"), job, joblist->name);
+        joblist->nb_budget_rejections++;
+        return FALSE;
+    }
+
+    g_message (_("Adding job %p to joblist %s"), job, joblist->name);
+
+    /* Flag point lookups that can be merged with others */
+    if (joblist->batch_templates && !job->is_batch) {
+        GList *templates = joblist->batch_templates;
+
+        while (templates &&
+               !squale_job_match_batch_template (job, templates->data)) {
+            templates = g_list_next (templates);
+        }
+    }
+
+    /* Same for single row inserts, Oracle has no multi-row VALUES */
+    if (joblist->insert_batch_size > 1 && !job->is_batch &&
+        !job->batch_template && !job->read_only &&
+        g_ascii_strcasecmp (joblist->backend, "oracle")) {
+        char *head = squale_job_match_insert (job);
+
+        if (head) {
+            SqualeBatchTemplate *template = NULL;
+
+            template = g_hash_table_lookup (joblist->write_templates, head);
+            if (!template) {
+                template = squale_insert_template_new (head);
+                template->window = joblist->insert_batch_linger;
+                template->max_size = joblist->insert_batch_size;
+                g_hash_table_insert (joblist->write_templates, g_strdup (head),
+                                     template);
+            }
+            job->batch_template = template;
+            g_free (head);
+        }
+    }
+
+    /* And increments of the same counter */
+    if (joblist->counter_batch_size > 1 && !job->is_batch &&
+        !job->batch_template && !job->read_only) {
+        char *tail = NULL, *head = squale_job_match_counter (job, &tail);
+
+        if (head) {
+            SqualeBatchTemplate *template = NULL;
+            char *shape = g_strconcat (head, " ?", tail, NULL);
+
+            template = g_hash_table_lookup (joblist->write_templates, shape);
+            if (!template) {
+                template = squale_counter_template_new (head, tail);
+                template->window = joblist->counter_batch_linger;
+                template->max_size = joblist->counter_batch_size;
+                g_hash_table_insert (joblist->write_templates, shape, template);
+            }
+            else {
+                g_free (shape);
+            }
+            job->batch_template = template;
+            g_free (head);
+            g_free (tail);
+        }
+    }
+
+    squale_resultset_set_spill_threshold (job->resultset,
+                                          joblist->spill_threshold);
+    squale_resultset_set_budget (job->resultset, &(joblist->memory_budget));
+
+    /* Statements of a session run on their worker whatever their cost */
+    if (joblist->slow_lane_workers && job->job_type == SQUALE_JOB_NORMAL &&
+        !job->is_batch && !job->pinned_worker) {
+        squale_job_get_fingerprint (job);
+    }
+
+    /* We steal the reference of that job */
+    g_mutex_lock (joblist->list_mutex);
+
+    if (joblist->retry_percent && job->read_only && !job->nb_retries) {
+        joblist->retry_tokens = MIN (SQUALE_RETRY_BURST,
+                                     joblist->retry_tokens +
+                                     joblist->retry_percent / 100.0);
+    }
+
+    if (job->fingerprint) {
+        SqualeFingerprintCost *cost = NULL;
+
+        cost = g_hash_table_lookup (joblist->fingerprint_costs,
+                                    job->fingerprint);
+
+        job->slow = cost && cost->cost > joblist->slow_threshold;
+        if (job->slow)
+            joblist->nb_slow_jobs++;
+    }
+
+    /* An identical read is already on its way, we just wait for its result */
+    if (squale_joblist_coalesce_job (joblist, job)) {
+        g_mutex_unlock (joblist->list_mutex);
+        return TRUE;
+    }
+
+    /* If a warn/block level is defined we crawl in the list to look how many
+     * pending job are hanging there */
+    if (joblist->max_pending_warn || joblist->max_pending_block) {
+        guint pending_jobs = 0;
+        SqualeJob *victim = NULL;
+
+        jobs = joblist->jobs;
+
+        while (jobs) {
+            SqualeJob *pending = SQUALE_JOB (jobs->data);
+            if (pending->status == SQUALE_JOB_PENDING) {
+                pending_jobs++;
+                /* Mirror copies go first, then the newest job of the least
+                   urgent class */
+                if (!pending->followers && !pending->leader &&
+                    !pending->pinned_worker &&
+                    (!victim || (pending->is_mirror && !victim->is_mirror) ||
+                     (pending->is_mirror == victim->is_mirror &&
+                      pending->priority >= victim->priority)))
+                    victim = pending;
+            }
+            jobs = g_list_next (jobs);
+        }
+
+        /* Make room by shedding less urgent work */
+        if (pending_jobs >= joblist->max_pending_block &&
+            joblist->max_pending_block && victim &&
+            (victim->priority > job->priority ||
+             (victim->is_mirror && !job->is_mirror))) {
+            g_warning (_("Shedding job %p from joblist %s to make room for " \
+          "job %p"), victim, joblist->name, job);
+            squale_job_set_error (victim, g_error_new (squale_joblist_error_quark (),
+                                                       SQUALE_JOBLIST_ERROR_OVERLOADED,
+                                                       _("Joblist %s is overloaded, " \
+          "job shed in favour of more urgent ones"), joblist->name));
+            if (squale_job_set_status_if_match (victim, SQUALE_JOB_COMPLETE,
+                                                SQUALE_JOB_PENDING)) {
+                joblist->nb_shed++;
+                pending_jobs--;
+            }
+        }
+
+        if (pending_jobs >= joblist->max_pending_block &&
+            joblist->max_pending_block) {
+            g_mutex_unlock (joblist->list_mutex);
+            g_set_error (error, squale_joblist_error_quark (), 0,
+                         _("Joblist %s is currently blocked, too many pending jobs (%d)"),
+                         joblist->name, pending_jobs);
+            g_warning (_("Declining addition of job %p to joblist %s because " \
+          "it's blocked, too many pending jobs (%d)"), job, joblist->name,
+                       pending_jobs);
+            return FALSE;
+        }
+        if (pending_jobs >= joblist->max_pending_warn &&
+            joblist->max_pending_warn) {
+            g_warning ("we have %d pending jobs in joblist %s (%d allowed)",
+                       pending_jobs, joblist->name, joblist->max_pending_warn);
+        }
+    }
+
+    joblist->discipline->enqueue (joblist, job);
+
+    /* We signal that a job has been added to wake up the waiting worker
+    threads. Pinned workers can't take any job, we don't know which one would
+    be woken up. The same goes for jobs which only some workers take */
+    if (job->pinned_worker || joblist->nb_pinned || job->affinity ||
+        job->avoid_endpoint)
+        g_cond_broadcast (joblist->cond);
+    else
+        g_cond_signal (joblist->cond);
+
+    g_mutex_unlock (joblist->list_mutex);
+
+    return TRUE;
+}
+
+/* The client of that job went away, a worker running it cancels its
+   statement. Jobs other clients are waiting for through coalescing or
+   batching keep running. */
+gboolean
+squale_joblist_cancel_job (SqualeJobList *joblist, SqualeJob *job)
+{
+    GList *workers = NULL;
+    gboolean ret = FALSE;
+
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    if (job->status != SQUALE_JOB_PROCESSING || job->followers || job->leader)
+        return FALSE;
+
+    for (workers = joblist->workers; workers && !ret;
+         workers = g_list_next (workers)) {
+        ret = squale_worker_cancel_job (SQUALE_WORKER (workers->data), job);
+    }
+
+    if (ret)
+        joblist->nb_abandoned++;
+
+    return ret;
+}
+
+gboolean
+squale_joblist_remove_job (SqualeJobList *joblist, SqualeJob *job)
+{
+    GList *jobs = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    g_message (_("Removing job %p from joblist %s"), job, joblist->name);
+
+    g_mutex_lock (joblist->list_mutex);
+
+    jobs = g_list_find (joblist->jobs, job);
+
+    if (jobs) {
+        SqualeJob *new_leader = NULL;
+
+        /* A pending job leaving with followers hands its place over to the
+           first of them so that they still get processed */
+        if (job->status == SQUALE_JOB_PENDING && job->followers) {
+            new_leader = squale_job_promote_follower (job);
+        }
+
+        if (new_leader) {
+            jobs->data = new_leader;
+        }
+        else {
+            joblist->jobs = g_list_delete_link (joblist->jobs, jobs);
+        }
+    }
+
+    /* Coalesced followers and batch members leave their leader */
+    if (job->leader) {
+        squale_job_remove_follower (job->leader, job);
+    }
+
+    g_mutex_unlock (joblist->list_mutex);
+
+    /* Compute stats */
+    joblist->assign_total_time += squale_job_get_assignation_delay (job);
+    joblist->nb_assign++;
+
+    if (job->status == SQUALE_JOB_COMPLETE) {
+        joblist->process_total_time += squale_job_get_processing_time (job);
+        joblist->nb_process++;
+        if (job->error) {
+            joblist->nb_errors++;
+        }
+    }
+
+    /* We unref that job as we have stolen the reference when adding */
+    g_object_unref (job);
+
+    return TRUE;
+}
+
+/* This function locks the joblist and crawls inside to find a pending job
+   and assign it. If keep_locking is TRUE this function will not unlock the
+   joblist mutex when no pending job is found. This is used to do an atomic
+   switch to waiting mode in the worker being sure that the list is not touched
+   meanwhile. Jobs of a client session only go to the worker pinned to it and
+   a pinned worker only takes those. Pending jobs past their deadline are
+   completed with an error on the way. Jobs of lower priority classes are
+   only assigned when there is no interactive job left and a worker is not
+   reserved for those. */
+SqualeJob *
+squale_joblist_assign_pending_job (SqualeJobList *joblist,
+                                   SqualeWorker *worker,
+                                   gboolean keep_locking)
+{
+    GList *jobs = NULL, *lower = NULL;
+    struct timeval now;
+    gboolean backwards = FALSE, pending = FALSE;
+
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), NULL);
+
+    g_mutex_lock (joblist->list_mutex);
+
+    gettimeofday (&now, NULL);
+    timerclear (&(joblist->batch_wakeup_ts));
+
+    /* Asking for a job means the previous one is done */
+    if (worker->in_flight) {
+        worker->in_flight = FALSE;
+        joblist->nb_in_flight--;
+    }
+    if (worker->slow_lane) {
+        worker->slow_lane = FALSE;
+        joblist->nb_slow_running--;
+    }
+
+    /* The database is saturated, that worker stays parked. A pinned worker
+       always serves its session */
+    if (joblist->adaptive_concurrency && !worker->pinned &&
+        joblist->concurrency_limit >= 1 &&
+        joblist->nb_in_flight >= (guint) joblist->concurrency_limit) {
+        if (!keep_locking) {
+            g_mutex_unlock (joblist->list_mutex);
+        }
+        return NULL;
+    }
+
+    for (jobs = joblist->discipline->first (joblist, &now, &backwards); jobs;
+         jobs = backwards ? g_list_previous (jobs) : g_list_next (jobs)) {
+        SqualeJob *job = SQUALE_JOB (jobs->data);
+
+        if (SQUALE_IS_JOB (job) && job->status == SQUALE_JOB_PENDING) {
+            pending = TRUE;
+        }
+
+        /* Batch members are processed by their batch job */
+        if (SQUALE_IS_JOB (job) && job->leader) {
+            continue;
+        }
+
+        if (SQUALE_IS_JOB (job) &&
+            (job->pinned_worker || worker->pinned) &&
+            job->pinned_worker != worker) {
+            continue;
+        }
+
+        /* Its client gave up on it already, followers still want the result */
+        if (SQUALE_IS_JOB (job) && job->status == SQUALE_JOB_PENDING &&
+            !job->followers && timerisset (&(job->deadline_ts)) &&
+            !timercmp (&now, &(job->deadline_ts), <)) {
+            squale_job_set_error (job, g_error_new (squale_joblist_error_quark (), 0,
+                                                    _("Deadline exceeded before the job was assigned")));
+            if (squale_job_set_status_if_match (job, SQUALE_JOB_COMPLETE,
+                                                SQUALE_JOB_PENDING)) {
+                joblist->nb_deadline_expired++;
+            }
+            continue;
+        }
+
+        /* The queue is standing, mirror copies which waited too long go
+           right away, another job makes room for the others once per
+           control law tick if there is no copy to drop instead */
+        if (SQUALE_IS_JOB (job) && joblist->codel_dropping &&
+            job->status == SQUALE_JOB_PENDING && !job->followers &&
+            !job->pinned_worker &&
+            squale_joblist_codel_late (joblist, job, &now) &&
+            (job->is_mirror ||
+             !timercmp (&now, &(joblist->codel_drop_ts), <))) {
+            SqualeJob *victim = job;
+
+            if (!job->is_mirror) {
+                victim = squale_joblist_codel_late_mirror (joblist, &now);
+                if (!victim) {
+                    victim = job;
+                    joblist->codel_count++;
+                    squale_joblist_codel_schedule_drop (joblist, &now);
+                }
+            }
+
+            squale_job_set_error (victim, g_error_new (squale_joblist_error_quark (),
+                                                       SQUALE_JOBLIST_ERROR_OVERLOADED,
+                                                       _("Joblist %s is overloaded, job " \
+              "dropped after waiting %d ms"), joblist->name,
+                                                       squale_joblist_sojourn (victim, &now)));
+            if (squale_job_set_status_if_match (victim, SQUALE_JOB_COMPLETE,
+                                                SQUALE_JOB_PENDING)) {
+                joblist->nb_codel_drops++;
+            }
+            if (victim == job)
+                continue;
+        }
+
+        /* Retried reads back off for a while */
+        if (SQUALE_IS_JOB (job) && job->status == SQUALE_JOB_PENDING &&
+            timerisset (&(job->retry_ts)) && timercmp (&now, &(job->retry_ts), <)) {
+            if (!timerisset (&(joblist->batch_wakeup_ts)) ||
+                timercmp (&(job->retry_ts), &(joblist->batch_wakeup_ts), <)) {
+                joblist->batch_wakeup_ts = job->retry_ts;
+            }
+            continue;
+        }
+
+        /* A job with an affinity key waits a little for its worker */
+        if (SQUALE_IS_JOB (job) && job->affinity && joblist->affinity_wait &&
+            job->status == SQUALE_JOB_PENDING && !worker->pinned) {
+            struct timeval wait_end;
+
+            wait_end.tv_sec = job->creation_ts.tv_sec + joblist->affinity_wait / 1000;
+            wait_end.tv_usec = job->creation_ts.tv_usec +
+                               (joblist->affinity_wait % 1000) * 1000;
+            if (wait_end.tv_usec >= 1000000) {
+                wait_end.tv_sec++;
+                wait_end.tv_usec -= 1000000;
+            }
+
+            if (timercmp (&now, &wait_end, <) &&
+                squale_joblist_affinity_worker (joblist, job) != worker) {
+                if (!timerisset (&(joblist->batch_wakeup_ts)) ||
+                    timercmp (&wait_end, &(joblist->batch_wakeup_ts), <)) {
+                    joblist->batch_wakeup_ts = wait_end;
+                }
+                continue;
+            }
+        }
+
+        /* A hedge has to run on another endpoint than its original */
+        if (SQUALE_IS_JOB (job) && job->avoid_endpoint &&
+            (!worker->endpoint ||
+             !strcmp (worker->endpoint, job->avoid_endpoint))) {
+            continue;
+        }
+
+        /* The slow lane is full, the remaining workers are kept for the
+           fast jobs */
+        if (SQUALE_IS_JOB (job) && job->slow &&
+            job->status == SQUALE_JOB_PENDING &&
+            joblist->nb_slow_running >= joblist->slow_lane_workers) {
+            continue;
+        }
+
+        /* Remember the first job of the most urgent lower class, a pinned
+           worker just serves its session */
+        if (SQUALE_IS_JOB (job) && job->priority > SQUALE_PRIORITY_INTERACTIVE &&
+            !worker->pinned) {
+            if (job->status == SQUALE_JOB_PENDING &&
+                (!lower || job->priority < SQUALE_JOB (lower->data)->priority))
+                lower = jobs;
+            continue;
+        }
+
+        if (SQUALE_IS_JOB (job) && job->batch_template &&
+            job->status == SQUALE_JOB_PENDING) {
+            SqualeJob *batch = squale_joblist_build_batch (joblist,
+                                                           job->batch_template,
+                                                           &now);
+
+            if (batch == NULL) {
+                /* Held for a little while */
+                continue;
+            }
+            else if (batch != job) {
+                squale_joblist_take_job (joblist, worker, batch, &now);
+                g_mutex_unlock (joblist->list_mutex);
+                g_message (_("Assigning batch job %p in joblist %s"), batch,
+                           joblist->name);
+                return batch;
+            }
+        }
+
+        if (SQUALE_IS_JOB (job)) {
+            gboolean ret = FALSE;
+
+            /* If this function returns TRUE we found a pending job and mark it as
+               processing while locked so that no worker can steal it at the same
+               time */
+            ret = squale_job_set_status_if_match (job, SQUALE_JOB_PROCESSING,
+                                                  SQUALE_JOB_PENDING);
+            if (ret) {
+                /* We return the job with an incremented reference count. Before the
+                 * reference was incremented in the worker_run function but that can
+                 * get us into a race if the job refcount is decremented because of
+                 * client disconnection between that function returns and the ref is
+                 * incremented. */
+                g_object_ref (job);
+                squale_joblist_take_job (joblist, worker, job, &now);
+                g_mutex_unlock (joblist->list_mutex);
+                g_message (_("Found pending job %p in joblist %s"), job, joblist->name);
+                return job;
+            }
+        }
+    }
+
+    if (lower && squale_joblist_has_spare_worker (joblist)) {
+        SqualeJob *job = SQUALE_JOB (lower->data);
+
+        if (squale_job_set_status_if_match (job, SQUALE_JOB_PROCESSING,
+                                            SQUALE_JOB_PENDING)) {
+            g_object_ref (job);
+            squale_joblist_take_job (joblist, worker, job, &now);
+            g_mutex_unlock (joblist->list_mutex);
+            g_message (_("Found pending job %p of priority %d in joblist %s"),
+                       job, job->priority, joblist->name);
+            return job;
+        }
+    }
+
+    /* Nothing else to do, run the spooled orders */
+    if (joblist->spool && !worker->pinned) {
+        SqualeJob *job = squale_joblist_drain_spool (joblist);
+
+        if (job) {
+            worker->in_flight = TRUE;
+            joblist->nb_in_flight++;
+            g_mutex_unlock (joblist->list_mutex);
+            g_message (_("Draining spooled job %p in joblist %s"), job,
+                       joblist->name);
+            return job;
+        }
+    }
+
+    /* An idle worker with nothing pending means there is no standing
+       queue, jobs it only skipped are still waiting */
+    if (!worker->pinned && !pending)
+        joblist->codel_min_sojourn = 0;
+
+    /* We don't unlock the joblist as g_cond_wait will do that in the worker */
+    if (!keep_locking) {
+        g_mutex_unlock (joblist->list_mutex);
+    }
+
+    return NULL;
+}
+
+/* This function allows a worker to give up on a specific job. This will just
+ * remove the job from the joblist, change its status back to pending and add
+ * it again. */
+gboolean
+squale_joblist_giveup_job (SqualeJobList *joblist, SqualeJob *job)
+{
+    gboolean ret = FALSE;
+    GError *error = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    /* A spooled job is not in the list either, its order stays in the spool */
+    if (job->spool) {
+        squale_spool_giveup (job->spool, job->spool_record);
+        squale_spool_unref (job->spool);
+        job->spool = NULL;
+        g_mutex_lock (joblist->list_mutex);
+        g_cond_broadcast (joblist->cond);
+        g_mutex_unlock (joblist->list_mutex);
+        return TRUE;
+    }
+
+    /* A batch job is not in the list, we just give its members back */
+    if (job->is_batch) {
+        g_mutex_lock (joblist->list_mutex);
+        squale_job_dissolve_batch (job);
+        g_cond_broadcast (joblist->cond);
+        g_mutex_unlock (joblist->list_mutex);
+        return TRUE;
+    }
+
+    /* We take an extra ref to the job, as removing will unref */
+    g_object_ref (job);
+    /* Remove job from the list */
+    ret = squale_joblist_remove_job (joblist, job);
+    if (G_UNLIKELY (!ret)) {
+        g_warning ("failed removing job %p from joblist %p", job, joblist);
+        g_object_unref (job);
+        goto beach;
+    }
+    /* Change status back to pending */
+    ret = squale_job_set_status_if_match (job, SQUALE_JOB_PENDING,
+                                          SQUALE_JOB_PROCESSING);
+    if (G_UNLIKELY (!ret)) {
+        g_warning ("job %p was not in processing status", job);
+        goto beach;
+    }
+    /* Add the job back, this will steal our reference */
+    ret = squale_joblist_add_job (joblist, job, &error);
+    if (G_UNLIKELY (!ret)) {
+        g_warning ("failed adding job %p to joblist %p", job, joblist);
+        if (error) {
+            squale_job_set_error (job, error);
+        }
+        /* Declare the job as COMPLETE */
+        squale_job_set_status_if_match (job, SQUALE_JOB_COMPLETE,
+                                        SQUALE_JOB_PENDING);
+    }
+
+    beach:
+    return ret;
+}
+
+void
+squale_joblist_set_max_pending_warn_level (SqualeJobList *joblist,
+                                           guint max_pending)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    joblist->max_pending_warn = max_pending;
+}
+
+void
+squale_joblist_set_max_pending_block_level (SqualeJobList *joblist,
+                                            guint max_pending)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    joblist->max_pending_block = max_pending;
+}
+
+void
+squale_joblist_set_coalesce_reads (SqualeJobList *joblist,
+                                   gboolean coalesce_reads)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    joblist->coalesce_reads = coalesce_reads;
+}
+
+/* Merge up to max_size single row inserts, 0 or 1 disables it. The oldest
+   insert waits at most linger ms for others to join. */
+void
+squale_joblist_set_insert_batching (SqualeJobList *joblist, guint max_size,
+                                    guint linger)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    joblist->insert_batch_size = max_size;
+    joblist->insert_batch_linger = linger;
+}
+
+/* Select the queue discipline by name, returns FALSE if there is none by
+   that name */
+gboolean
+squale_joblist_set_queue_discipline (SqualeJobList *joblist, const char *name)
+{
+    const SqualeQueueDiscipline *discipline = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
+    g_return_val_if_fail (name != NULL, FALSE);
+
+    discipline = squale_queue_discipline_find (name);
+    if (!discipline)
+        return FALSE;
+
+    /* Jobs already queued keep their place */
+    g_mutex_lock (joblist->list_mutex);
+    joblist->discipline = discipline;
+    g_mutex_unlock (joblist->list_mutex);
+
+    return TRUE;
+}
+
+/* Let the joblist find how many jobs the database can run at once instead
+   of using all the workers */
+void
+squale_joblist_set_adaptive_concurrency (SqualeJobList *joblist,
+                                         gboolean adaptive)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    g_mutex_lock (joblist->list_mutex);
+    joblist->adaptive_concurrency = adaptive;
+    /* Start from all the workers and back off from there, the first sample
+       sets it if there are none yet */
+    joblist->concurrency_limit = g_list_length (joblist->workers);
+    g_cond_broadcast (joblist->cond);
+    g_mutex_unlock (joblist->list_mutex);
+}
+
+/* Called by workers with the processing time of each job they ran. It
+   feeds the cost history of the job fingerprint and the adaptive concurrency
+   limit. The limit grows additively while that time stays under the
+   tolerance and shrinks multiplicatively, at most once per limit jobs, over
+   it. */
+void
+squale_joblist_sample_latency (SqualeJobList *joblist, SqualeJob *job)
+{
+    struct timeval now;
+    gint64 latency;
+    guint nb_workers, old_limit;
+
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+    g_return_if_fail (SQUALE_IS_JOB (job));
+
+    if (!joblist->adaptive_concurrency && !job->fingerprint &&
+        !joblist->hedge_percent)
+        return;
+
+    gettimeofday (&now, NULL);
+    latency = (gint64) (now.tv_sec - job->assign_ts.tv_sec) * G_USEC_PER_SEC +
+              (now.tv_usec - job->assign_ts.tv_usec);
+
+    g_mutex_lock (joblist->list_mutex);
+
+    if (job->fingerprint && !job->error) {
+        SqualeFingerprintCost *cost = NULL;
+
+        cost = g_hash_table_lookup (joblist->fingerprint_costs,
+                                    job->fingerprint);
+        joblist->fingerprint_clock++;
+
+        if (cost) {
+            cost->cost = 0.8 * cost->cost + 0.2 * latency / 1000.0;
+        }
+        else {
+            if (g_hash_table_size (joblist->fingerprint_costs) >=
+                SQUALE_FINGERPRINT_HISTORY) {
+                g_hash_table_foreach_remove (joblist->fingerprint_costs,
+                                             squale_joblist_fingerprint_is_stale,
+                                             &(joblist->fingerprint_clock));
+            }
+            cost = g_new (SqualeFingerprintCost, 1);
+            cost->cost = latency / 1000.0;
+            g_hash_table_insert (joblist->fingerprint_costs,
+                                 g_strdup (job->fingerprint), cost);
+        }
+        cost->sampled = joblist->fingerprint_clock;
+    }
+
+    /* The hedge delay follows the p95 of the reads */
+    if (joblist->hedge_percent && job->read_only && !job->error &&
+        !job->is_batch) {
+        joblist->read_latencies[joblist->nb_read_latencies % SQUALE_HEDGE_SAMPLES] =
+                latency / 1000;
+        joblist->nb_read_latencies++;
+        if (joblist->nb_read_latencies >= SQUALE_HEDGE_SAMPLES &&
+            !(joblist->nb_read_latencies % (SQUALE_HEDGE_SAMPLES / 4))) {
+            gint32 sorted[SQUALE_HEDGE_SAMPLES];
+
+            memcpy (sorted, joblist->read_latencies, sizeof (sorted));
+            qsort (sorted, SQUALE_HEDGE_SAMPLES, sizeof (gint32),
+                   squale_joblist_compare_latencies);
+            joblist->hedge_delay = MAX (sorted[SQUALE_HEDGE_SAMPLES * 95 / 100], 1);
+        }
+    }
+
+    if (!joblist->adaptive_concurrency) {
+        g_mutex_unlock (joblist->list_mutex);
+        return;
+    }
+
+    nb_workers = g_list_length (joblist->workers);
+    /* Workers are added after the joblist is configured */
+    if (joblist->concurrency_limit < 1)
+        joblist->concurrency_limit = nb_workers;
+    old_limit = (guint) joblist->concurrency_limit;
+
+    /* The baseline is the best the database did over the last window, so
+       that it follows the query mix */
+    joblist->latency_window_min = MIN (joblist->latency_window_min, latency);
+    if (++joblist->nb_latency_samples >= SQUALE_CONCURRENCY_WINDOW ||
+        !joblist->latency_baseline) {
+        joblist->latency_baseline = MAX (joblist->latency_window_min, 1);
+        joblist->latency_window_min = G_MAXINT64;
+        joblist->nb_latency_samples = 0;
+    }
+
+    if (joblist->latency_average == 0)
+        joblist->latency_average = latency;
+    else
+        joblist->latency_average = 0.9 * joblist->latency_average + 0.1 * latency;
+
+    joblist->nb_since_decrease++;
+
+    if (joblist->latency_average >
+        SQUALE_CONCURRENCY_TOLERANCE * joblist->latency_baseline) {
+        if (joblist->nb_since_decrease >= old_limit) {
+            joblist->concurrency_limit = MAX (1, joblist->concurrency_limit * 0.9);
+            joblist->nb_since_decrease = 0;
+        }
+    }
+    else if (joblist->nb_in_flight + 1 >= old_limit) {
+        /* Only grow when the limit is what holds us back */
+        joblist->concurrency_limit = MIN (nb_workers,
+                                          joblist->concurrency_limit +
+                                          1 / joblist->concurrency_limit);
+    }
+
+    if ((guint) joblist->concurrency_limit != old_limit) {
+        g_message (_("Joblist %s concurrency limit is now %u (average %.0f us, " \
+          "baseline %" G_GINT64_FORMAT " us)"), joblist->name,
+                   (guint) joblist->concurrency_limit,
+                   joblist->latency_average, joblist->latency_baseline);
+        /* Parked workers can take jobs again */
+        if ((guint) joblist->concurrency_limit > old_limit)
+            g_cond_broadcast (joblist->cond);
+    }
+
+    g_mutex_unlock (joblist->list_mutex);
+}
+
+/* Drop jobs waiting more than target ms once no job went through faster
+   during a whole interval, a target of 0 disables it */
+void
+squale_joblist_set_codel (SqualeJobList *joblist, guint target,
+                          guint interval)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    g_mutex_lock (joblist->list_mutex);
+    joblist->codel_target = target;
+    joblist->codel_interval = interval;
+    joblist->codel_dropping = FALSE;
+    g_mutex_unlock (joblist->list_mutex);
+}
+
+void
+squale_joblist_set_reserved_workers (SqualeJobList *joblist,
+                                     guint reserved_workers)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    joblist->reserved_workers = reserved_workers;
+}
+
+/* Share of the workers a tenant gets under the fair discipline compared to
+   the others, the default weight is 1 */
+void
+squale_joblist_set_tenant_weight (SqualeJobList *joblist, const char *tenant,
+                                  guint weight)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+    g_return_if_fail (tenant != NULL);
+
+    g_mutex_lock (joblist->list_mutex);
+    g_hash_table_insert (joblist->tenant_weights, g_strdup (tenant),
+                         GUINT_TO_POINTER (MAX (weight, 1)));
+    g_mutex_unlock (joblist->list_mutex);
+}
+
+/* Maximum orders per second of a tenant, 0 for unlimited */
+void
+squale_joblist_set_tenant_rate (SqualeJobList *joblist, const char *tenant,
+                                gdouble rate)
+{
+    SqualeTenantLimit *limit = NULL;
+
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+    g_return_if_fail (tenant != NULL);
+
+    limit = squale_joblist_configure_tenant_limit (joblist, tenant);
+    limit->rate = MAX (rate, 0);
+    limit->tokens = MAX (limit->rate, 1);
+}
+
+/* Maximum jobs of a tenant in flight on the joblist, 0 for unlimited */
+void
+squale_joblist_set_tenant_concurrency (SqualeJobList *joblist,
+                                       const char *tenant, guint max_in_flight)
+{
+    SqualeTenantLimit *limit = NULL;
+
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+    g_return_if_fail (tenant != NULL);
+
+    limit = squale_joblist_configure_tenant_limit (joblist, tenant);
+    limit->max_in_flight = max_in_flight;
+}
+
+/* Called before adding a job, takes a token from the bucket of its tenant
+   and counts the job as in flight. Fails when the tenant is over one of
+   its limits, the job is then rejected without being queued. */
+gboolean
+squale_joblist_admit_tenant (SqualeJobList *joblist, SqualeJob *job,
+                             GError **error)
+{
+    SqualeTenantLimit *limit = NULL;
+    struct timeval now;
+
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    if (!job->tenant)
+        return TRUE;
+
+    limit = squale_joblist_get_tenant_limit (joblist, job->tenant, TRUE);
+    if (!limit)
+        return TRUE;
+
+    gettimeofday (&now, NULL);
+    squale_joblist_refill_tenant_limit (limit, &now);
+
+    if (limit->max_in_flight && limit->in_flight >= limit->max_in_flight) {
+        joblist->nb_tenant_rejections++;
+        g_set_error (error, squale_joblist_error_quark (),
+                     SQUALE_JOBLIST_ERROR_TENANT_LIMIT,
+                     _("Tenant %s already has %u jobs in flight on joblist %s"),
+                     job->tenant, limit->in_flight, joblist->name);
+        return FALSE;
+    }
+
+    if (limit->rate && limit->tokens < 1) {
+        joblist->nb_tenant_rejections++;
+        g_set_error (error, squale_joblist_error_quark (),
+                     SQUALE_JOBLIST_ERROR_TENANT_LIMIT,
+                     _("Tenant %s is over its rate of %.1f orders per second " \
+          "on joblist %s"), job->tenant, limit->rate, joblist->name);
+        return FALSE;
+    }
+
+    if (limit->rate)
+        limit->tokens -= 1;
+
+    limit->in_flight++;
+    job->tenant_admitted = TRUE;
+
+    return TRUE;
+}
+
+/* The job admitted by squale_joblist_admit_tenant is done */
+void
+squale_joblist_release_tenant (SqualeJobList *joblist, SqualeJob *job)
+{
+    SqualeTenantLimit *limit = NULL;
+
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+    g_return_if_fail (SQUALE_IS_JOB (job));
+
+    if (!job->tenant_admitted)
+        return;
+
+    job->tenant_admitted = FALSE;
+
+    limit = squale_joblist_get_tenant_limit (joblist, job->tenant, FALSE);
+    if (limit && limit->in_flight)
+        limit->in_flight--;
+}
+
+/* Jobs whose fingerprint took more than threshold ms on average are run by
+   at most max_workers workers at a time, 0 disables the slow lane */
+void
+squale_joblist_set_slow_lane (SqualeJobList *joblist, guint threshold,
+                              guint max_workers)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    joblist->slow_threshold = threshold;
+    joblist->slow_lane_workers = max_workers;
+}
+
+/* Hedge at most percent % of the reads, 0 disables hedging. Hedging only
+   makes sense with workers on several endpoints. */
+void
+squale_joblist_set_hedging (SqualeJobList *joblist, guint percent)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    joblist->hedge_percent = MIN (percent, 100);
+}
+
+/* Called by the client once the job is added, returns after how many ms the
+   job should be hedged or 0 if it should not. Every eligible read earns its
+   share of the hedge budget. */
+guint
+squale_joblist_get_hedge_delay (SqualeJobList *joblist, SqualeJob *job)
+{
+    guint delay = 0;
+
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), 0);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), 0);
+
+    if (!joblist->hedge_percent || !job->read_only ||
+        job->job_type != SQUALE_JOB_NORMAL || job->nb_params ||
+        job->cursor_rows || job->pinned_worker || job->is_batch ||
+        job->no_reply || job->avoid_endpoint)
+        return 0;
+
+    g_mutex_lock (joblist->list_mutex);
+
+    if (!job->leader) {
+        joblist->hedge_tokens = MIN (SQUALE_HEDGE_BURST,
+                                     joblist->hedge_tokens +
+                                     joblist->hedge_percent / 100.0);
+        delay = joblist->hedge_delay;
+    }
+
+    g_mutex_unlock (joblist->list_mutex);
+
+    return delay;
+}
+
+/* The job has been running for longer than the hedge delay, send a copy to
+   another endpoint if the budget allows it. The hedge is added to the
+   joblist which steals its reference, like the jobs of clients. */
+SqualeJob *
+squale_joblist_hedge_job (SqualeJobList *joblist, SqualeJob *job)
+{
+    SqualeJob *hedge = NULL;
+    GList *workers = NULL;
+
     g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), NULL);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), NULL);
 
-    if (joblist->backend) {
-        return g_strdup (joblist->backend);
+    g_mutex_lock (joblist->list_mutex);
+
+    /* Still queued, another endpoint would not do better */
+    if (job->status != SQUALE_JOB_PROCESSING || !job->endpoint ||
+        joblist->hedge_tokens < 1) {
+        g_mutex_unlock (joblist->list_mutex);
+        return NULL;
     }
-    else {
+
+    for (workers = joblist->workers; workers; workers = g_list_next (workers)) {
+        SqualeWorker *worker = SQUALE_WORKER (workers->data);
+
+        if (squale_worker_is_running (worker) && !worker->pinned &&
+            worker->endpoint && strcmp (worker->endpoint, job->endpoint))
+            break;
+    }
+
+    if (!workers) {
+        g_mutex_unlock (joblist->list_mutex);
+        return NULL;
+    }
+
+    hedge = squale_job_new_hedge (job);
+    joblist->hedge_tokens -= 1;
+    joblist->nb_hedges++;
+
+    g_mutex_unlock (joblist->list_mutex);
+
+    if (!squale_joblist_add_job (joblist, hedge, NULL)) {
+        g_object_unref (hedge);
         return NULL;
     }
+
+    g_message (_("Hedging job %p running on %s with job %p in joblist %s"),
+               job, job->endpoint, hedge, joblist->name);
+
+    return hedge;
 }
 
+/* Percentage of the reads which can be retried after losing their
+   connection, 0 disables retries */
 void
-squale_joblist_set_backend (SqualeJobList *joblist, const char *backend)
+squale_joblist_set_retry_budget (SqualeJobList *joblist, guint percent)
 {
     g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
-    g_return_if_fail (backend != NULL);
 
-    if (joblist->backend)
-        g_free (joblist->backend);
+    joblist->retry_percent = MIN (percent, 100);
+}
 
-    joblist->backend = g_strdup (backend);
+/* Called by a worker whose connection died while running that job. Reads
+   are idempotent so they are given back to the joblist with a backoff as
+   long as the retry budget allows it. Returns TRUE if the job was given
+   back. */
+/* Delay the next run of a retried job, the backoff doubles with each
+   retry */
+static void
+squale_joblist_backoff_job (SqualeJobList *joblist, SqualeJob *job,
+                            struct timeval *now, const char *reason)
+{
+    guint backoff;
+
+    backoff = SQUALE_RETRY_BACKOFF << job->nb_retries;
+    job->nb_retries++;
+
+    g_warning (_("Retrying job %p in joblist %s in %u ms: %s"), job,
+               joblist->name, backoff, reason);
+
+    job->retry_ts.tv_sec = now->tv_sec + backoff / 1000;
+    job->retry_ts.tv_usec = now->tv_usec + (backoff % 1000) * 1000;
+    if (job->retry_ts.tv_usec >= 1000000) {
+        job->retry_ts.tv_sec++;
+        job->retry_ts.tv_usec -= 1000000;
+    }
 }
 
 gboolean
-squale_joblist_add_job (SqualeJobList *joblist, SqualeJob *job, GError **error)
+squale_joblist_retry_job (SqualeJobList *joblist, SqualeJob *job)
 {
-    GList *jobs = NULL, *workers = NULL;
-    gboolean running_workers = FALSE;
+    struct timeval now;
+    GList *members = NULL;
+    guint nb_retries = 1;
 
     g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
     g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
 
-    /* Check if we have some running workers to process that job */
-    workers = joblist->workers;
+    if (!job->read_only || job->job_type != SQUALE_JOB_NORMAL ||
+        job->pinned_worker || job->cursor_rows ||
+        job->nb_retries >= SQUALE_RETRY_MAX)
+        return FALSE;
 
-    while (workers) {
-        SqualeWorker *worker = SQUALE_WORKER (workers->data);
-        if (SQUALE_IS_WORKER (worker)) {
-            if (squale_worker_is_running (worker)) {
-                running_workers = TRUE;
-            }
+    g_mutex_lock (joblist->list_mutex);
+    g_mutex_lock (job->status_mutex);
+
+    /* A batch is given back as its members, each of them is a retry of its
+       own and pays for it */
+    if (job->is_batch) {
+        nb_retries = 0;
+        for (members = job->followers; members;
+             members = g_list_next (members)) {
+            if (SQUALE_JOB (members->data)->nb_retries >= SQUALE_RETRY_MAX)
+                break;
+            nb_retries++;
         }
-        workers = g_list_next (workers);
     }
 
-    if ((joblist->status == SQUALE_JOBLIST_CLOSED) || (!running_workers)) {
-        g_set_error (error, squale_joblist_error_quark (), 0,
-                     _("Joblist %s is currently in closed state"), joblist->name);
-        g_message (_("Declining addition of job %p to joblist %s because " \
-        "it's closed"), job, joblist->name);
+    if (members || joblist->retry_tokens < nb_retries) {
+        g_mutex_unlock (job->status_mutex);
+        g_mutex_unlock (joblist->list_mutex);
         return FALSE;
     }
 
-    g_message (_("Adding job %p to joblist %s"), job, joblist->name);
-
-    /* We steal the reference of that job */
-    g_mutex_lock (joblist->list_mutex);
-
-    /* If a warn/block level is defined we crawl in the list to look how many
-     * pending job are hanging there */
-    if (joblist->max_pending_warn || joblist->max_pending_block) {
-        guint pending_jobs = 0;
-
-        jobs = joblist->jobs;
+    joblist->retry_tokens -= nb_retries;
+    joblist->nb_retries += nb_retries;
 
-        while (jobs) {
-            SqualeJob *job = SQUALE_JOB (jobs->data);
-            if (job->status == SQUALE_JOB_PENDING)
-                pending_jobs++;
-            jobs = g_list_next (jobs);
-        }
+    gettimeofday (&now, NULL);
 
-        if (pending_jobs >= joblist->max_pending_block &&
-            joblist->max_pending_block) {
-            g_mutex_unlock (joblist->list_mutex);
-            g_set_error (error, squale_joblist_error_quark (), 0,
-                         _("Joblist %s is currently blocked, too many pending jobs (%d)"),
-                         joblist->name, pending_jobs);
-            g_warning (_("Declining addition of job %p to joblist %s because " \
-          "it's blocked, too many pending jobs (%d)"), job, joblist->name,
-                       pending_jobs);
-            return FALSE;
-        }
-        if (pending_jobs >= joblist->max_pending_warn &&
-            joblist->max_pending_warn) {
-            g_warning ("we have %d pending jobs in joblist %s (%d allowed)",
-                       pending_jobs, joblist->name, joblist->max_pending_warn);
+    if (job->is_batch) {
+        for (members = job->followers; members;
+             members = g_list_next (members)) {
+            squale_joblist_backoff_job (joblist, SQUALE_JOB (members->data),
+                                        &now, job->error->message);
         }
     }
 
-    joblist->jobs = g_list_append (joblist->jobs, job);
+    g_mutex_unlock (job->status_mutex);
+    g_mutex_unlock (joblist->list_mutex);
 
-    /* We signal that a job has been added to wake up the waiting worker
-    threads */
-    g_cond_signal (joblist->cond);
+    squale_joblist_backoff_job (joblist, job, &now, job->error->message);
 
-    g_mutex_unlock (joblist->list_mutex);
+    /* Start again from scratch */
+    g_error_free (job->error);
+    job->error = NULL;
+    squale_resultset_abort (job->resultset);
+    job->affected_rows = -1;
 
-    return TRUE;
+    return squale_joblist_giveup_job (joblist, job);
 }
 
-gboolean
-squale_joblist_remove_job (SqualeJobList *joblist, SqualeJob *job)
+/* How long a job with an affinity key waits for its worker before any
+   worker takes it (ms), 0 disables affinity */
+void
+squale_joblist_set_affinity_wait (SqualeJobList *joblist, guint affinity_wait)
 {
-    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
-    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
 
-    g_message (_("Removing job %p from joblist %s"), job, joblist->name);
+    joblist->affinity_wait = affinity_wait;
+}
 
-    g_mutex_lock (joblist->list_mutex);
+/* Copy percent % of the reads to the joblist named mirror, NULL or 0 stops
+   mirroring */
+void
+squale_joblist_set_mirror (SqualeJobList *joblist, const char *mirror,
+                           guint percent)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
 
-    joblist->jobs = g_list_remove (joblist->jobs, job);
+    if (joblist->mirror != mirror) {
+        g_free (joblist->mirror);
+        joblist->mirror = g_strdup (mirror);
+    }
+    joblist->mirror_percent = MIN (percent, 100);
+}
 
-    g_mutex_unlock (joblist->list_mutex);
+/* Called by the client once its read has been added, sends a copy of a
+   sample of them to the target joblist. The copy has the lowest priority so
+   that it is the first shed under load, and its result is discarded. */
+void
+squale_joblist_mirror_job (SqualeJobList *joblist, SqualeJob *job,
+                           SqualeJobList *target)
+{
+    SqualeMirrorWatch *watch = NULL;
+    SqualeJob *mirror = NULL;
+    GIOChannel *channel = NULL;
+    GError *error = NULL;
+    const char *reason = NULL;
 
-    /* Compute stats */
-    joblist->assign_total_time += squale_job_get_assignation_delay (job);
-    joblist->nb_assign++;
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+    g_return_if_fail (SQUALE_IS_JOB (job));
+    g_return_if_fail (SQUALE_IS_JOBLIST (target));
+
+    if (!joblist->mirror_percent || job->mirror ||
+        g_random_int_range (0, 100) >= (gint32) joblist->mirror_percent)
+        return;
+
+    /* Checked before building anything, a saturated mirror costs nothing */
+    reason = squale_joblist_mirror_saturation (joblist, target);
+    if (reason) {
+        if (!joblist->mirror_saturated) {
+            g_warning (_("Joblist %s stops mirroring reads to joblist %s as " \
+          "%s"), joblist->name, target->name, reason);
+            joblist->mirror_saturated = TRUE;
+        }
+        joblist->nb_mirror_dropped++;
+        return;
+    }
 
-    if (job->status == SQUALE_JOB_COMPLETE) {
-        joblist->process_total_time += squale_job_get_processing_time (job);
-        joblist->nb_process++;
-        if (job->error) {
-            joblist->nb_errors++;
+    mirror = squale_job_new_mirror (job);
+
+    if (!squale_joblist_add_job (target, mirror, &error)) {
+        if (!joblist->mirror_saturated) {
+            g_warning (_("Joblist %s stops mirroring reads to joblist %s: %s"),
+                       joblist->name, target->name,
+                       error ? error->message : _("copy declined"));
+            joblist->mirror_saturated = TRUE;
         }
+        if (error)
+            g_error_free (error);
+        joblist->nb_mirror_dropped++;
+        g_object_unref (mirror);
+        return;
     }
 
-    /* We unref that job as we have stolen the reference when adding */
-    g_object_unref (job);
+    if (joblist->mirror_saturated) {
+        g_message (_("Joblist %s mirrors reads to joblist %s again"),
+                   joblist->name, target->name);
+        joblist->mirror_saturated = FALSE;
+    }
 
-    return TRUE;
+    joblist->nb_mirrors_running++;
+    mirror->mirror_of = g_object_ref (job);
+    mirror->mirror_source = g_object_ref (joblist);
+    job->mirror = g_object_ref (mirror);
+    joblist->nb_mirrored++;
+
+    watch = g_new0 (SqualeMirrorWatch, 1);
+    watch->target = g_object_ref (target);
+    watch->mirror = g_object_ref (mirror);
+
+    channel = g_io_channel_unix_new (mirror->control_socket[0]);
+    g_io_add_watch_full (channel, G_PRIORITY_DEFAULT, G_IO_IN,
+                         squale_joblist_mirror_io_watch, watch,
+                         squale_joblist_mirror_watch_free);
+    /* The watch keeps its own ref */
+    g_io_channel_unref (channel);
 }
 
-/* This function locks the joblist and crawls inside to find a pending job
-   and assign it. If keep_locking is TRUE this function will not unlock the
-   joblist mutex when no pending job is found. This is used to do an atomic
-   switch to waiting mode in the worker being sure that the list is not touched
-   meanwhile */
-SqualeJob *
-squale_joblist_assign_pending_job (SqualeJobList *joblist,
-                                   gboolean keep_locking)
+/* Called by the client before removing its job, compares it with its
+   mirror if that one is complete already, otherwise the mirror does it when
+   it completes */
+void
+squale_joblist_detach_mirror (SqualeJobList *joblist, SqualeJob *job)
 {
-    GList *jobs = NULL;
+    SqualeJob *mirror = NULL;
 
-    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), NULL);
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+    g_return_if_fail (SQUALE_IS_JOB (job));
 
-    g_mutex_lock (joblist->list_mutex);
+    mirror = job->mirror;
+    if (!mirror)
+        return;
 
-    jobs = joblist->jobs;
+    job->mirror = NULL;
 
-    while (jobs) {
-        SqualeJob *job = SQUALE_JOB (jobs->data);
+    if (mirror->status == SQUALE_JOB_COMPLETE && mirror->mirror_of == job) {
+        if (job->status == SQUALE_JOB_COMPLETE) {
+            squale_joblist_compare_mirror (joblist, job, mirror);
+        }
+        mirror->mirror_of = NULL;
+        g_object_unref (job);
+    }
 
-        if (SQUALE_IS_JOB (job)) {
-            gboolean ret = FALSE;
+    g_object_unref (mirror);
+}
 
-            /* If this function returns TRUE we found a pending job and mark it as
-               processing while locked so that no worker can steal it at the same
-               time */
-            ret = squale_job_set_status_if_match (job, SQUALE_JOB_PROCESSING,
-                                                  SQUALE_JOB_PENDING);
-            if (ret) {
-                /* We return the job with an incremented reference count. Before the
-                 * reference was incremented in the worker_run function but that can
-                 * get us into a race if the job refcount is decremented because of
-                 * client disconnection between that function returns and the ref is
-                 * incremented. */
-                g_object_ref (job);
-                g_mutex_unlock (joblist->list_mutex);
-                g_message (_("Found pending job %p in joblist %s"), job, joblist->name);
-                return job;
-            }
-        }
+void
+squale_joblist_set_lifo_threshold (SqualeJobList *joblist,
+                                   guint lifo_threshold)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
 
-        jobs = g_list_next (jobs);
-    }
+    joblist->lifo_threshold = lifo_threshold;
+}
 
-    /* We don't unlock the joblist as g_cond_wait will do that in the worker */
-    if (!keep_locking) {
-        g_mutex_unlock (joblist->list_mutex);
-    }
+/* Sum up to max_size increments of the same counter, 0 or 1 disables it.
+   The oldest increment waits at most linger ms for others to join. */
+void
+squale_joblist_set_counter_batching (SqualeJobList *joblist, guint max_size,
+                                     guint linger)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
 
-    return NULL;
+    joblist->counter_batch_size = max_size;
+    joblist->counter_batch_linger = linger;
 }
 
-/* This function allows a worker to give up on a specific job. This will just
- * remove the job from the joblist, change its status back to pending and add
- * it again. */
-gboolean
-squale_joblist_giveup_job (SqualeJobList *joblist, SqualeJob *job)
+void
+squale_joblist_set_spill_threshold (SqualeJobList *joblist,
+                                    gulong spill_threshold)
 {
-    gboolean ret = FALSE;
-    GError *error = NULL;
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
 
-    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
-    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+    joblist->spill_threshold = spill_threshold;
+}
 
-    /* We take an extra ref to the job, as removing will unref */
-    g_object_ref (job);
-    /* Remove job from the list */
-    ret = squale_joblist_remove_job (joblist, job);
-    if (G_UNLIKELY (!ret)) {
-        g_warning ("failed removing job %p from joblist %p", job, joblist);
-        g_object_unref (job);
-        goto beach;
-    }
-    /* Change status back to pending */
-    ret = squale_job_set_status_if_match (job, SQUALE_JOB_PENDING,
-                                          SQUALE_JOB_PROCESSING);
-    if (G_UNLIKELY (!ret)) {
-        g_warning ("job %p was not in processing status", job);
-        goto beach;
-    }
-    /* Add the job back, this will steal our reference */
-    ret = squale_joblist_add_job (joblist, job, &error);
-    if (G_UNLIKELY (!ret)) {
-        g_warning ("failed adding job %p to joblist %p", job, joblist);
-        if (error) {
-            squale_job_set_error (job, error);
-        }
-        /* Declare the job as COMPLETE */
-        squale_job_set_status_if_match (job, SQUALE_JOB_COMPLETE,
-                                        SQUALE_JOB_PENDING);
+/* 0 means no limit */
+void
+squale_joblist_set_memory_budget (SqualeJobList *joblist, gulong limit)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    squale_memory_budget_set_limit (&(joblist->memory_budget), limit);
+}
+
+/* In ms, 0 means idle transactions are kept until the client leaves */
+void
+squale_joblist_set_transaction_timeout (SqualeJobList *joblist,
+                                        guint transaction_timeout)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    joblist->transaction_timeout = transaction_timeout;
+}
+
+void
+squale_joblist_set_spool (SqualeJobList *joblist, const char *path)
+{
+    g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+
+    if (joblist->spool_path) {
+        g_free (joblist->spool_path);
     }
 
-    beach:
-    return ret;
+    joblist->spool_path = g_strdup (path);
 }
 
 void
-squale_joblist_set_max_pending_warn_level (SqualeJobList *joblist,
-                                           guint max_pending)
+squale_joblist_set_spool_size (SqualeJobList *joblist, gulong size)
 {
     g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
 
-    joblist->max_pending_warn = max_pending;
+    joblist->spool_size = size;
+}
+
+/* Open the spool once the configuration is known, what it still holds gets
+   drained by the workers */
+gboolean
+squale_joblist_open_spool (SqualeJobList *joblist, GError **error)
+{
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
+
+    if (!joblist->spool_path || joblist->spool)
+        return TRUE;
+
+    joblist->spool = squale_spool_open (joblist->spool_path,
+                                        joblist->spool_size, error);
+
+    return joblist->spool != NULL;
 }
 
+/* Append the order of a no reply job to the spool. Like squale_joblist_add_job
+   that steals the reference of the caller, the job completes once the spool
+   has been synced. */
+gboolean
+squale_joblist_spool_job (SqualeJobList *joblist, SqualeJob *job,
+                          GError **error)
+{
+    g_return_val_if_fail (SQUALE_IS_JOBLIST (joblist), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+    g_return_val_if_fail (joblist->spool != NULL, FALSE);
+
+    if (!squale_spool_append (joblist->spool, job->query, error))
+        return FALSE;
+
+    joblist->spool_waiting = g_list_append (joblist->spool_waiting,
+                                            g_object_ref (job));
+
+    if (!joblist->spool_sync_id && !joblist->spool_syncing) {
+        joblist->spool_sync_id = g_idle_add (squale_joblist_sync_spool, joblist);
+    }
+
+    return TRUE;
+}
+
+/* The joblist takes ownership of the template */
 void
-squale_joblist_set_max_pending_block_level (SqualeJobList *joblist,
-                                            guint max_pending)
+squale_joblist_add_batch_template (SqualeJobList *joblist,
+                                   SqualeBatchTemplate *template)
 {
     g_return_if_fail (SQUALE_IS_JOBLIST (joblist));
+    g_return_if_fail (template != NULL);
 
-    joblist->max_pending_block = max_pending;
+    joblist->batch_templates = g_list_append (joblist->batch_templates,
+                                              template);
 }
 
 gboolean
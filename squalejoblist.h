@@ -26,8 +26,10 @@
 
 typedef struct _SqualeJobList SqualeJobList;
 typedef struct _SqualeJobListClass SqualeJobListClass;
+typedef struct _SqualeTenantLimit SqualeTenantLimit;
 
 #include "squalejob.h"
+#include "squalequeue.h"
 #include "squaleworker.h"
 
 #define SQUALE_TYPE_JOBLIST            (squale_joblist_get_type ())
@@ -37,6 +39,65 @@ typedef struct _SqualeJobListClass SqualeJobListClass;
 #define SQUALE_IS_JOBLIST_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), SQUALE_TYPE_JOBLIST))
 #define SQUALE_JOBLIST_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), SQUALE_TYPE_JOBLIST, SqualeJobListClass))
 
+/* Default idle transaction timeout (ms) */
+#define SQUALE_TRANSACTION_TIMEOUT 30000
+
+/* Threads syncing the spools of all joblists */
+#define SQUALE_JOBLIST_SYNC_THREADS 2
+
+/* Default CoDel interval (ms) */
+#define SQUALE_CODEL_INTERVAL 100
+
+/* Adaptive concurrency: the limit backs off when the average processing
+   time goes over that many times the baseline, which is the minimum
+   processing time of the last SQUALE_CONCURRENCY_WINDOW jobs */
+#define SQUALE_CONCURRENCY_TOLERANCE 2.0
+#define SQUALE_CONCURRENCY_WINDOW 1000
+
+/* Number of query fingerprints whose processing time is remembered */
+#define SQUALE_FINGERPRINT_HISTORY 4096
+
+/* Retries of reads whose connection died: default budget in percent of the
+   reads, retries which can be saved up, retries of a single job and backoff
+   before the first one (ms), doubled for each of the next ones */
+#define SQUALE_RETRY_PERCENT 10
+#define SQUALE_RETRY_BURST 10
+#define SQUALE_RETRY_MAX 3
+#define SQUALE_RETRY_BACKOFF 50
+
+/* Default time a job with an affinity key waits for its worker before
+   any worker can take it (ms) */
+#define SQUALE_AFFINITY_WAIT 10
+
+/* Hedged reads: number of read processing times the hedge delay is the 95th
+   percentile of, and hedges which can be saved up while reads are fast */
+#define SQUALE_HEDGE_SAMPLES 128
+#define SQUALE_HEDGE_BURST 10
+
+typedef enum
+{
+    SQUALE_JOBLIST_ERROR_FAILED,
+    /* Retryable, the client should send the order again later */
+    SQUALE_JOBLIST_ERROR_OVERLOADED,
+    /* The tenant of the job is over its rate or concurrency limit */
+    SQUALE_JOBLIST_ERROR_TENANT_LIMIT
+} SqualeJobListError;
+
+/* Limits of a tenant on a joblist: a token bucket refilled at rate orders
+   per second holding up to one second worth of tokens, and a maximum
+   number of jobs in flight. 0 means unlimited. Limits are only checked
+   and updated from the main loop. */
+struct _SqualeTenantLimit
+{
+    gdouble rate;
+    gdouble tokens;
+    struct timeval refill_ts;
+    guint max_in_flight;
+    guint in_flight;
+    /* Set from the configuration, not derived from the default */
+    gboolean configured;
+};
+
 typedef enum
 {
     SQUALE_JOBLIST_OPENED,
@@ -51,6 +112,57 @@ struct _SqualeJobList
 
     GList *jobs;
 
+    /* Order in which pending jobs are served, see squalequeue.h */
+    const SqualeQueueDiscipline *discipline;
+    guint lifo_threshold;
+
+    /* Fair queuing: tenant weights, finish tag of the last job of each
+       tenant and virtual time */
+    GHashTable *tenant_weights;
+    GHashTable *tenant_finish;
+    gdouble fair_virtual_time;
+
+    /* Slow lane: jobs whose fingerprint averaged more than slow_threshold ms
+       are run by at most slow_lane_workers workers at a time. Fingerprint
+       costs are EWMAs of the processing time in ms, the least recently
+       sampled are forgotten when there are too many */
+    GHashTable *fingerprint_costs;
+    gulong fingerprint_clock;
+    guint slow_threshold;
+    guint slow_lane_workers;
+    guint nb_slow_running;
+
+    /* Hedged reads: a read still running after hedge_delay ms, the p95 of
+       the last reads, is sent again to another endpoint. Each read earns
+       hedge_percent / 100 hedge tokens and each hedge costs one */
+    guint hedge_percent;
+    gdouble hedge_tokens;
+    guint hedge_delay;
+    gint32 read_latencies[SQUALE_HEDGE_SAMPLES];
+    guint nb_read_latencies;
+
+    /* Retry budget: each new read earns retry_percent / 100 retry tokens
+       and each retry costs one, so that retries can't amplify an outage */
+    guint retry_percent;
+    gdouble retry_tokens;
+
+    /* Affinity: a job with a key is kept for the live worker with the best
+       rendezvous score for that key during affinity_wait ms */
+    guint affinity_wait;
+
+    /* Shadow traffic: mirror_percent % of the reads are copied to the
+       joblist named mirror, their latency and errors are compared. No more
+       copies than the mirror has workers are running at a time, and none
+       while the mirror is saturated. Only touched from the main loop */
+    char *mirror;
+    guint mirror_percent;
+    guint nb_mirrors_running;
+    gboolean mirror_saturated;
+
+    /* Per tenant limits and the default for tenants not listed */
+    GHashTable *tenant_limits;
+    SqualeTenantLimit default_tenant_limit;
+
     GMutex *list_mutex;
     GCond *cond;
 
@@ -59,14 +171,108 @@ struct _SqualeJobList
     guint max_pending_warn;
     guint max_pending_block;
 
+    /* Workers only interactive jobs can use, jobs of lower priority classes
+       share the others */
+    guint reserved_workers;
+
+    /* Controlled delay: when no job waited less than codel_target ms during
+       a whole codel_interval the queue is standing and pending jobs waiting
+       longer than the target are dropped until a job gets through quickly
+       again. Drops are spaced by codel_interval / sqrt (codel_count), the
+       next one is due at codel_drop_ts. A target of 0 disables it */
+    guint codel_target;
+    guint codel_interval;
+    gint32 codel_min_sojourn;
+    struct timeval codel_interval_ts;
+    gboolean codel_dropping;
+    guint codel_count;
+    struct timeval codel_drop_ts;
+
+    /* Adaptive concurrency limit: workers over concurrency_limit stay parked.
+       The limit grows by one every limit jobs while processing time stays
+       close to the baseline and is cut by 10% when it rises. Times are in
+       microseconds */
+    gboolean adaptive_concurrency;
+    gdouble concurrency_limit;
+    guint nb_in_flight;
+    gint64 latency_baseline;
+    gint64 latency_window_min;
+    gdouble latency_average;
+    guint nb_latency_samples;
+    guint nb_since_decrease;
+
+    /* Identical read-only queries already in the list get the result of the
+       first one instead of hitting the backend again */
+    gboolean coalesce_reads;
+
+    /* Point lookups matching one of these templates are merged together, the
+       wakeup time tells waiting workers when a held batch is due */
+    GList *batch_templates;
+    struct timeval batch_wakeup_ts;
+
+    /* Single row inserts into the same columns are merged in multi-row
+       inserts of up to insert_batch_size rows, waiting at most
+       insert_batch_linger ms. Counter increments of the same row are summed
+       the same way. Their templates are keyed by statement shape */
+    guint insert_batch_size;
+    guint insert_batch_linger;
+    guint counter_batch_size;
+    guint counter_batch_linger;
+    GHashTable *write_templates;
+
+    /* Resultsets larger than that are spilled to disk, 0 disables it */
+    gulong spill_threshold;
+
+    /* Bytes held by the resultsets of that joblist */
+    SqualeMemoryBudget memory_budget;
+
     GList *workers;
 
+    /* Workers kept by a client session, at least one worker stays free */
+    guint nb_pinned;
+
+    /* An idle transaction gets rolled back after that many ms, 0 disables it */
+    guint transaction_timeout;
+
+    /* No reply orders are acked once synced to the spool, the sync starts
+       when the main loop is idle for all the orders received meanwhile and
+       runs in the sync pool */
+    char *spool_path;
+    gulong spool_size;
+    SqualeSpool *spool;
+    GList *spool_waiting;
+    guint spool_sync_id;
+    gboolean spool_syncing;
+
     /* Statistics */
     gulong assign_total_time;
     gulong nb_assign;
     gulong process_total_time;
     gulong nb_process;
     gulong nb_errors;
+    gulong nb_coalesced;
+    gulong nb_batches;
+    gulong nb_batched;
+    gulong nb_budget_rejections;
+    gulong nb_transaction_timeouts;
+    gulong nb_deadline_expired;
+    gulong nb_abandoned;
+    gulong nb_shed;
+    gulong nb_codel_drops;
+    gulong nb_tenant_rejections;
+    gulong nb_slow_jobs;
+    gulong nb_hedges;
+    gulong nb_hedge_wins;
+    gulong nb_retries;
+    gulong nb_affinity_hits;
+    gulong nb_affinity_misses;
+    gulong nb_mirrored;
+    gulong nb_mirror_dropped;
+    gulong nb_mirror_compared;
+    gulong nb_mirror_errors;
+    gulong nb_mirror_fixes;
+    guint64 mirror_primary_time;
+    guint64 mirror_time;
 
     struct timeval startup_ts;
 };
@@ -82,6 +288,7 @@ struct _SqualeJobListClass
 };
 
 GType squale_joblist_get_type (void);
+GQuark squale_joblist_error_quark (void);
 
 SqualeJobList *squale_joblist_new (void);
 
@@ -93,7 +300,9 @@ char * squale_joblist_get_backend (SqualeJobList *joblist);
 gboolean squale_joblist_add_job (SqualeJobList *joblist, SqualeJob *job,
                                  GError **error);
 gboolean squale_joblist_remove_job (SqualeJobList *joblist, SqualeJob *job);
+gboolean squale_joblist_cancel_job (SqualeJobList *joblist, SqualeJob *job);
 SqualeJob *squale_joblist_assign_pending_job (SqualeJobList *joblist,
+                                              SqualeWorker *worker,
                                               gboolean keep_locking);
 gboolean squale_joblist_giveup_job (SqualeJobList *joblist, SqualeJob *job);
 
@@ -103,6 +312,60 @@ void squale_joblist_set_max_pending_warn_level (SqualeJobList *joblist,
 void squale_joblist_set_max_pending_block_level (SqualeJobList *joblist,
                                                  guint max_pending);
 
+void squale_joblist_set_coalesce_reads (SqualeJobList *joblist,
+                                        gboolean coalesce_reads);
+void squale_joblist_add_batch_template (SqualeJobList *joblist,
+                                        SqualeBatchTemplate *template);
+void squale_joblist_set_insert_batching (SqualeJobList *joblist, guint max_size,
+                                         guint linger);
+gboolean squale_joblist_set_queue_discipline (SqualeJobList *joblist,
+                                              const char *name);
+void squale_joblist_set_adaptive_concurrency (SqualeJobList *joblist,
+                                              gboolean adaptive);
+void squale_joblist_sample_latency (SqualeJobList *joblist, SqualeJob *job);
+void squale_joblist_set_codel (SqualeJobList *joblist, guint target,
+                               guint interval);
+void squale_joblist_set_reserved_workers (SqualeJobList *joblist,
+                                          guint reserved_workers);
+void squale_joblist_set_tenant_weight (SqualeJobList *joblist,
+                                       const char *tenant, guint weight);
+void squale_joblist_set_tenant_rate (SqualeJobList *joblist,
+                                     const char *tenant, gdouble rate);
+void squale_joblist_set_tenant_concurrency (SqualeJobList *joblist,
+                                            const char *tenant,
+                                            guint max_in_flight);
+gboolean squale_joblist_admit_tenant (SqualeJobList *joblist, SqualeJob *job,
+                                      GError **error);
+void squale_joblist_release_tenant (SqualeJobList *joblist, SqualeJob *job);
+void squale_joblist_set_slow_lane (SqualeJobList *joblist, guint threshold,
+                                   guint max_workers);
+void squale_joblist_set_hedging (SqualeJobList *joblist, guint percent);
+guint squale_joblist_get_hedge_delay (SqualeJobList *joblist, SqualeJob *job);
+SqualeJob *squale_joblist_hedge_job (SqualeJobList *joblist, SqualeJob *job);
+void squale_joblist_set_retry_budget (SqualeJobList *joblist, guint percent);
+gboolean squale_joblist_retry_job (SqualeJobList *joblist, SqualeJob *job);
+void squale_joblist_set_affinity_wait (SqualeJobList *joblist,
+                                       guint affinity_wait);
+void squale_joblist_set_mirror (SqualeJobList *joblist, const char *mirror,
+                                guint percent);
+void squale_joblist_mirror_job (SqualeJobList *joblist, SqualeJob *job,
+                                SqualeJobList *target);
+void squale_joblist_detach_mirror (SqualeJobList *joblist, SqualeJob *job);
+void squale_joblist_set_lifo_threshold (SqualeJobList *joblist,
+                                        guint lifo_threshold);
+void squale_joblist_set_counter_batching (SqualeJobList *joblist, guint max_size,
+                                          guint linger);
+void squale_joblist_set_spill_threshold (SqualeJobList *joblist,
+                                         gulong spill_threshold);
+void squale_joblist_set_memory_budget (SqualeJobList *joblist, gulong limit);
+void squale_joblist_set_transaction_timeout (SqualeJobList *joblist,
+                                             guint transaction_timeout);
+void squale_joblist_set_spool (SqualeJobList *joblist, const char *path);
+void squale_joblist_set_spool_size (SqualeJobList *joblist, gulong size);
+gboolean squale_joblist_open_spool (SqualeJobList *joblist, GError **error);
+gboolean squale_joblist_spool_job (SqualeJobList *joblist, SqualeJob *job,
+                                   GError **error);
+
 gboolean squale_joblist_clear (SqualeJobList *joblist);
 
 void squale_joblist_startup (SqualeJobList *joblist);
@@ -26,6 +26,8 @@
 #include "squale.h"
 #include "squalemysqlworker.h"
 #include "squale-i18n.h"
+#include <mysql/errmsg.h>
+#include <mysql/mysqld_error.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -41,7 +43,8 @@ enum
     PROP_PORT,
     PROP_USER,
     PROP_PASSWD,
-    PROP_DBNAME
+    PROP_DBNAME,
+    PROP_STATEMENT_CACHE_SIZE
 };
 
 static SqualeWorkerClass *parent_class = NULL;
@@ -61,14 +64,74 @@ squale_mysql_worker_error_quark (void)
     return quark;
 }
 
+/* Native type of a MySQL column in the binary and columnar encodings */
+static SqualeColumnType
+squale_mysql_worker_column_type (MYSQL_FIELD *field)
+{
+    switch (field->type) {
+        case MYSQL_TYPE_TINY:
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_YEAR:
+            return SQUALE_COLUMN_INT64;
+        case MYSQL_TYPE_LONGLONG:
+            /* Unsigned 64 bits integers don't fit */
+            if (field->flags & UNSIGNED_FLAG)
+                return SQUALE_COLUMN_TEXT;
+            return SQUALE_COLUMN_INT64;
+        case MYSQL_TYPE_FLOAT:
+        case MYSQL_TYPE_DOUBLE:
+            return SQUALE_COLUMN_DOUBLE;
+        case MYSQL_TYPE_TIMESTAMP:
+        case MYSQL_TYPE_DATETIME:
+        case MYSQL_TYPE_DATE:
+            return SQUALE_COLUMN_TIMESTAMP;
+        default:
+            /* Decimals are kept as text to preserve their precision */
+            return SQUALE_COLUMN_TEXT;
+    }
+}
+
+/* Pack the columns of a result, shared by plain and prepared queries */
+static gboolean
+squale_mysql_worker_store_columns (SqualeJob *job, MYSQL_RES *result)
+{
+    MYSQL_FIELD *fields;
+    gint32 num_fields = 0, i;
+
+    num_fields = (gint32) mysql_num_fields (result);
+
+    if (!squale_resultset_begin (job->resultset, job->encoding, num_fields))
+        return FALSE;
+
+    /* Getting columns names */
+    fields = mysql_fetch_fields (result);
+
+    /* Packing columns names */
+    for (i = 0; i < num_fields; i++) {
+        gint32 field_length = 0;
+        if (fields[i].name) {
+            field_length = strlen (fields[i].name);
+        }
+        if (!squale_resultset_add_column (job->resultset, fields[i].name,
+                                          field_length,
+                                          squale_mysql_worker_column_type (&(fields[i])))) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
 static gboolean
 squale_mysql_worker_store_resultset (SqualeMysqlWorker *my_worker,
                                      SqualeJob *job, MYSQL_RES *result)
 {
-    MYSQL_FIELD *fields;
     MYSQL_ROW row;
+    GError *error = NULL;
     gint32 num_fields = 0, i;
-    gulong offset = 0, num_rows = 0, j;
+    gulong num_rows = 0, j;
 
     g_return_val_if_fail (SQUALE_IS_MYSQL_WORKER (my_worker), FALSE);
     g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
@@ -77,68 +140,345 @@ squale_mysql_worker_store_resultset (SqualeMysqlWorker *my_worker,
     num_fields = (gint32) mysql_num_fields (result);
     num_rows = (gulong) mysql_num_rows (result);
 
-    /* Let's allocate the needed memory in the resultset data buffer.
-       We need 2 gint32 and a char for the header then we can start packing
-       our data */
-    job->resultset->allocated_memory = SQUALE_PAGE_SIZE;
-    job->resultset->data = g_malloc0 (job->resultset->allocated_memory);
+    if (!squale_mysql_worker_store_columns (job, result))
+        goto failed;
 
-    /* Packing number of fields */
-    squale_check_mem_block (&(job->resultset->data),
-                            &(job->resultset->allocated_memory), offset,
-                            3 * sizeof (gint32) + sizeof (char));
+    /* Packing data row by row */
+    for (j = 0; j < num_rows; j++) {
+        unsigned long *lengths;
 
-    offset = 2 * sizeof (gint32) + sizeof (char);
+        row = mysql_fetch_row (result);
+        lengths = mysql_fetch_lengths (result);
 
-    *(gint32 *)(job->resultset->data + offset) = num_fields;
-    offset += sizeof (gint32);
+        for (i = 0; i < num_fields; i++) {
+            if (!squale_resultset_add_value (job->resultset, row[i],
+                                             (gint32) lengths[i]))
+                goto failed;
+        }
+        if (!squale_resultset_end_row (job->resultset))
+            goto failed;
+    }
 
-    /* Getting columns names */
-    fields = mysql_fetch_fields (result);
+    if (!squale_resultset_finish (job->resultset))
+        goto failed;
 
-    /* Packing columns names */
+    return TRUE;
+
+failed:
+    squale_resultset_abort (job->resultset);
+    error = squale_resultset_get_error (job->resultset);
+    if (!error)
+        error = g_error_new (squale_mysql_worker_error_quark (), 0, _("Failed packing resultset"));
+    squale_job_set_error (job, error);
+    return FALSE;
+}
+
+static void
+squale_mysql_worker_close_statement (gpointer data)
+{
+    mysql_stmt_close ((MYSQL_STMT *) data);
+}
+
+static gboolean
+squale_mysql_worker_true_func (gpointer key, gpointer value, gpointer user_data)
+{
+    return TRUE;
+}
+
+/* Get a prepared statement for that text from the cache or prepare it,
+   cached tells which one it was */
+static MYSQL_STMT *
+squale_mysql_worker_get_statement (SqualeMysqlWorker *my_worker,
+                                   const char *query, gboolean *cached,
+                                   GError **error)
+{
+    MYSQL_STMT *stmt = NULL;
+
+    stmt = g_hash_table_lookup (my_worker->statements, query);
+    *cached = stmt != NULL;
+    if (stmt)
+        return stmt;
+
+    stmt = mysql_stmt_init (&(my_worker->mysql));
+    if (!stmt) {
+        g_set_error (error, squale_mysql_worker_error_quark (), 0, "%s",
+                     mysql_error (&(my_worker->mysql)));
+        return NULL;
+    }
+
+    if (mysql_stmt_prepare (stmt, query, strlen (query))) {
+        g_set_error (error, squale_mysql_worker_error_quark (), 0, "%s",
+                     mysql_stmt_error (stmt));
+        mysql_stmt_close (stmt);
+        return NULL;
+    }
+
+    /* The cache is full, start again from scratch */
+    if (my_worker->statement_cache_size &&
+        g_hash_table_size (my_worker->statements) >=
+        my_worker->statement_cache_size) {
+        g_hash_table_foreach_remove (my_worker->statements,
+                                     squale_mysql_worker_true_func, NULL);
+    }
+
+    if (my_worker->statement_cache_size) {
+        g_hash_table_insert (my_worker->statements, g_strdup (query), stmt);
+    }
+
+    return stmt;
+}
+
+/* Pack the rows of an executed prepared statement. Each column is fetched
+   separately once we know its length. */
+static gboolean
+squale_mysql_worker_store_statement_resultset (SqualeMysqlWorker *my_worker,
+                                               SqualeJob *job, MYSQL_STMT *stmt,
+                                               MYSQL_RES *metadata)
+{
+    MYSQL_BIND *binds = NULL;
+    unsigned long *lengths = NULL;
+    my_bool *nulls = NULL;
+    char *buffer = NULL;
+    gulong buffer_size = 0;
+    gint32 num_fields = 0, i;
+    gint status;
+    gboolean ret = TRUE;
+    GError *error = NULL;
+
+    num_fields = (gint32) mysql_num_fields (metadata);
+
+    binds = g_new0 (MYSQL_BIND, num_fields);
+    lengths = g_new0 (unsigned long, num_fields);
+    nulls = g_new0 (my_bool, num_fields);
+
+    /* No buffer at all, we only want the lengths */
     for (i = 0; i < num_fields; i++) {
-        gint32 field_length = 0;
-        if (fields[i].name) {
-            field_length = strlen (fields[i].name);
-        }
-        squale_check_mem_block (&(job->resultset->data),
-                                &(job->resultset->allocated_memory), offset,
-                                sizeof (gint32) + field_length);
-        *(gint32 *)(job->resultset->data + offset) = field_length;
-        offset += sizeof (gint32);
-        memcpy (job->resultset->data + offset, fields[i].name, field_length);
-        offset += field_length;
-    }
-
-    /* Packing number of rows */
-    squale_check_mem_block (&(job->resultset->data),
-                            &(job->resultset->allocated_memory), offset,
-                            sizeof (gulong));
-    *(gulong *)(job->resultset->data + offset) = num_rows;
-    offset += sizeof (gulong);
+        binds[i].buffer_type = MYSQL_TYPE_STRING;
+        binds[i].length = &(lengths[i]);
+        binds[i].is_null = &(nulls[i]);
+    }
+
+    if (mysql_stmt_bind_result (stmt, binds) || mysql_stmt_store_result (stmt)) {
+        GError *error = g_error_new (squale_mysql_worker_error_quark (), 0,
+                                     "%s", mysql_stmt_error (stmt));
+        squale_job_set_error (job, error);
+        ret = FALSE;
+        goto beach;
+    }
+
+    if (!squale_mysql_worker_store_columns (job, metadata)) {
+        ret = FALSE;
+        goto packing_failed;
+    }
 
     /* Packing data row by row */
-    for (j = 0; j < num_rows; j++) {
-        row = mysql_fetch_row (result);
+    while ((status = mysql_stmt_fetch (stmt)) == 0 ||
+           status == MYSQL_DATA_TRUNCATED) {
         for (i = 0; i < num_fields; i++) {
-            gint32 field_length = 0;
-            if (row[i]) {
-                field_length = strlen (row[i]);
+            if (nulls[i]) {
+                ret = squale_resultset_add_value (job->resultset, NULL, 0);
             }
-            squale_check_mem_block (&(job->resultset->data),
-                                    &(job->resultset->allocated_memory),
-                                    offset, sizeof (gint32) + field_length);
-            *(gint32 *)(job->resultset->data + offset) = field_length;
-            offset += sizeof (gint32);
-            memcpy (job->resultset->data + offset, row[i], field_length);
-            offset += field_length;
+            else {
+                MYSQL_BIND column;
+
+                /* Room for the terminating zero written by the library */
+                if (lengths[i] + 1 > buffer_size) {
+                    buffer_size = lengths[i] + 1;
+                    buffer = g_realloc (buffer, buffer_size);
+                }
+
+                memset (&column, 0, sizeof (MYSQL_BIND));
+                column.buffer_type = MYSQL_TYPE_STRING;
+                column.buffer = buffer;
+                column.buffer_length = buffer_size;
+                if (lengths[i]) {
+                    mysql_stmt_fetch_column (stmt, &column, i, 0);
+                }
+                ret = squale_resultset_add_value (job->resultset, buffer,
+                                                  (gint32) lengths[i]);
+            }
+            if (!ret)
+                goto packing_failed;
         }
+        if (!squale_resultset_end_row (job->resultset))
+            goto packing_failed;
     }
 
-    job->resultset->data_size = offset;
+    if (status != MYSQL_NO_DATA) {
+        GError *error = g_error_new (squale_mysql_worker_error_quark (), 0,
+                                     "%s", mysql_stmt_error (stmt));
+        squale_job_set_error (job, error);
+        squale_resultset_abort (job->resultset);
+        ret = FALSE;
+        goto beach;
+    }
 
-    return TRUE;
+    if (!squale_resultset_finish (job->resultset))
+        goto packing_failed;
+
+    goto beach;
+
+packing_failed:
+    squale_resultset_abort (job->resultset);
+    error = squale_resultset_get_error (job->resultset);
+    if (!error)
+        error = g_error_new (squale_mysql_worker_error_quark (), 0, _("Failed packing resultset"));
+    squale_job_set_error (job, error);
+    ret = FALSE;
+
+beach:
+    mysql_stmt_free_result (stmt);
+
+    g_free (binds);
+    g_free (lengths);
+    g_free (nulls);
+    g_free (buffer);
+
+    return ret;
+}
+
+/* Run the query of a plain job. A SELECT with a deadline gets the time left
+   as an optimizer hint so that the server stops it on its own, servers
+   older than 5.7.8 take the hint for a comment */
+static gint
+squale_mysql_worker_query (SqualeMysqlWorker *my_worker, SqualeJob *job)
+{
+    const char *walk = job->query;
+    gint32 time_left;
+    char *query = NULL;
+    gint ret;
+
+    time_left = squale_job_get_time_left (job);
+
+    while (g_ascii_isspace (*walk))
+        walk++;
+
+    if (time_left == G_MAXINT32 || !job->read_only ||
+        g_ascii_strncasecmp (walk, "select", strlen ("select")) ||
+        !g_ascii_isspace (walk[strlen ("select")])) {
+        return mysql_query (&(my_worker->mysql), job->query);
+    }
+
+    walk += strlen ("select");
+    query = g_strdup_printf ("%.*s /*+ MAX_EXECUTION_TIME(%d) */%s",
+                             (gint) (walk - job->query), job->query,
+                             MAX (time_left, 1), walk);
+
+    ret = mysql_query (&(my_worker->mysql), query);
+
+    g_free (query);
+
+    return ret;
+}
+
+/* Execute a parameterized job through a cached prepared statement. stale
+   is set if a cached statement was unknown to the server, the statement was
+   then not run at all and can be prepared again */
+static gboolean
+squale_mysql_worker_execute_prepared (SqualeMysqlWorker *my_worker,
+                                      SqualeJob *job, gboolean *stale,
+                                      GError **error)
+{
+    MYSQL_STMT *stmt = NULL;
+    MYSQL_BIND *binds = NULL;
+    MYSQL_RES *metadata = NULL;
+    gint64 *ints = NULL;
+    gdouble *doubles = NULL;
+    unsigned long *lengths = NULL;
+    my_bool is_null = 1;
+    guint i, nb_params = job->params ? job->params->len : 0;
+    gboolean ret = TRUE, cached = FALSE;
+
+    *stale = FALSE;
+
+    stmt = squale_mysql_worker_get_statement (my_worker, job->query, &cached,
+                                              error);
+    if (!stmt)
+        return FALSE;
+
+    if (mysql_stmt_param_count (stmt) != nb_params) {
+        g_set_error (error, squale_mysql_worker_error_quark (), 0,
+                     _("Statement expects %lu parameters, got %u"),
+                     mysql_stmt_param_count (stmt), nb_params);
+        ret = FALSE;
+        goto beach;
+    }
+
+    binds = g_new0 (MYSQL_BIND, nb_params + 1);
+    ints = g_new0 (gint64, nb_params + 1);
+    doubles = g_new0 (gdouble, nb_params + 1);
+    lengths = g_new0 (unsigned long, nb_params + 1);
+
+    for (i = 0; i < nb_params; i++) {
+        SqualeJobParam *param = g_ptr_array_index (job->params, i);
+
+        switch (param->type) {
+            case SQUALE_PARAM_INT:
+                ints[i] = g_ascii_strtoll (param->value, NULL, 10);
+                binds[i].buffer_type = MYSQL_TYPE_LONGLONG;
+                binds[i].buffer = &(ints[i]);
+                break;
+            case SQUALE_PARAM_DOUBLE:
+                doubles[i] = g_ascii_strtod (param->value, NULL);
+                binds[i].buffer_type = MYSQL_TYPE_DOUBLE;
+                binds[i].buffer = &(doubles[i]);
+                break;
+            case SQUALE_PARAM_STRING:
+                lengths[i] = strlen (param->value);
+                binds[i].buffer_type = MYSQL_TYPE_STRING;
+                binds[i].buffer = param->value;
+                binds[i].buffer_length = lengths[i];
+                binds[i].length = &(lengths[i]);
+                break;
+            case SQUALE_PARAM_NULL:
+            default:
+                binds[i].buffer_type = MYSQL_TYPE_NULL;
+                binds[i].is_null = &is_null;
+                break;
+        }
+    }
+
+    if ((nb_params && mysql_stmt_bind_param (stmt, binds)) ||
+        mysql_stmt_execute (stmt)) {
+        guint code = mysql_stmt_errno (stmt);
+
+        g_set_error (error, squale_mysql_worker_error_quark (), 0, "%s",
+                     mysql_stmt_error (stmt));
+        *stale = cached && (code == CR_NO_PREPARE_STMT ||
+                            code == ER_UNKNOWN_STMT_HANDLER);
+        ret = FALSE;
+        goto beach;
+    }
+
+    metadata = mysql_stmt_result_metadata (stmt);
+    if (metadata) {
+        squale_mysql_worker_store_statement_resultset (my_worker, job, stmt,
+                                                       metadata);
+        mysql_free_result (metadata);
+    }
+    else {
+        /* The statement was not supposed to return data */
+        job->affected_rows = mysql_stmt_affected_rows (stmt);
+    }
+
+beach:
+    /* A failing statement might be stale after a reconnection, make sure we
+       prepare it again next time */
+    if (!ret) {
+        if (!g_hash_table_remove (my_worker->statements, job->query)) {
+            mysql_stmt_close (stmt);
+        }
+    }
+    else if (!my_worker->statement_cache_size) {
+        mysql_stmt_close (stmt);
+    }
+
+    g_free (binds);
+    g_free (ints);
+    g_free (doubles);
+    g_free (lengths);
+
+    return ret;
 }
 
 static gboolean
@@ -220,6 +560,15 @@ squale_mysql_worker_disconnect (SqualeWorker *worker)
     g_message (_("Joblist '%s': MySQL worker (%p) shutting down connection to " \
              "%s"), joblist_name, worker, my_worker->dbname);
 
+    /* Prepared statements and cursors belong to the connection */
+    g_hash_table_foreach_remove (my_worker->statements,
+                                 squale_mysql_worker_true_func, NULL);
+
+    if (my_worker->cursor) {
+        mysql_free_result (my_worker->cursor);
+        my_worker->cursor = NULL;
+    }
+
     mysql_close (&(my_worker->mysql));
 
     if (joblist_name)
@@ -228,6 +577,267 @@ squale_mysql_worker_disconnect (SqualeWorker *worker)
     return TRUE;
 }
 
+/* Pack the next job->cursor_rows rows of the cursor, all of them if 0 */
+static gboolean
+squale_mysql_worker_fetch_page (SqualeMysqlWorker *my_worker, SqualeJob *job)
+{
+    MYSQL_ROW row = NULL;
+    GError *error = NULL;
+    gint32 num_fields = 0, i;
+    guint nb_rows = 0;
+
+    if (!squale_mysql_worker_store_columns (job, my_worker->cursor))
+        goto failed;
+
+    num_fields = (gint32) mysql_num_fields (my_worker->cursor);
+
+    while (!job->cursor_rows || nb_rows < job->cursor_rows) {
+        unsigned long *lengths;
+
+        row = mysql_fetch_row (my_worker->cursor);
+        if (!row)
+            break;
+
+        lengths = mysql_fetch_lengths (my_worker->cursor);
+
+        for (i = 0; i < num_fields; i++) {
+            if (!squale_resultset_add_value (job->resultset, row[i],
+                                             (gint32) lengths[i]))
+                goto failed;
+        }
+        if (!squale_resultset_end_row (job->resultset))
+            goto failed;
+
+        nb_rows++;
+    }
+
+    /* mysql_fetch_row returns NULL at the end of the rows and on errors */
+    if (!row && mysql_errno (&(my_worker->mysql))) {
+        squale_resultset_abort (job->resultset);
+        squale_job_set_error (job, g_error_new (squale_mysql_worker_error_quark (), 0,
+                                                "%s", mysql_error (&(my_worker->mysql))));
+        SQUALE_WORKER (my_worker)->nb_errors++;
+        return FALSE;
+    }
+
+    if (!squale_resultset_finish (job->resultset))
+        goto failed;
+
+    return row != NULL;
+
+failed:
+    squale_resultset_abort (job->resultset);
+    error = squale_resultset_get_error (job->resultset);
+    if (!error)
+        error = g_error_new (squale_mysql_worker_error_quark (), 0,
+                             _("Failed packing resultset"));
+    squale_job_set_error (job, error);
+    return FALSE;
+}
+
+/* Rows of the cursor are read from the server as they are fetched, the
+   connection is dedicated to it until it is closed */
+static gboolean
+squale_mysql_worker_open_cursor (SqualeWorker *worker, SqualeJob *job)
+{
+    SqualeMysqlWorker *my_worker = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_MYSQL_WORKER (worker), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    my_worker = SQUALE_MYSQL_WORKER (worker);
+
+    if (mysql_query (&(my_worker->mysql), job->query)) {
+        squale_job_set_error (job, g_error_new (squale_mysql_worker_error_quark (), 0,
+                                                "%s", mysql_error (&(my_worker->mysql))));
+        worker->nb_errors++;
+        return FALSE;
+    }
+
+    my_worker->cursor = mysql_use_result (&(my_worker->mysql));
+    if (!my_worker->cursor) {
+        if (mysql_field_count (&(my_worker->mysql)) == 0) {
+            /* Nothing to page through */
+            job->affected_rows = mysql_affected_rows (&(my_worker->mysql));
+        }
+        else {
+            squale_job_set_error (job, g_error_new (squale_mysql_worker_error_quark (), 0,
+                                                    "%s", mysql_error (&(my_worker->mysql))));
+            worker->nb_errors++;
+        }
+        return FALSE;
+    }
+
+    return squale_mysql_worker_fetch_page (my_worker, job);
+}
+
+static gboolean
+squale_mysql_worker_fetch_cursor (SqualeWorker *worker, SqualeJob *job)
+{
+    SqualeMysqlWorker *my_worker = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_MYSQL_WORKER (worker), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    my_worker = SQUALE_MYSQL_WORKER (worker);
+
+    if (!my_worker->cursor)
+        return FALSE;
+
+    return squale_mysql_worker_fetch_page (my_worker, job);
+}
+
+/* Freeing an unbuffered result reads the remaining rows */
+static void
+squale_mysql_worker_close_cursor (SqualeWorker *worker)
+{
+    SqualeMysqlWorker *my_worker = NULL;
+
+    g_return_if_fail (SQUALE_IS_MYSQL_WORKER (worker));
+
+    my_worker = SQUALE_MYSQL_WORKER (worker);
+
+    if (my_worker->cursor) {
+        mysql_free_result (my_worker->cursor);
+        my_worker->cursor = NULL;
+    }
+}
+
+static gboolean
+squale_mysql_worker_begin_transaction (SqualeWorker *worker, GError **error)
+{
+    SqualeMysqlWorker *my_worker = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_MYSQL_WORKER (worker), FALSE);
+
+    my_worker = SQUALE_MYSQL_WORKER (worker);
+
+    if (mysql_query (&(my_worker->mysql), "START TRANSACTION")) {
+        g_set_error (error, squale_mysql_worker_error_quark (), 0, "%s",
+                     mysql_error (&(my_worker->mysql)));
+        return FALSE;
+    }
+
+    /* The transaction lives on that connection, a reconnection ends it */
+    g_mutex_lock (worker->status_mutex);
+    my_worker->thread_id = mysql_thread_id (&(my_worker->mysql));
+    g_mutex_unlock (worker->status_mutex);
+
+    return TRUE;
+}
+
+static gboolean
+squale_mysql_worker_commit_transaction (SqualeWorker *worker, GError **error)
+{
+    SqualeMysqlWorker *my_worker = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_MYSQL_WORKER (worker), FALSE);
+
+    my_worker = SQUALE_MYSQL_WORKER (worker);
+
+    if (mysql_commit (&(my_worker->mysql))) {
+        g_set_error (error, squale_mysql_worker_error_quark (), 0, "%s",
+                     mysql_error (&(my_worker->mysql)));
+        return FALSE;
+    }
+
+    /* Reconnected on the way, the transaction was rolled back with the old
+       connection and we committed nothing */
+    if (my_worker->thread_id != mysql_thread_id (&(my_worker->mysql))) {
+        g_set_error (error, squale_mysql_worker_error_quark (), 0,
+                     _("Connection lost, the transaction was rolled back"));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+squale_mysql_worker_rollback_transaction (SqualeWorker *worker, GError **error)
+{
+    SqualeMysqlWorker *my_worker = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_MYSQL_WORKER (worker), FALSE);
+
+    my_worker = SQUALE_MYSQL_WORKER (worker);
+
+    if (mysql_rollback (&(my_worker->mysql))) {
+        g_set_error (error, squale_mysql_worker_error_quark (), 0, "%s",
+                     mysql_error (&(my_worker->mysql)));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Called from a cancel thread, the statement is killed from a side
+   connection which is kept for next time */
+static void
+squale_mysql_worker_cancel (SqualeWorker *worker)
+{
+    SqualeMysqlWorker *my_worker = NULL;
+    char *query = NULL;
+    gulong thread_id;
+    guint nb_tries;
+
+    g_return_if_fail (SQUALE_IS_MYSQL_WORKER (worker));
+
+    my_worker = SQUALE_MYSQL_WORKER (worker);
+
+    g_mutex_lock (worker->status_mutex);
+    thread_id = my_worker->thread_id;
+    g_mutex_unlock (worker->status_mutex);
+
+    query = g_strdup_printf ("KILL QUERY %lu", thread_id);
+
+    /* The side connection might have timed out since last time */
+    for (nb_tries = 0; nb_tries < 2; nb_tries++) {
+        if (!my_worker->killer) {
+            guint timeout = 1;
+
+            my_worker->killer = mysql_init (NULL);
+            mysql_options (my_worker->killer, MYSQL_OPT_CONNECT_TIMEOUT,
+                           (const char *) &timeout);
+            mysql_options (my_worker->killer, MYSQL_OPT_READ_TIMEOUT,
+                           (const char *) &timeout);
+            mysql_options (my_worker->killer, MYSQL_OPT_WRITE_TIMEOUT,
+                           (const char *) &timeout);
+            if (!mysql_real_connect (my_worker->killer, my_worker->host,
+                                     my_worker->user, my_worker->passwd,
+                                     NULL, my_worker->port, NULL, 0)) {
+                g_warning (_("MySQL worker (%p) failed connecting to cancel its " \
+                     "statement: %s"), worker, mysql_error (my_worker->killer));
+                mysql_close (my_worker->killer);
+                my_worker->killer = NULL;
+                break;
+            }
+        }
+
+        if (!mysql_query (my_worker->killer, query))
+            break;
+
+        g_warning (_("MySQL worker (%p) failed cancelling its statement: %s"),
+                   worker, mysql_error (my_worker->killer));
+        mysql_close (my_worker->killer);
+        my_worker->killer = NULL;
+    }
+
+    g_free (query);
+}
+
+static gboolean
+squale_mysql_worker_connection_lost (SqualeWorker *worker)
+{
+    guint error;
+
+    g_return_val_if_fail (SQUALE_IS_MYSQL_WORKER (worker), FALSE);
+
+    error = mysql_errno (&(SQUALE_MYSQL_WORKER (worker)->mysql));
+
+    return error == CR_SERVER_GONE_ERROR || error == CR_SERVER_LOST ||
+           error == CR_CONNECTION_ERROR || error == CR_CONN_HOST_ERROR;
+}
+
 static gpointer
 squale_mysql_worker_run (gpointer worker)
 {
@@ -252,7 +862,9 @@ squale_mysql_worker_run (gpointer worker)
     while (!squale_worker_check_shutdown (SQUALE_WORKER (my_worker))) {
 
         if (job == NULL) {
-            job = squale_joblist_assign_pending_job (joblist, FALSE);
+            job = squale_joblist_assign_pending_job (joblist,
+                                                     SQUALE_WORKER (my_worker),
+                                                     FALSE);
         }
 
         if (SQUALE_IS_JOB (job)) {
@@ -260,6 +872,15 @@ squale_mysql_worker_run (gpointer worker)
 
             squale_worker_set_status (SQUALE_WORKER (my_worker), job->query);
 
+            /* Cursor and transaction orders, no ping as the connection might
+               be in the middle of reading rows */
+            if (squale_worker_run_session_job (SQUALE_WORKER (my_worker), job)) {
+                g_object_unref (job);
+                job = NULL;
+                squale_worker_set_status (SQUALE_WORKER (my_worker), _("Sleeping"));
+                continue;
+            }
+
             if (mysql_ping (&(my_worker->mysql)) != 0) {
                 /* Our connection died, release the reference to that job and make it
                  * available again on the job list */
@@ -281,8 +902,59 @@ squale_mysql_worker_run (gpointer worker)
                 continue;
             }
 
+            /* The ping might have reconnected, our prepared statements are
+               gone with the old connection and so is our session */
+            if (my_worker->thread_id != mysql_thread_id (&(my_worker->mysql))) {
+                gboolean pinned = SQUALE_WORKER (my_worker)->pinned;
+
+                g_hash_table_foreach_remove (my_worker->statements,
+                                             squale_mysql_worker_true_func,
+                                             NULL);
+                g_mutex_lock (SQUALE_WORKER (my_worker)->status_mutex);
+                my_worker->thread_id = mysql_thread_id (&(my_worker->mysql));
+                g_mutex_unlock (SQUALE_WORKER (my_worker)->status_mutex);
+
+                /* The order would run on a fresh autocommit connection */
+                if (pinned) {
+                    squale_worker_session_lost (SQUALE_WORKER (my_worker), job);
+                    g_object_unref (job);
+                    job = NULL;
+                    squale_worker_set_status (SQUALE_WORKER (my_worker), _("Sleeping"));
+                    continue;
+                }
+            }
+
+            if (!squale_worker_begin_job (SQUALE_WORKER (my_worker), job)) {
+                g_object_unref (job);
+                job = NULL;
+                squale_worker_set_status (SQUALE_WORKER (my_worker), _("Sleeping"));
+                continue;
+            }
+
             /* We have a job assigned to us */
-            if (mysql_query (&(my_worker->mysql), job->query)) {
+            if (job->nb_params) {
+                GError *error = NULL;
+                gboolean stale = FALSE;
+                gboolean ret;
+
+                /* Parameterized order, retry once with a fresh statement if
+                   the server did not know the cached one. Anything else might
+                   have run, a cancelled statement in particular */
+                ret = squale_mysql_worker_execute_prepared (my_worker, job,
+                                                            &stale, &error);
+                if (!ret && stale &&
+                    !squale_worker_is_cancelled (SQUALE_WORKER (my_worker))) {
+                    g_error_free (error);
+                    error = NULL;
+                    ret = squale_mysql_worker_execute_prepared (my_worker, job,
+                                                                &stale, &error);
+                }
+                if (!ret) {
+                    squale_job_set_error (job, error);
+                    SQUALE_WORKER (my_worker)->nb_errors++;
+                }
+            }
+            else if (squale_mysql_worker_query (my_worker, job)) {
                 /* Error: Query failed */
                 GError *error = g_error_new (squale_mysql_worker_error_quark (), 0,
                                              "%s", mysql_error (&(my_worker->mysql)));
@@ -313,6 +985,14 @@ squale_mysql_worker_run (gpointer worker)
                 }
             }
 
+            if (!squale_worker_end_job (SQUALE_WORKER (my_worker), job)) {
+                /* Given back to be retried, the next ping reconnects */
+                g_object_unref (job);
+                job = NULL;
+                squale_worker_set_status (SQUALE_WORKER (my_worker), _("Sleeping"));
+                continue;
+            }
+
             squale_job_set_status_if_match (job, SQUALE_JOB_COMPLETE,
                                             SQUALE_JOB_PROCESSING);
 
@@ -342,6 +1022,18 @@ squale_mysql_worker_run (gpointer worker)
     return NULL;
 }
 
+/* Workers reaching the same server share the endpoint */
+static void
+squale_mysql_worker_update_endpoint (SqualeMysqlWorker *worker)
+{
+    char *endpoint = g_strdup_printf ("%s:%d",
+                                      worker->host ? worker->host : "localhost",
+                                      worker->port);
+
+    squale_worker_set_endpoint (SQUALE_WORKER (worker), endpoint);
+    g_free (endpoint);
+}
+
 static void
 squale_mysql_worker_set_property (GObject *object, guint prop_id,
                                   const GValue *value, GParamSpec *pspec)
@@ -358,9 +1050,11 @@ squale_mysql_worker_set_property (GObject *object, guint prop_id,
             if (worker->host)
                 g_free (worker->host);
             worker->host = g_strdup (g_value_get_string (value));
+            squale_mysql_worker_update_endpoint (worker);
             break;
         case PROP_PORT:
             worker->port = atoi (g_value_get_string (value));
+            squale_mysql_worker_update_endpoint (worker);
             break;
         case PROP_DBNAME:
             if (worker->dbname)
@@ -377,6 +1071,9 @@ squale_mysql_worker_set_property (GObject *object, guint prop_id,
                 g_free (worker->passwd);
             worker->passwd = g_strdup (g_value_get_string (value));
             break;
+        case PROP_STATEMENT_CACHE_SIZE:
+            worker->statement_cache_size = atoi (g_value_get_string (value));
+            break;
         default :
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -410,6 +1107,10 @@ squale_mysql_worker_get_property (GObject *object, guint prop_id,
         case PROP_PASSWD:
             g_value_set_string (value, g_strdup (worker->passwd));
             break;
+        case PROP_STATEMENT_CACHE_SIZE:
+            g_value_set_string (value,
+                                g_strdup_printf ("%u", worker->statement_cache_size));
+            break;
         default :
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -451,6 +1152,16 @@ squale_mysql_worker_dispose (GObject *object)
 
     worker->dbname = NULL;
 
+    if (worker->statements) {
+        g_hash_table_destroy (worker->statements);
+        worker->statements = NULL;
+    }
+
+    if (worker->killer) {
+        mysql_close (worker->killer);
+        worker->killer = NULL;
+    }
+
     if (G_OBJECT_CLASS (parent_class)->dispose)
         G_OBJECT_CLASS (parent_class)->dispose (object);
 }
@@ -463,7 +1174,13 @@ squale_mysql_worker_init (SqualeMysqlWorker *worker)
     worker->user = NULL;
     worker->passwd = NULL;
     worker->dbname = NULL;
+    worker->statements = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                squale_mysql_worker_close_statement);
+    worker->statement_cache_size = 64;
+    worker->cursor = NULL;
     mysql_init (&(worker->mysql));
+    worker->thread_id = 0;
+    worker->killer = NULL;
 }
 
 static void
@@ -481,6 +1198,14 @@ squale_mysql_worker_class_init (SqualeMysqlWorkerClass *klass)
     worker_class->connect = squale_mysql_worker_connect;
     worker_class->disconnect = squale_mysql_worker_disconnect;
     worker_class->run = squale_mysql_worker_run;
+    worker_class->open_cursor = squale_mysql_worker_open_cursor;
+    worker_class->fetch_cursor = squale_mysql_worker_fetch_cursor;
+    worker_class->close_cursor = squale_mysql_worker_close_cursor;
+    worker_class->begin_transaction = squale_mysql_worker_begin_transaction;
+    worker_class->commit_transaction = squale_mysql_worker_commit_transaction;
+    worker_class->rollback_transaction = squale_mysql_worker_rollback_transaction;
+    worker_class->cancel = squale_mysql_worker_cancel;
+    worker_class->connection_lost = squale_mysql_worker_connection_lost;
 
     g_object_class_install_property (gobject_class,
                                      PROP_HOST,
@@ -517,6 +1242,13 @@ squale_mysql_worker_class_init (SqualeMysqlWorkerClass *klass)
                                                           "The password to access that database",
                                                           NULL,
                                                           G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class,
+                                     PROP_STATEMENT_CACHE_SIZE,
+                                     g_param_spec_string ("statement-cache-size",
+                                                          "Statement cache size",
+                                                          "The number of prepared statements kept per connection",
+                                                          NULL,
+                                                          G_PARAM_READWRITE));
 }
 
 /* ============================================================= */
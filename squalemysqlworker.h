@@ -45,7 +45,19 @@ struct _SqualeMysqlWorker
     char *passwd;
     char *dbname;
 
+    /* Prepared statements of the current connection keyed by statement text */
+    GHashTable *statements;
+    guint statement_cache_size;
+
+    /* Unbuffered result of the cursor opened for a client session */
+    MYSQL_RES *cursor;
+
     MYSQL mysql;
+
+    /* Server thread of the connection, protected by the worker status_mutex,
+       and side connection used by the cancel threads to KILL QUERY it */
+    gulong thread_id;
+    MYSQL *killer;
 };
 
 struct _SqualeMysqlWorkerClass
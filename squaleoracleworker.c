@@ -43,7 +43,8 @@ enum
     PROP_TNSNAME,
     PROP_USER,
     PROP_PASSWD,
-    PROP_COMMIT_EVERY
+    PROP_COMMIT_EVERY,
+    PROP_STATEMENT_CACHE_SIZE
 };
 
 static SqualeWorkerClass *parent_class = NULL;
@@ -63,13 +64,45 @@ squale_oracle_worker_error_quark (void)
     return quark;
 }
 
+/* Native type of an Oracle column in the typed encodings. Dates are kept as
+   text as their format depends on the session NLS settings. */
+static SqualeColumnType
+squale_oracle_worker_column_type (sqlo_stmt_handle_t sth, gint column)
+{
+    unsigned short dtype = 0;
+    char *name = NULL;
+    int name_len = 0, prec = 0, scale = 0, dbsize = 0, nullok = 0;
+
+    if (sqlo_describecol (sth, column, &dtype, &name, &name_len, &prec, &scale,
+                          &dbsize, &nullok) != SQLO_SUCCESS)
+        return SQUALE_COLUMN_TEXT;
+
+    switch (dtype) {
+        case SQLOT_NUM:
+            /* NUMBER(p, 0) fitting in 64 bits is an integer */
+            if (scale == 0 && prec > 0 && prec <= 18)
+                return SQUALE_COLUMN_INT64;
+            return SQUALE_COLUMN_TEXT;
+        case SQLOT_INT:
+            return SQUALE_COLUMN_INT64;
+        case SQLOT_FLT:
+            return SQUALE_COLUMN_DOUBLE;
+        default:
+            return SQUALE_COLUMN_TEXT;
+    }
+}
+
+/* Pack at most max_rows rows, all of them if 0. more is set when the page
+   got full before the end of the rows. */
 static gboolean
 squale_oracle_worker_store_resultset (SqualeOracleWorker *ora_worker,
-                                      SqualeJob *job, sqlo_stmt_handle_t sth)
+                                      SqualeJob *job, sqlo_stmt_handle_t sth,
+                                      guint max_rows, gboolean *more)
 {
-    gint32 num_fields = 0, i, status;
-    gulong offset = 0, num_rows_offset, j = 0;
+    gint32 num_fields = 0, i, status = SQLO_SUCCESS;
+    guint nb_rows = 0;
     const char **col_names = NULL;
+    GError *error = NULL;
 
     g_return_val_if_fail (SQUALE_IS_ORACLE_WORKER (ora_worker), FALSE);
     g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
@@ -87,79 +120,156 @@ squale_oracle_worker_store_resultset (SqualeOracleWorker *ora_worker,
         return FALSE;
     }
 
-    /* Let's allocate the needed memory in the resultset data buffer.
-       We need 2 gint32 and a char for the header then we can start packing
-       our data */
-    job->resultset->allocated_memory = SQUALE_PAGE_SIZE;
-    job->resultset->data = g_malloc0 (job->resultset->allocated_memory);
-
-    /* Packing number of fields */
-    squale_check_mem_block (&(job->resultset->data),
-                            &(job->resultset->allocated_memory), offset,
-                            3 * sizeof (gint32) + sizeof (char));
-
-    offset = 2 * sizeof (gint32) + sizeof (char);
-
-    *(gint32 *)(job->resultset->data + offset) = num_fields;
-    offset += sizeof (gint32);
+    if (!squale_resultset_begin (job->resultset, job->encoding, num_fields))
+        goto packing_failed;
 
     /* Packing columns names */
     for (i = 0; i < num_fields; i++) {
-        gint32 field_length = strlen (col_names[i]);
-        squale_check_mem_block (&(job->resultset->data),
-                                &(job->resultset->allocated_memory), offset,
-                                sizeof (gint32) + field_length);
-        *(gint32 *)(job->resultset->data + offset) = field_length;
-        offset += sizeof (gint32);
-        memcpy (job->resultset->data + offset, col_names[i], field_length);
-        offset += field_length;
-    }
-
-    /* Storing the offset of number of rows */
-    num_rows_offset = offset;
-    squale_check_mem_block (&(job->resultset->data),
-                            &(job->resultset->allocated_memory), offset,
-                            sizeof (gulong));
-    offset += sizeof (gulong);
+        SqualeColumnType type = SQUALE_COLUMN_TEXT;
+
+        if (job->encoding != SQUALE_RESULTSET_TEXT)
+            type = squale_oracle_worker_column_type (sth, i + 1);
+
+        if (!squale_resultset_add_column (job->resultset, col_names[i],
+                                          strlen (col_names[i]), type))
+            goto packing_failed;
+    }
 
     /* For each row */
-    while (SQLO_SUCCESS == (status = (sqlo_fetch (sth, 1))) ||
-           status == SQLO_SUCCESS_WITH_INFO) {
+    while ((!max_rows || nb_rows < max_rows) &&
+           (SQLO_SUCCESS == (status = (sqlo_fetch (sth, 1))) ||
+            status == SQLO_SUCCESS_WITH_INFO)) {
         const char **v = sqlo_values (sth, NULL, 1);
         for (i = 0; i < num_fields; i++) {
             gint32 field_length = strlen (v[i]);
-            squale_check_mem_block (&(job->resultset->data),
-                                    &(job->resultset->allocated_memory),
-                                    offset, sizeof (gint32) + field_length);
-            *(gint32 *)(job->resultset->data + offset) = field_length;
-            offset += sizeof (gint32);
-            memcpy (job->resultset->data + offset, v[i], field_length);
-            offset += field_length;
+            /* Oracle has no empty strings, those are NULL values */
+            if (!squale_resultset_add_value (job->resultset,
+                                             field_length ? v[i] : NULL,
+                                             field_length))
+                goto packing_failed;
         }
+        if (!squale_resultset_end_row (job->resultset))
+            goto packing_failed;
         if (status == SQLO_SUCCESS_WITH_INFO) {
             GError *warning = g_error_new (squale_oracle_worker_error_quark (), 0,
                                            "%s", sqlo_geterror (ora_worker->dbh));
             squale_job_set_warning (job, warning);
         }
-        j++;
+        nb_rows++;
     }
 
+    if (more)
+        *more = max_rows && nb_rows >= max_rows;
+
     /* If status is different from SQLO_NO_DATA that means an error occured
        in that case we free the fetched data and gather the error message. */
-    if (status != SQLO_NO_DATA) {
+    if (status != SQLO_NO_DATA && !(max_rows && nb_rows >= max_rows)) {
         GError *error = g_error_new (squale_oracle_worker_error_quark (), 0, "%s",
                                      sqlo_geterror (ora_worker->dbh));
         squale_job_set_error (job, error);
         SQUALE_WORKER (ora_worker)->nb_errors++;
-        g_free (job->resultset->data);
-        job->resultset->data = NULL;
+        squale_resultset_abort (job->resultset);
         return FALSE;
     }
 
     /* Finally packing the number of rows */
-    *(gulong *)(job->resultset->data + num_rows_offset) = (gulong) j;
+    if (!squale_resultset_finish (job->resultset))
+        goto packing_failed;
+
+    return TRUE;
+
+packing_failed:
+    squale_resultset_abort (job->resultset);
+    error = squale_resultset_get_error (job->resultset);
+    if (!error)
+        error = g_error_new (squale_oracle_worker_error_quark (), 0, _("Failed packing resultset"));
+    squale_job_set_error (job, error);
+    SQUALE_WORKER (ora_worker)->nb_errors++;
+    return FALSE;
+}
+
+static void
+squale_oracle_worker_close_statement (gpointer data)
+{
+    sqlo_close (*(sqlo_stmt_handle_t *) data);
+    g_free (data);
+}
+
+static gboolean
+squale_oracle_worker_true_func (gpointer key, gpointer value, gpointer user_data)
+{
+    return TRUE;
+}
+
+/* Open a cursor for that job. Parameterized orders are bound by position to
+   :1, :2... and reuse the cursor cached for the same statement text if
+   any. Oracle considers empty strings as NULL so that's what we bind for
+   NULL parameters. */
+static gint
+squale_oracle_worker_open (SqualeOracleWorker *ora_worker, SqualeJob *job,
+                           sqlo_stmt_handle_t *sth, gboolean *cached)
+{
+    sqlo_stmt_handle_t *cached_sth = NULL;
+    const char **argv = NULL;
+    gint argc = 0, i, ret;
+
+    *cached = FALSE;
+
+    if (!job->nb_params) {
+        return sqlo_open2 (sth, ora_worker->dbh, job->query, 0, NULL);
+    }
+
+    argc = job->params ? job->params->len : 0;
+    argv = g_new0 (const char *, argc + 1);
+
+    for (i = 0; i < argc; i++) {
+        SqualeJobParam *param = g_ptr_array_index (job->params, i);
+        argv[i] = param->value ? param->value : "";
+    }
+
+    cached_sth = g_hash_table_lookup (ora_worker->statements, job->query);
+
+    if (cached_sth) {
+        ret = sqlo_reopen (*cached_sth, argc, argv);
+        if (ret >= 0) {
+            *sth = *cached_sth;
+            *cached = TRUE;
+            g_free (argv);
+            return ret;
+        }
+        /* That cursor is unusable, close it and start again */
+        g_hash_table_remove (ora_worker->statements, job->query);
+    }
+
+    ret = sqlo_open2 (sth, ora_worker->dbh, job->query, argc, argv);
+
+    g_free (argv);
+
+    return ret;
+}
+
+/* Keep the cursor of a parameterized SELECT open for the next execution */
+static gboolean
+squale_oracle_worker_cache_statement (SqualeOracleWorker *ora_worker,
+                                      SqualeJob *job, sqlo_stmt_handle_t sth)
+{
+    sqlo_stmt_handle_t *cached_sth = NULL;
+
+    if (!job->nb_params || !ora_worker->statement_cache_size)
+        return FALSE;
+
+    /* The cache is full, start again from scratch */
+    if (g_hash_table_size (ora_worker->statements) >=
+        ora_worker->statement_cache_size) {
+        g_hash_table_foreach_remove (ora_worker->statements,
+                                     squale_oracle_worker_true_func, NULL);
+    }
 
-    job->resultset->data_size = offset;
+    cached_sth = g_new0 (sqlo_stmt_handle_t, 1);
+    *cached_sth = sth;
+
+    g_hash_table_insert (ora_worker->statements, g_strdup (job->query),
+                         cached_sth);
 
     return TRUE;
 }
@@ -230,8 +340,13 @@ squale_oracle_worker_disconnect (SqualeWorker *worker)
 
     ora_worker = SQUALE_ORACLE_WORKER (worker);
 
-    /* Trying to commit any pending transaction */
-    if (ora_worker->since_commit) {
+    /* A client transaction is never committed behind its back, we commit
+       any other pending change */
+    if (worker->in_transaction) {
+        sqlo_rollback (ora_worker->dbh);
+        ora_worker->since_commit = 0;
+    }
+    else if (ora_worker->since_commit) {
         sqlo_commit (ora_worker->dbh);
         ora_worker->since_commit = 0;
     }
@@ -249,6 +364,15 @@ squale_oracle_worker_disconnect (SqualeWorker *worker)
     g_message (_("Joblist '%s': Oracle worker (%p) shutting down connection " \
              "to %s"), joblist_name, worker, ora_worker->tnsname);
 
+    /* Cached cursors belong to the connection */
+    g_hash_table_foreach_remove (ora_worker->statements,
+                                 squale_oracle_worker_true_func, NULL);
+
+    if (ora_worker->cursor != SQLO_STH_INIT) {
+        sqlo_close (ora_worker->cursor);
+        ora_worker->cursor = SQLO_STH_INIT;
+    }
+
     sqlo_finish (ora_worker->dbh);
 
     if (joblist_name) {
@@ -276,6 +400,181 @@ squale_oracle_worker_test (SqualeOracleWorker *ora_worker)
     }
 }
 
+/* Session cursors are never cached, the statement is closed with the
+   cursor */
+static gboolean
+squale_oracle_worker_open_cursor (SqualeWorker *worker, SqualeJob *job)
+{
+    SqualeOracleWorker *ora_worker = NULL;
+    gboolean more = FALSE;
+    gint num_fields = 0;
+
+    g_return_val_if_fail (SQUALE_IS_ORACLE_WORKER (worker), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    ora_worker = SQUALE_ORACLE_WORKER (worker);
+
+    if (sqlo_open2 (&(ora_worker->cursor), ora_worker->dbh, job->query,
+                    0, NULL) < 0) {
+        GError *error = g_error_new (squale_oracle_worker_error_quark (), 0,
+                                     "%s", sqlo_geterror (ora_worker->dbh));
+        squale_job_set_error (job, error);
+        worker->nb_errors++;
+        ora_worker->cursor = SQLO_STH_INIT;
+        return FALSE;
+    }
+
+    /* Not a query, store_resultset executes it */
+    if (!sqlo_ocol_names (ora_worker->cursor, &num_fields)) {
+        squale_oracle_worker_store_resultset (ora_worker, job,
+                                              ora_worker->cursor, 0, NULL);
+        if (!job->error) {
+            job->affected_rows = (gint32) sqlo_prows (ora_worker->cursor);
+            ora_worker->since_commit++;
+        }
+        return FALSE;
+    }
+
+    if (!squale_oracle_worker_store_resultset (ora_worker, job,
+                                               ora_worker->cursor,
+                                               job->cursor_rows, &more))
+        return FALSE;
+
+    return more;
+}
+
+static gboolean
+squale_oracle_worker_fetch_cursor (SqualeWorker *worker, SqualeJob *job)
+{
+    SqualeOracleWorker *ora_worker = NULL;
+    gboolean more = FALSE;
+
+    g_return_val_if_fail (SQUALE_IS_ORACLE_WORKER (worker), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    ora_worker = SQUALE_ORACLE_WORKER (worker);
+
+    if (ora_worker->cursor == SQLO_STH_INIT)
+        return FALSE;
+
+    if (!squale_oracle_worker_store_resultset (ora_worker, job,
+                                               ora_worker->cursor,
+                                               job->cursor_rows, &more))
+        return FALSE;
+
+    return more;
+}
+
+static void
+squale_oracle_worker_close_cursor (SqualeWorker *worker)
+{
+    SqualeOracleWorker *ora_worker = NULL;
+
+    g_return_if_fail (SQUALE_IS_ORACLE_WORKER (worker));
+
+    ora_worker = SQUALE_ORACLE_WORKER (worker);
+
+    if (ora_worker->cursor != SQLO_STH_INIT) {
+        sqlo_close (ora_worker->cursor);
+        ora_worker->cursor = SQLO_STH_INIT;
+    }
+}
+
+/* Oracle transactions start implicitly, we just make sure the grouped
+   commits of previous orders don't end up in the client transaction */
+static gboolean
+squale_oracle_worker_begin_transaction (SqualeWorker *worker, GError **error)
+{
+    SqualeOracleWorker *ora_worker = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_ORACLE_WORKER (worker), FALSE);
+
+    ora_worker = SQUALE_ORACLE_WORKER (worker);
+
+    if (ora_worker->since_commit) {
+        if (sqlo_commit (ora_worker->dbh) < 0) {
+            g_set_error (error, squale_oracle_worker_error_quark (), 0, "%s",
+                         sqlo_geterror (ora_worker->dbh));
+            return FALSE;
+        }
+        ora_worker->since_commit = 0;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+squale_oracle_worker_commit_transaction (SqualeWorker *worker, GError **error)
+{
+    SqualeOracleWorker *ora_worker = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_ORACLE_WORKER (worker), FALSE);
+
+    ora_worker = SQUALE_ORACLE_WORKER (worker);
+
+    ora_worker->since_commit = 0;
+
+    if (sqlo_commit (ora_worker->dbh) < 0) {
+        g_set_error (error, squale_oracle_worker_error_quark (), 0, "%s",
+                     sqlo_geterror (ora_worker->dbh));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+squale_oracle_worker_rollback_transaction (SqualeWorker *worker, GError **error)
+{
+    SqualeOracleWorker *ora_worker = NULL;
+
+    g_return_val_if_fail (SQUALE_IS_ORACLE_WORKER (worker), FALSE);
+
+    ora_worker = SQUALE_ORACLE_WORKER (worker);
+
+    ora_worker->since_commit = 0;
+
+    if (sqlo_rollback (ora_worker->dbh) < 0) {
+        g_set_error (error, squale_oracle_worker_error_quark (), 0, "%s",
+                     sqlo_geterror (ora_worker->dbh));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* OCIBreak can be called from another thread while the worker is blocked in
+   a call, that call then fails with ORA-01013 */
+static void
+squale_oracle_worker_cancel (SqualeWorker *worker)
+{
+    SqualeOracleWorker *ora_worker = NULL;
+
+    g_return_if_fail (SQUALE_IS_ORACLE_WORKER (worker));
+
+    ora_worker = SQUALE_ORACLE_WORKER (worker);
+
+    if (sqlo_break (ora_worker->dbh) != SQLO_SUCCESS) {
+        g_warning (_("Oracle worker (%p) failed cancelling its statement: %s"),
+                   worker, sqlo_geterror (ora_worker->dbh));
+    }
+}
+
+/* End of file on communication channel, not connected, connection lost
+   contact, TNS errors and the session being killed */
+static gboolean
+squale_oracle_worker_connection_lost (SqualeWorker *worker)
+{
+    gint error;
+
+    g_return_val_if_fail (SQUALE_IS_ORACLE_WORKER (worker), FALSE);
+
+    error = ABS (sqlo_geterrcode (SQUALE_ORACLE_WORKER (worker)->dbh));
+
+    return error == 3113 || error == 3114 || error == 3135 || error == 28 ||
+           error == 1012 || error == 12541 || error == 12560;
+}
+
 static gpointer
 squale_oracle_worker_run (gpointer worker)
 {
@@ -311,6 +610,9 @@ squale_oracle_worker_run (gpointer worker)
                 g_warning (_("Joblist '%s': Oracle worker (%p)'s connection to %s " \
                    "went down, trying to cycle"), joblist_name, worker,
                            ora_worker->tnsname);
+                g_hash_table_foreach_remove (ora_worker->statements,
+                                             squale_oracle_worker_true_func, NULL);
+                ora_worker->cursor = SQLO_STH_INIT;
                 sqlo_server_free (ora_worker->dbh);
                 squale_worker_connect (SQUALE_WORKER (ora_worker));
                 SQUALE_WORKER (ora_worker)->nb_db_conn_cycles++;
@@ -320,16 +622,34 @@ squale_oracle_worker_run (gpointer worker)
         }
 
         if (job == NULL) {
-            job = squale_joblist_assign_pending_job (joblist, FALSE);
+            job = squale_joblist_assign_pending_job (joblist,
+                                                     SQUALE_WORKER (ora_worker),
+                                                     FALSE);
         }
 
         if (SQUALE_IS_JOB (job)) {
             sqlo_stmt_handle_t sth = SQLO_STH_INIT;
+            gboolean cached = FALSE;
 
             squale_worker_set_status (SQUALE_WORKER (ora_worker), job->query);
 
+            /* Cursor and transaction orders */
+            if (squale_worker_run_session_job (SQUALE_WORKER (ora_worker), job)) {
+                g_object_unref (job);
+                job = NULL;
+                squale_worker_set_status (SQUALE_WORKER (ora_worker), _("Sleeping"));
+                continue;
+            }
+
+            if (!squale_worker_begin_job (SQUALE_WORKER (ora_worker), job)) {
+                g_object_unref (job);
+                job = NULL;
+                squale_worker_set_status (SQUALE_WORKER (ora_worker), _("Sleeping"));
+                continue;
+            }
+
             /* We have a job assigned to us */
-            if (sqlo_open2 (&sth, ora_worker->dbh, job->query, 0, NULL) < 0) {
+            if (squale_oracle_worker_open (ora_worker, job, &sth, &cached) < 0) {
                 /* Error: Query failed */
                 GError *error = g_error_new (squale_oracle_worker_error_quark (), 0,
                                              "%s", sqlo_geterror (ora_worker->dbh));
@@ -373,9 +693,11 @@ squale_oracle_worker_run (gpointer worker)
                             ora_worker->since_commit++;
 
                             /* Try to commit only if commit grouping is disabled or we've
-                             * reached our commit threshold */
-                            if (ora_worker->commit_every == 0 ||
-                                ora_worker->since_commit >= ora_worker->commit_every) {
+                             * reached our commit threshold. A client transaction commits
+                             * itself */
+                            if (!SQUALE_WORKER (ora_worker)->in_transaction &&
+                                (ora_worker->commit_every == 0 ||
+                                 ora_worker->since_commit >= ora_worker->commit_every)) {
                                 g_message ("Joblist '%s': Oracle worker (%p) commiting %" \
                     G_GUINT64_FORMAT " transactions (Threshold %" \
                     G_GUINT64_FORMAT ")", joblist_name, worker,
@@ -400,11 +722,21 @@ squale_oracle_worker_run (gpointer worker)
                 }
                 else {
                     /* We probably have a resultset */
-                    squale_oracle_worker_store_resultset (ora_worker, job, sth);
+                    if (squale_oracle_worker_store_resultset (ora_worker, job, sth,
+                                                              0, NULL) &&
+                        !cached) {
+                        cached = squale_oracle_worker_cache_statement (ora_worker,
+                                                                       job, sth);
+                    }
+                    else if (!squale_resultset_has_data (job->resultset) && cached) {
+                        /* Don't keep a cursor which failed */
+                        g_hash_table_remove (ora_worker->statements, job->query);
+                        cached = TRUE;
+                    }
                 }
 
-                /* Closing cursor */
-                if (sqlo_close (sth) != SQLO_SUCCESS) {
+                /* Closing cursor unless we keep it for next time */
+                if (!cached && sqlo_close (sth) != SQLO_SUCCESS) {
                     GError *error = g_error_new (squale_oracle_worker_error_quark (), 0,
                                                  "%s", sqlo_geterror (ora_worker->dbh));
                     squale_job_set_error (job, error);
@@ -414,6 +746,14 @@ squale_oracle_worker_run (gpointer worker)
                 }
             }
 
+            if (!squale_worker_end_job (SQUALE_WORKER (ora_worker), job)) {
+                /* Given back to be retried, the connection test cycles it */
+                g_object_unref (job);
+                job = NULL;
+                squale_worker_set_status (SQUALE_WORKER (ora_worker), _("Sleeping"));
+                continue;
+            }
+
             squale_job_set_status_if_match (job, SQUALE_JOB_COMPLETE,
                                             SQUALE_JOB_PROCESSING);
 
@@ -468,6 +808,7 @@ squale_oracle_worker_set_property (GObject *object, guint prop_id,
             if (worker->tnsname)
                 g_free (worker->tnsname);
             worker->tnsname = g_strdup (g_value_get_string (value));
+            squale_worker_set_endpoint (SQUALE_WORKER (worker), worker->tnsname);
             break;
         case PROP_USER:
             if (worker->user)
@@ -484,6 +825,10 @@ squale_oracle_worker_set_property (GObject *object, guint prop_id,
             /* We always reinitialize our since_commit counter */
             worker->since_commit = 0;
             break;
+        case PROP_STATEMENT_CACHE_SIZE:
+            worker->statement_cache_size = MIN (atoi (g_value_get_string (value)),
+                                                SQUALE_ORACLE_MAX_CURSORS - 1);
+            break;
         default :
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -515,6 +860,10 @@ squale_oracle_worker_get_property (GObject *object, guint prop_id,
             g_value_set_string (value,
                                 g_strdup_printf ("%" G_GUINT64_FORMAT, worker->commit_every));
             break;
+        case PROP_STATEMENT_CACHE_SIZE:
+            g_value_set_string (value,
+                                g_strdup_printf ("%u", worker->statement_cache_size));
+            break;
         default :
             G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
             break;
@@ -549,6 +898,11 @@ squale_oracle_worker_dispose (GObject *object)
 
     worker->passwd = NULL;
 
+    if (worker->statements) {
+        g_hash_table_destroy (worker->statements);
+        worker->statements = NULL;
+    }
+
     if (G_OBJECT_CLASS (parent_class)->dispose)
         G_OBJECT_CLASS (parent_class)->dispose (object);
 }
@@ -560,6 +914,10 @@ squale_oracle_worker_init (SqualeOracleWorker *worker)
     worker->user = NULL;
     worker->passwd = NULL;
     worker->commit_every = worker->since_commit = 0;
+    worker->statements = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                squale_oracle_worker_close_statement);
+    worker->statement_cache_size = 32;
+    worker->cursor = SQLO_STH_INIT;
 }
 
 static void
@@ -577,6 +935,14 @@ squale_oracle_worker_class_init (SqualeOracleWorkerClass *klass)
     worker_class->connect = squale_oracle_worker_connect;
     worker_class->disconnect = squale_oracle_worker_disconnect;
     worker_class->run = squale_oracle_worker_run;
+    worker_class->open_cursor = squale_oracle_worker_open_cursor;
+    worker_class->fetch_cursor = squale_oracle_worker_fetch_cursor;
+    worker_class->close_cursor = squale_oracle_worker_close_cursor;
+    worker_class->begin_transaction = squale_oracle_worker_begin_transaction;
+    worker_class->commit_transaction = squale_oracle_worker_commit_transaction;
+    worker_class->rollback_transaction = squale_oracle_worker_rollback_transaction;
+    worker_class->cancel = squale_oracle_worker_cancel;
+    worker_class->connection_lost = squale_oracle_worker_connection_lost;
 
     g_object_class_install_property (gobject_class,
                                      PROP_TNSNAME,
@@ -606,6 +972,13 @@ squale_oracle_worker_class_init (SqualeOracleWorkerClass *klass)
                                                           "When not 0 this tells the work to not auto-commit and do a commit after a certain number of transactions",
                                                           NULL,
                                                           G_PARAM_READWRITE));
+    g_object_class_install_property (gobject_class,
+                                     PROP_STATEMENT_CACHE_SIZE,
+                                     g_param_spec_string ("statement-cache-size",
+                                                          "Statement cache size",
+                                                          "The number of parameterized SELECT cursors kept open per connection",
+                                                          NULL,
+                                                          G_PARAM_READWRITE));
 }
 
 /* ============================================================= */
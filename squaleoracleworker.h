@@ -32,6 +32,10 @@
 #define SQUALE_IS_ORACLE_WORKER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), SQUALE_TYPE_ORACLE_WORKER))
 #define SQUALE_ORACLE_WORKER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), SQUALE_TYPE_ORACLE_WORKER, SqualeOracleWorkerClass))
 
+/* Cursors allowed per connection: the statement cache plus the one used
+   for plain queries */
+#define SQUALE_ORACLE_MAX_CURSORS 65
+
 typedef struct _SqualeOracleWorker SqualeOracleWorker;
 typedef struct _SqualeOracleWorkerClass SqualeOracleWorkerClass;
 
@@ -45,6 +49,13 @@ struct _SqualeOracleWorker
     guint64 commit_every;
     guint64 since_commit;
 
+    /* Open cursors of parameterized SELECTs keyed by statement text */
+    GHashTable *statements;
+    guint statement_cache_size;
+
+    /* Cursor opened for a client session, fetched page by page */
+    sqlo_stmt_handle_t cursor;
+
     sqlo_db_handle_t dbh;
 };
 
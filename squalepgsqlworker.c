@@ -373,7 +373,7 @@ squale_worker_wait (SqualeWorker *worker)
     g_return_val_if_fail (SQUALE_IS_WORKER (worker), NULL);
 
     /* We get a job and keep locking the joblist to block the main thread */
-    job = squale_joblist_assign_pending_job (worker->joblist, TRUE);
+    job = squale_joblist_assign_pending_job (worker->joblist, worker, TRUE);
 
     /* Atomic unlock of the joblist mutex, we are sure that no signal can be sent
        before we are actually waiting on the cond. */
@@ -0,0 +1,214 @@
+/*  SQuaLe
+ *
+ *  Copyright (C) 2005 Julien Moutte <julien@moutte.net>
+ *
+ *  squalequeue.c : Source for the joblist queue disciplines.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "squalequeue.h"
+#include "squalejoblist.h"
+#include <string.h>
+
+#ifdef HAVE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+/* ============================================================= */
+/*                                                               */
+/*                       Private Methods                         */
+/*                                                               */
+/* ============================================================= */
+
+static void
+squale_queue_append (SqualeJobList *joblist, SqualeJob *job)
+{
+    joblist->jobs = g_list_append (joblist->jobs, job);
+}
+
+static GList *
+squale_queue_head (SqualeJobList *joblist, const struct timeval *now,
+                   gboolean *backwards)
+{
+    *backwards = FALSE;
+
+    return joblist->jobs;
+}
+
+/* Jobs are in arrival order. While the oldest pending job has waited less
+   than the threshold we serve them in that order, past it the backlog is
+   probably stale already and the newest jobs are served first so that they
+   still meet their client timeouts. */
+static GList *
+squale_queue_adaptive_lifo_first (SqualeJobList *joblist,
+                                  const struct timeval *now,
+                                  gboolean *backwards)
+{
+    GList *jobs = joblist->jobs;
+    struct timeval age;
+
+    *backwards = FALSE;
+
+    while (jobs && SQUALE_JOB (jobs->data)->status != SQUALE_JOB_PENDING)
+        jobs = g_list_next (jobs);
+
+    if (!jobs)
+        return joblist->jobs;
+
+    timersub (now, &(SQUALE_JOB (jobs->data)->creation_ts), &age);
+
+    if (age.tv_sec * 1000 + age.tv_usec / 1000 < joblist->lifo_threshold)
+        return jobs;
+
+    *backwards = TRUE;
+
+    return g_list_last (jobs);
+}
+
+/* Jobs without a deadline come after all those with one, ties keep their
+   arrival order */
+static gint
+squale_queue_compare_deadlines (gconstpointer a, gconstpointer b)
+{
+    const SqualeJob *job = a, *other = b;
+
+    if (!timerisset (&(job->deadline_ts)))
+        return 1;
+    if (!timerisset (&(other->deadline_ts)))
+        return -1;
+    if (timercmp (&(job->deadline_ts), &(other->deadline_ts), <))
+        return -1;
+
+    return 1;
+}
+
+static void
+squale_queue_edf_enqueue (SqualeJobList *joblist, SqualeJob *job)
+{
+    /* Nothing to sort, spare the walk */
+    if (!timerisset (&(job->deadline_ts))) {
+        joblist->jobs = g_list_append (joblist->jobs, job);
+        return;
+    }
+
+    joblist->jobs = g_list_insert_sorted (joblist->jobs, job,
+                                          squale_queue_compare_deadlines);
+}
+
+static gboolean
+squale_queue_tenant_is_idle (gpointer key, gpointer value, gpointer data)
+{
+    return *(gdouble *) value <= *(gdouble *) data;
+}
+
+/* Start-time fair queuing. A job starts at the later of the virtual time
+   and the finish tag of the previous job of its tenant, and finishes
+   1 / weight later. Jobs are served by start tag so that a tenant flooding
+   the joblist only delays its own jobs. The virtual time is the start tag
+   of the oldest pending job. */
+static void
+squale_queue_fair_enqueue (SqualeJobList *joblist, SqualeJob *job)
+{
+    const char *tenant = job->tenant ? job->tenant : "";
+    GList *jobs = NULL;
+    gdouble *finish = NULL, start;
+    guint weight;
+
+    for (jobs = joblist->jobs; jobs; jobs = g_list_next (jobs)) {
+        if (SQUALE_JOB (jobs->data)->status == SQUALE_JOB_PENDING) {
+            joblist->fair_virtual_time = MAX (joblist->fair_virtual_time,
+                                              SQUALE_JOB (jobs->data)->fair_tag);
+            break;
+        }
+    }
+
+    weight = GPOINTER_TO_UINT (g_hash_table_lookup (joblist->tenant_weights,
+                                                    tenant));
+    if (!weight)
+        weight = 1;
+
+    finish = g_hash_table_lookup (joblist->tenant_finish, tenant);
+    if (!finish) {
+        /* Tenants whose last job started in the past are not owed anything */
+        if (g_hash_table_size (joblist->tenant_finish) >=
+            SQUALE_QUEUE_MAX_TENANTS) {
+            g_hash_table_foreach_remove (joblist->tenant_finish,
+                                         squale_queue_tenant_is_idle,
+                                         &(joblist->fair_virtual_time));
+        }
+        finish = g_new0 (gdouble, 1);
+        g_hash_table_insert (joblist->tenant_finish, g_strdup (tenant), finish);
+    }
+
+    start = MAX (joblist->fair_virtual_time, *finish);
+    *finish = start + 1.0 / weight;
+    job->fair_tag = start;
+
+    /* Ties keep their arrival order, most jobs go at the end */
+    for (jobs = g_list_last (joblist->jobs); jobs; jobs = g_list_previous (jobs)) {
+        if (SQUALE_JOB (jobs->data)->fair_tag <= start)
+            break;
+    }
+
+    if (!jobs) {
+        joblist->jobs = g_list_prepend (joblist->jobs, job);
+    }
+    else if (!jobs->next) {
+        joblist->jobs = g_list_append (joblist->jobs, job);
+    }
+    else {
+        joblist->jobs = g_list_insert_before (joblist->jobs, jobs->next, job);
+    }
+}
+
+static const SqualeQueueDiscipline squale_queue_disciplines[] = {
+    { "fifo", squale_queue_append, squale_queue_head },
+    { "adaptive-lifo", squale_queue_append, squale_queue_adaptive_lifo_first },
+    { "edf", squale_queue_edf_enqueue, squale_queue_head },
+    { "fair", squale_queue_fair_enqueue, squale_queue_head },
+    { NULL, NULL, NULL }
+};
+
+/* ============================================================= */
+/*                                                               */
+/*                       Public Methods                          */
+/*                                                               */
+/* ============================================================= */
+
+const SqualeQueueDiscipline *
+squale_queue_discipline_find (const char *name)
+{
+    guint i;
+
+    g_return_val_if_fail (name != NULL, NULL);
+
+    for (i = 0; squale_queue_disciplines[i].name; i++) {
+        if (!g_ascii_strcasecmp (squale_queue_disciplines[i].name, name))
+            return &(squale_queue_disciplines[i]);
+    }
+
+    return NULL;
+}
+
+const SqualeQueueDiscipline *
+squale_queue_discipline_default (void)
+{
+    return &(squale_queue_disciplines[0]);
+}
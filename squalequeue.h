@@ -0,0 +1,57 @@
+/*  SQuaLe
+ *
+ *  Copyright (C) 2005 Julien Moutte <julien@moutte.net>
+ *
+ *  squalequeue.h : Header for the joblist queue disciplines.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __SQUALE_QUEUE_H__
+#define __SQUALE_QUEUE_H__
+
+#include <glib.h>
+#include <sys/time.h>
+
+#include "squalejob.h"
+
+typedef struct _SqualeQueueDiscipline SqualeQueueDiscipline;
+
+struct _SqualeJobList;
+
+/* Default queue age after which the adaptive LIFO discipline serves the
+   newest jobs first (ms) */
+#define SQUALE_QUEUE_LIFO_THRESHOLD 100
+
+/* Number of tenants the fair discipline remembers before forgetting the
+   idle ones */
+#define SQUALE_QUEUE_MAX_TENANTS 1024
+
+/* A queue discipline decides where a new job goes in the joblist and from
+   which end workers look for a pending job. Both are called with the
+   joblist locked. */
+struct _SqualeQueueDiscipline
+{
+    const char *name;
+
+    void (*enqueue) (struct _SqualeJobList *joblist, SqualeJob *job);
+    GList *(*first) (struct _SqualeJobList *joblist, const struct timeval *now,
+                     gboolean *backwards);
+};
+
+const SqualeQueueDiscipline *squale_queue_discipline_find (const char *name);
+const SqualeQueueDiscipline *squale_queue_discipline_default (void);
+
+#endif /* __SQUALE_QUEUE_H__ */
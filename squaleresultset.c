@@ -0,0 +1,966 @@
+/*  SQuaLe
+ *
+ *  Copyright (C) 2005 Julien Moutte <julien@moutte.net>
+ *
+ *  squaleresultset.c : Source for SqualeResultSet structure.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "squale.h"
+#include "squaleresultset.h"
+#include "squale-i18n.h"
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef HAVE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+static SqualeMemoryBudget global_budget = { 0, 0, 0 };
+static GMutex *budget_mutex = NULL;
+static GCond *budget_cond = NULL;
+
+/* ============================================================= */
+/*                                                               */
+/*                       Private Methods                         */
+/*                                                               */
+/* ============================================================= */
+
+static gboolean
+squale_memory_budget_over (SqualeMemoryBudget *budget)
+{
+    return budget && budget->limit && budget->used > budget->limit;
+}
+
+static void
+squale_memory_budget_charge (SqualeMemoryBudget *budget, glong delta)
+{
+    if (!budget)
+        return;
+
+    budget->used += delta;
+    if (budget->used > budget->high_water)
+        budget->high_water = budget->used;
+}
+
+/* Charge the budgets with what the resultset allocated since the last call.
+   When growing over budget the worker packing it can wait for other
+   resultsets to be sent and freed, it gives up after a while. */
+static gboolean
+squale_resultset_account (SqualeResultSet *resultset, gboolean wait)
+{
+    gulong memory = resultset->allocated_memory + resultset->columns_memory;
+    glong delta = (glong) memory - (glong) resultset->accounted_memory;
+    gboolean ret = TRUE;
+
+    if (!delta || !budget_mutex)
+        return TRUE;
+
+    g_mutex_lock (budget_mutex);
+
+    squale_memory_budget_charge (&global_budget, delta);
+    squale_memory_budget_charge (resultset->budget, delta);
+    resultset->accounted_memory = memory;
+
+    if (delta < 0) {
+        g_cond_broadcast (budget_cond);
+    }
+    else if (wait && (squale_memory_budget_over (&global_budget) ||
+                      squale_memory_budget_over (resultset->budget))) {
+        GTimeVal until;
+
+        g_message (_("Memory budget exhausted, pausing packing of resultset %p"),
+                   resultset);
+
+        g_get_current_time (&until);
+        g_time_val_add (&until, SQUALE_MEMORY_BUDGET_WAIT * 1000);
+
+        while (squale_memory_budget_over (&global_budget) ||
+               squale_memory_budget_over (resultset->budget)) {
+            if (!g_cond_timed_wait (budget_cond, budget_mutex, &until)) {
+                g_warning (_("Memory budget still exhausted, giving up " \
+                  "resultset %p"), resultset);
+                resultset->over_budget = TRUE;
+                ret = FALSE;
+                break;
+            }
+        }
+    }
+
+    g_mutex_unlock (budget_mutex);
+
+    return ret;
+}
+
+static gboolean
+squale_resultset_reserve (SqualeResultSet *resultset, gulong needed_bytes)
+{
+    if (!squale_check_mem_block (&(resultset->data),
+                                 &(resultset->allocated_memory),
+                                 resultset->data_size, needed_bytes))
+        return FALSE;
+
+    return squale_resultset_account (resultset, TRUE);
+}
+
+static gboolean
+squale_resultset_append (SqualeResultSet *resultset, gconstpointer data,
+                         gulong length)
+{
+    if (!squale_resultset_reserve (resultset, length))
+        return FALSE;
+
+    if (length)
+        memcpy (resultset->data + resultset->data_size, data, length);
+    resultset->data_size += length;
+
+    return TRUE;
+}
+
+static gboolean
+squale_resultset_append_string (SqualeResultSet *resultset, const char *string,
+                                gint32 length)
+{
+    if (!squale_resultset_reserve (resultset, sizeof (gint32) + length))
+        return FALSE;
+
+    *(gint32 *)(resultset->data + resultset->data_size) = length;
+    resultset->data_size += sizeof (gint32);
+    if (length) {
+        memcpy (resultset->data + resultset->data_size, string, length);
+        resultset->data_size += length;
+    }
+
+    return TRUE;
+}
+
+/* Move what has been packed so far to the spill file, the in memory block is
+   then reused for the following rows */
+static gboolean
+squale_resultset_spill (SqualeResultSet *resultset)
+{
+    gulong written = 0;
+
+    if (resultset->spill_fd < 0) {
+        GError *error = NULL;
+        char *path = NULL;
+
+        resultset->spill_fd = g_file_open_tmp ("squale-XXXXXX", &path, &error);
+        if (resultset->spill_fd < 0) {
+            g_warning (_("Failed creating spill file for resultset %p: %s"),
+                       resultset, error->message);
+            g_error_free (error);
+            return FALSE;
+        }
+
+        /* Nobody else needs to see it, the space is given back when the last
+           reference is dropped */
+        unlink (path);
+        g_free (path);
+
+        g_message (_("Resultset %p is larger than %lu bytes, spilling it to disk"),
+                   resultset, resultset->spill_threshold);
+    }
+
+    while (written < resultset->data_size) {
+        ssize_t ret = write (resultset->spill_fd, resultset->data + written,
+                             resultset->data_size - written);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            g_warning (_("Failed writing resultset %p to its spill file: %s"),
+                       resultset, strerror (errno));
+            return FALSE;
+        }
+        written += ret;
+    }
+
+    resultset->spilled_size += resultset->data_size;
+    resultset->data_size = 0;
+
+    return TRUE;
+}
+
+static void
+squale_resultset_close_spill (SqualeResultSet *resultset)
+{
+    if (resultset->spill_fd >= 0) {
+        close (resultset->spill_fd);
+        resultset->spill_fd = -1;
+    }
+    resultset->spilled_size = 0;
+}
+
+/* Days since 1970-01-01 of a date in the proleptic Gregorian calendar */
+static gint64
+squale_resultset_days_from_civil (gint year, guint month, guint day)
+{
+    gint era;
+    guint yoe, doy, doe;
+
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = (guint) (year - era * 400);
+    doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return (gint64) era * 146097 + (gint64) doe - 719468;
+}
+
+/* Parse "YYYY-MM-DD[ HH:MM:SS[.ffffff]]" as microseconds since the epoch. The
+   database session time zone is not known here so the value is taken as
+   UTC. */
+static gboolean
+squale_resultset_parse_timestamp (const char *value, gint32 length,
+                                  gint64 *timestamp)
+{
+    char buffer[32];
+    gint year = 0;
+    guint month = 0, day = 0, hour = 0, minute = 0, second = 0, n = 0;
+    gulong fraction = 0;
+    gint fraction_digits = 0;
+    char *dot = NULL;
+
+    if (length <= 0 || length >= (gint32) sizeof (buffer))
+        return FALSE;
+
+    memcpy (buffer, value, length);
+    buffer[length] = '\0';
+
+    n = sscanf (buffer, "%d-%u-%u %u:%u:%u", &year, &month, &day, &hour,
+                &minute, &second);
+    if (n < 3 || month < 1 || month > 12 || day < 1 || day > 31)
+        return FALSE;
+
+    dot = strchr (buffer, '.');
+    if (dot) {
+        dot++;
+        while (g_ascii_isdigit (*dot) && fraction_digits < 6) {
+            fraction = fraction * 10 + (*dot - '0');
+            fraction_digits++;
+            dot++;
+        }
+        while (fraction_digits++ < 6)
+            fraction *= 10;
+    }
+
+    *timestamp = ((squale_resultset_days_from_civil (year, month, day) * 86400 +
+                   hour * 3600 + minute * 60 + second) * G_GINT64_CONSTANT (1000000)) +
+            fraction;
+
+    return TRUE;
+}
+
+/* Convert a text value to the native type of the current column. Values that
+   can't be represented are reported as NULL */
+static gboolean
+squale_resultset_convert_value (SqualeResultSet *resultset, const char *value,
+                                gint32 length, guint64 *native,
+                                gboolean *is_null)
+{
+    char buffer[64], *end = NULL;
+
+    *is_null = FALSE;
+
+    switch (resultset->types[resultset->current_column]) {
+        case SQUALE_COLUMN_INT64:
+        {
+            gint64 int_value;
+            if (length <= 0 || length >= (gint32) sizeof (buffer))
+                break;
+            memcpy (buffer, value, length);
+            buffer[length] = '\0';
+            int_value = g_ascii_strtoll (buffer, &end, 10);
+            if (*end != '\0')
+                break;
+            memcpy (native, &int_value, sizeof (gint64));
+            return TRUE;
+        }
+        case SQUALE_COLUMN_DOUBLE:
+        {
+            gdouble double_value;
+            if (length <= 0 || length >= (gint32) sizeof (buffer))
+                break;
+            memcpy (buffer, value, length);
+            buffer[length] = '\0';
+            double_value = g_ascii_strtod (buffer, &end);
+            if (*end != '\0')
+                break;
+            memcpy (native, &double_value, sizeof (gdouble));
+            return TRUE;
+        }
+        case SQUALE_COLUMN_TIMESTAMP:
+        {
+            gint64 timestamp;
+            /* Zero dates and the like can't be represented, they are sent as
+               NULL */
+            if (!squale_resultset_parse_timestamp (value, length, &timestamp))
+                *is_null = TRUE;
+            else
+                memcpy (native, &timestamp, sizeof (gint64));
+            return TRUE;
+        }
+        default:
+            break;
+    }
+
+    g_warning (_("Failed converting value of column %d in resultset %p to its " \
+      "native type"), resultset->current_column, resultset);
+
+    return FALSE;
+}
+
+/* Pack a value converted to the native type of its column */
+static gboolean
+squale_resultset_add_binary_value (SqualeResultSet *resultset,
+                                   const char *value, gint32 length)
+{
+    guint64 native = 0;
+    gboolean is_null = FALSE;
+
+    if (resultset->types[resultset->current_column] == SQUALE_COLUMN_TEXT)
+        return squale_resultset_append_string (resultset, value, length);
+
+    if (!squale_resultset_convert_value (resultset, value, length, &native,
+                                         &is_null))
+        return FALSE;
+
+    if (is_null) {
+        resultset->data[resultset->row_offset + resultset->current_column / 8] |=
+                1 << (resultset->current_column % 8);
+        return TRUE;
+    }
+
+    return squale_resultset_append (resultset, &native, sizeof (guint64));
+}
+
+/* Columnar buffers */
+
+static gboolean
+squale_resultset_buffer_append (SqualeResultSet *resultset,
+                                SqualeResultSetBuffer *buffer,
+                                gconstpointer data, gulong length)
+{
+    gulong allocated = buffer->allocated;
+
+    if (!buffer->data) {
+        buffer->data = g_try_malloc0 (SQUALE_PAGE_SIZE);
+        if (!buffer->data)
+            return FALSE;
+        buffer->allocated = SQUALE_PAGE_SIZE;
+    }
+
+    if (!squale_check_mem_block (&(buffer->data), &(buffer->allocated),
+                                 buffer->size, length))
+        return FALSE;
+
+    if (buffer->allocated != allocated) {
+        resultset->columns_memory += buffer->allocated - allocated;
+        if (!squale_resultset_account (resultset, TRUE))
+            return FALSE;
+    }
+
+    memcpy (buffer->data + buffer->size, data, length);
+    buffer->size += length;
+
+    return TRUE;
+}
+
+static void
+squale_resultset_buffer_free (SqualeResultSetBuffer *buffer)
+{
+    if (buffer->data) {
+        g_free (buffer->data);
+        buffer->data = NULL;
+    }
+    buffer->size = buffer->allocated = 0;
+}
+
+static void
+squale_resultset_free_columns (SqualeResultSet *resultset)
+{
+    gint32 i;
+
+    if (!resultset->columns)
+        return;
+
+    for (i = 0; i < resultset->num_fields; i++) {
+        squale_resultset_buffer_free (&(resultset->columns[i].validity));
+        squale_resultset_buffer_free (&(resultset->columns[i].offsets));
+        squale_resultset_buffer_free (&(resultset->columns[i].values));
+    }
+
+    g_free (resultset->columns);
+    resultset->columns = NULL;
+
+    resultset->columns_memory = 0;
+    squale_resultset_account (resultset, FALSE);
+}
+
+/* Append a value to the buffers of the current column. NULL values get a
+   cleared validity bit and an empty slot */
+static gboolean
+squale_resultset_add_columnar_value (SqualeResultSet *resultset,
+                                     const char *value, gint32 length)
+{
+    SqualeResultSetColumn *column = &(resultset->columns[resultset->current_column]);
+    SqualeColumnType type = resultset->types[resultset->current_column];
+    gulong row = resultset->num_rows;
+    gboolean valid = (value != NULL);
+    guint64 native = 0;
+
+    if (row % 8 == 0) {
+        char byte = 0;
+        if (!squale_resultset_buffer_append (resultset, &(column->validity),
+                                             &byte, sizeof (char)))
+            return FALSE;
+    }
+
+    if (type == SQUALE_COLUMN_TEXT) {
+        gint32 offset;
+
+        if (valid && length > 0 &&
+            !squale_resultset_buffer_append (resultset, &(column->values),
+                                             value, length))
+            return FALSE;
+
+        /* Offsets are 32 bits like Arrow's Utf8 type */
+        if (column->values.size > G_MAXINT32) {
+            g_warning (_("Column %d of resultset %p is larger than 2GB"),
+                       resultset->current_column, resultset);
+            return FALSE;
+        }
+
+        offset = (gint32) column->values.size;
+        if (!squale_resultset_buffer_append (resultset, &(column->offsets),
+                                             &offset, sizeof (gint32)))
+            return FALSE;
+    }
+    else {
+        gboolean is_null = FALSE;
+
+        if (valid) {
+            if (!squale_resultset_convert_value (resultset, value, length,
+                                                 &native, &is_null))
+                return FALSE;
+            valid = !is_null;
+        }
+
+        if (!squale_resultset_buffer_append (resultset, &(column->values),
+                                             &native, sizeof (guint64)))
+            return FALSE;
+    }
+
+    if (valid)
+        column->validity.data[row / 8] |= 1 << (row % 8);
+
+    return TRUE;
+}
+
+/* Pad the data block with zeros up to the next 8 bytes boundary */
+static gboolean
+squale_resultset_align (SqualeResultSet *resultset)
+{
+    static const char padding[8] = { 0 };
+    gulong remainder = resultset->data_size % 8;
+
+    if (!remainder)
+        return TRUE;
+
+    return squale_resultset_append (resultset, padding, 8 - remainder);
+}
+
+/* Lay the column buffers out after the column names:
+   the number of rows as a gint64, then a directory with the gint64 offset of
+   each column from the start of the frame, then for each column its validity
+   bitmap, its gint32 offsets (TEXT columns only) and its values. Every one of
+   those starts on an 8 bytes boundary. */
+static gboolean
+squale_resultset_finish_columnar (SqualeResultSet *resultset)
+{
+    gulong directory_offset, total_size = 0;
+    gint64 num_rows = resultset->num_rows;
+    gint32 i;
+
+    /* Reserving everything at once, with room for the padding */
+    total_size = 2 * sizeof (gint64) + resultset->num_fields * sizeof (gint64);
+    for (i = 0; i < resultset->num_fields; i++) {
+        total_size += resultset->columns[i].validity.size +
+                resultset->columns[i].offsets.size +
+                resultset->columns[i].values.size + 3 * 8;
+    }
+    if (!squale_resultset_reserve (resultset, total_size))
+        return FALSE;
+
+    if (!squale_resultset_append (resultset, &num_rows, sizeof (gint64)) ||
+        !squale_resultset_align (resultset))
+        return FALSE;
+
+    directory_offset = resultset->data_size;
+    memset (resultset->data + directory_offset, 0,
+            resultset->num_fields * sizeof (gint64));
+    resultset->data_size += resultset->num_fields * sizeof (gint64);
+
+    for (i = 0; i < resultset->num_fields; i++) {
+        SqualeResultSetColumn *column = &(resultset->columns[i]);
+        gint64 column_offset;
+
+        if (!squale_resultset_align (resultset))
+            return FALSE;
+
+        column_offset = resultset->data_size;
+        memcpy (resultset->data + directory_offset + i * sizeof (gint64),
+                &column_offset, sizeof (gint64));
+
+        if (!squale_resultset_append (resultset, column->validity.data,
+                                      column->validity.size) ||
+            !squale_resultset_align (resultset))
+            return FALSE;
+
+        if (resultset->types[i] == SQUALE_COLUMN_TEXT &&
+            (!squale_resultset_append (resultset, column->offsets.data,
+                                       column->offsets.size) ||
+             !squale_resultset_align (resultset)))
+            return FALSE;
+
+        if (!squale_resultset_append (resultset, column->values.data,
+                                      column->values.size))
+            return FALSE;
+    }
+
+    if (!squale_resultset_align (resultset))
+        return FALSE;
+
+    squale_resultset_free_columns (resultset);
+
+    return TRUE;
+}
+
+/* ============================================================= */
+/*                                                               */
+/*                       Public Methods                          */
+/*                                                               */
+/* ============================================================= */
+
+SqualeResultSet *
+squale_resultset_new (void)
+{
+    SqualeResultSet *resultset = g_new0 (SqualeResultSet, 1);
+
+    resultset->ref_count = 1;
+    resultset->data = NULL;
+    resultset->data_size = 0;
+    resultset->allocated_memory = 0;
+    resultset->encoding = SQUALE_RESULTSET_TEXT;
+    resultset->types = NULL;
+    resultset->columns = NULL;
+    resultset->spill_threshold = 0;
+    resultset->spill_fd = -1;
+    resultset->spilled_size = 0;
+    resultset->budget = NULL;
+    resultset->columns_memory = 0;
+    resultset->accounted_memory = 0;
+    resultset->over_budget = FALSE;
+
+    return resultset;
+}
+
+SqualeResultSet *
+squale_resultset_ref (SqualeResultSet *resultset)
+{
+    g_return_val_if_fail (resultset != NULL, NULL);
+
+    g_atomic_int_inc (&(resultset->ref_count));
+
+    return resultset;
+}
+
+void
+squale_resultset_unref (SqualeResultSet *resultset)
+{
+    g_return_if_fail (resultset != NULL);
+
+    if (!g_atomic_int_dec_and_test (&(resultset->ref_count)))
+        return;
+
+    if (resultset->data) {
+        g_message (_("Freeing resultset memory %p (%lu bytes)"), resultset,
+                   resultset->allocated_memory);
+        g_free (resultset->data);
+        resultset->data = NULL;
+        resultset->allocated_memory = 0;
+    }
+
+    if (resultset->types) {
+        g_free (resultset->types);
+        resultset->types = NULL;
+    }
+
+    squale_resultset_free_columns (resultset);
+    squale_resultset_close_spill (resultset);
+    squale_resultset_account (resultset, FALSE);
+
+    g_free (resultset);
+}
+
+GQuark
+squale_resultset_error_quark (void)
+{
+    static GQuark quark = 0;
+    if (quark == 0)
+        quark = g_quark_from_static_string ("SQuaLe-resultset");
+    return quark;
+}
+
+/* Called once threads are initialized */
+void
+squale_memory_budget_init (void)
+{
+    budget_mutex = g_mutex_new ();
+    budget_cond = g_cond_new ();
+}
+
+SqualeMemoryBudget *
+squale_memory_budget_get_global (void)
+{
+    return &global_budget;
+}
+
+void
+squale_memory_budget_set_limit (SqualeMemoryBudget *budget, gulong limit)
+{
+    g_return_if_fail (budget != NULL);
+
+    if (budget_mutex)
+        g_mutex_lock (budget_mutex);
+    budget->limit = limit;
+    if (budget_mutex)
+        g_mutex_unlock (budget_mutex);
+}
+
+/* No new work should be accepted while a budget is exhausted */
+gboolean
+squale_memory_budget_exhausted (SqualeMemoryBudget *budget)
+{
+    gboolean exhausted;
+
+    g_return_val_if_fail (budget != NULL, FALSE);
+
+    g_mutex_lock (budget_mutex);
+    exhausted = budget->limit && budget->used >= budget->limit;
+    g_mutex_unlock (budget_mutex);
+
+    return exhausted;
+}
+
+void
+squale_memory_budget_get_usage (SqualeMemoryBudget *budget, gulong *used,
+                                gulong *high_water)
+{
+    g_return_if_fail (budget != NULL);
+
+    g_mutex_lock (budget_mutex);
+    if (used)
+        *used = budget->used;
+    if (high_water)
+        *high_water = budget->high_water;
+    g_mutex_unlock (budget_mutex);
+}
+
+/* The resultset is charged to that budget on top of the global one, that has
+   to be done before anything is packed */
+void
+squale_resultset_set_budget (SqualeResultSet *resultset,
+                             SqualeMemoryBudget *budget)
+{
+    g_return_if_fail (resultset != NULL);
+    g_return_if_fail (resultset->accounted_memory == 0);
+
+    resultset->budget = budget;
+}
+
+/* For data blocks allocated outside of the packing functions */
+void
+squale_resultset_update_budget (SqualeResultSet *resultset)
+{
+    g_return_if_fail (resultset != NULL);
+
+    squale_resultset_account (resultset, FALSE);
+}
+
+/* A packing failure because of the memory budget is worth retrying later */
+GError *
+squale_resultset_get_error (SqualeResultSet *resultset)
+{
+    g_return_val_if_fail (resultset != NULL, NULL);
+
+    if (!resultset->over_budget)
+        return NULL;
+
+    return g_error_new (squale_resultset_error_quark (),
+                        SQUALE_RESULTSET_ERROR_BUDGET,
+                        _("Memory budget exhausted, retry later"));
+}
+
+/* 0 keeps the whole resultset in memory */
+void
+squale_resultset_set_spill_threshold (SqualeResultSet *resultset,
+                                      gulong spill_threshold)
+{
+    g_return_if_fail (resultset != NULL);
+
+    resultset->spill_threshold = spill_threshold;
+}
+
+/* Is there a packed resultset, in memory or spilled ? */
+gboolean
+squale_resultset_has_data (SqualeResultSet *resultset)
+{
+    g_return_val_if_fail (resultset != NULL, FALSE);
+
+    return resultset->data != NULL || resultset->spill_fd >= 0;
+}
+
+/* Size of the whole frame, header included */
+gulong
+squale_resultset_get_size (SqualeResultSet *resultset)
+{
+    g_return_val_if_fail (resultset != NULL, 0);
+
+    return resultset->spilled_size + resultset->data_size;
+}
+
+/* Start packing a resultset. Room is kept at the beginning for the header
+   that the client will send */
+gboolean
+squale_resultset_begin (SqualeResultSet *resultset,
+                        SqualeResultSetEncoding encoding, gint32 num_fields)
+{
+    g_return_val_if_fail (resultset != NULL, FALSE);
+    g_return_val_if_fail (resultset->data == NULL, FALSE);
+
+    resultset->encoding = encoding;
+    resultset->num_fields = num_fields;
+    resultset->current_column = 0;
+    resultset->num_rows = 0;
+    resultset->types = g_new0 (SqualeColumnType, MAX (num_fields, 1));
+
+    if (encoding == SQUALE_RESULTSET_COLUMNAR)
+        resultset->columns = g_new0 (SqualeResultSetColumn, MAX (num_fields, 1));
+
+    resultset->over_budget = FALSE;
+
+    resultset->data = g_try_malloc0 (SQUALE_PAGE_SIZE);
+    if (!resultset->data) {
+        return FALSE;
+    }
+
+    resultset->allocated_memory = SQUALE_PAGE_SIZE;
+    if (!squale_resultset_account (resultset, TRUE))
+        return FALSE;
+
+    resultset->data_size = SQUALE_RESULTSET_HEADER_SIZE;
+
+    if (!squale_resultset_append (resultset, &num_fields, sizeof (gint32)))
+        return FALSE;
+
+    /* No columns at all, the number of rows comes right away */
+    if (num_fields == 0 && encoding != SQUALE_RESULTSET_COLUMNAR) {
+        resultset->num_rows_offset = resultset->data_size;
+        if (!squale_resultset_reserve (resultset, sizeof (gulong)))
+            return FALSE;
+        resultset->data_size += sizeof (gulong);
+    }
+
+    return TRUE;
+}
+
+gboolean
+squale_resultset_add_column (SqualeResultSet *resultset, const char *name,
+                             gint32 length, SqualeColumnType type)
+{
+    g_return_val_if_fail (resultset != NULL, FALSE);
+    g_return_val_if_fail (resultset->current_column < resultset->num_fields,
+                          FALSE);
+
+    if (!squale_resultset_append_string (resultset, name, length))
+        return FALSE;
+
+    /* Typed encodings send the type of each column */
+    if (resultset->encoding != SQUALE_RESULTSET_TEXT) {
+        char type_char = (char) type;
+        if (!squale_resultset_append (resultset, &type_char, sizeof (char)))
+            return FALSE;
+    }
+
+    /* Text columns start with a first offset of 0 */
+    if (resultset->encoding == SQUALE_RESULTSET_COLUMNAR &&
+        type == SQUALE_COLUMN_TEXT) {
+        gint32 offset = 0;
+        if (!squale_resultset_buffer_append (resultset,
+                &(resultset->columns[resultset->current_column].offsets),
+                &offset, sizeof (gint32)))
+            return FALSE;
+    }
+
+    resultset->types[resultset->current_column++] = type;
+
+    /* Last column, reserve the number of rows. Columnar resultsets write it
+       when they are finished */
+    if (resultset->current_column == resultset->num_fields &&
+        resultset->encoding == SQUALE_RESULTSET_COLUMNAR) {
+        resultset->current_column = 0;
+    }
+    else if (resultset->current_column == resultset->num_fields) {
+        resultset->num_rows_offset = resultset->data_size;
+        if (!squale_resultset_reserve (resultset, sizeof (gulong)))
+            return FALSE;
+        resultset->data_size += sizeof (gulong);
+        resultset->current_column = 0;
+    }
+
+    return TRUE;
+}
+
+/* Add the next value of the current row, a NULL value pointer means NULL */
+gboolean
+squale_resultset_add_value (SqualeResultSet *resultset, const char *value,
+                            gint32 length)
+{
+    g_return_val_if_fail (resultset != NULL, FALSE);
+
+    if (resultset->encoding == SQUALE_RESULTSET_TEXT) {
+        resultset->current_column++;
+        return squale_resultset_append_string (resultset, value,
+                                               value ? length : 0);
+    }
+
+    if (resultset->encoding == SQUALE_RESULTSET_COLUMNAR) {
+        if (!squale_resultset_add_columnar_value (resultset, value, length))
+            return FALSE;
+        resultset->current_column++;
+        return TRUE;
+    }
+
+    /* First value of the row, reserve the NULL bitmap */
+    if (resultset->current_column == 0) {
+        gulong bitmap_size = (resultset->num_fields + 7) / 8;
+        if (!squale_resultset_reserve (resultset, bitmap_size))
+            return FALSE;
+        resultset->row_offset = resultset->data_size;
+        memset (resultset->data + resultset->data_size, 0, bitmap_size);
+        resultset->data_size += bitmap_size;
+    }
+
+    if (value == NULL) {
+        resultset->data[resultset->row_offset + resultset->current_column / 8] |=
+                1 << (resultset->current_column % 8);
+    }
+    else if (!squale_resultset_add_binary_value (resultset, value, length)) {
+        return FALSE;
+    }
+
+    resultset->current_column++;
+
+    return TRUE;
+}
+
+gboolean
+squale_resultset_end_row (SqualeResultSet *resultset)
+{
+    g_return_val_if_fail (resultset != NULL, FALSE);
+
+    resultset->current_column = 0;
+    resultset->num_rows++;
+
+    /* Spilling on row boundaries only so that the NULL bitmap of the row
+       being packed is always in memory. Columnar buffers are only laid out
+       when finishing and are never spilled. */
+    if (resultset->spill_threshold &&
+        resultset->encoding != SQUALE_RESULTSET_COLUMNAR &&
+        resultset->data_size >= resultset->spill_threshold)
+        return squale_resultset_spill (resultset);
+
+    return TRUE;
+}
+
+/* Write the number of rows, the resultset is ready to be sent */
+gboolean
+squale_resultset_finish (SqualeResultSet *resultset)
+{
+    g_return_val_if_fail (resultset != NULL, FALSE);
+    g_return_val_if_fail (resultset->data != NULL, FALSE);
+
+    if (resultset->encoding == SQUALE_RESULTSET_COLUMNAR)
+        return squale_resultset_finish_columnar (resultset);
+
+    if (resultset->spill_fd < 0) {
+        *(gulong *)(resultset->data + resultset->num_rows_offset) =
+                resultset->num_rows;
+        return TRUE;
+    }
+
+    /* The number of rows might already be on disk */
+    if (resultset->num_rows_offset < resultset->spilled_size) {
+        if (pwrite (resultset->spill_fd, &(resultset->num_rows), sizeof (gulong),
+                    resultset->num_rows_offset) != sizeof (gulong)) {
+            g_warning (_("Failed writing resultset %p to its spill file: %s"),
+                       resultset, strerror (errno));
+            return FALSE;
+        }
+    }
+    else {
+        *(gulong *)(resultset->data + resultset->num_rows_offset -
+                    resultset->spilled_size) = resultset->num_rows;
+    }
+
+    if (!squale_resultset_spill (resultset))
+        return FALSE;
+
+    g_free (resultset->data);
+    resultset->data = NULL;
+    resultset->allocated_memory = 0;
+    squale_resultset_account (resultset, FALSE);
+
+    return TRUE;
+}
+
+/* Drop whatever has been packed so far */
+void
+squale_resultset_abort (SqualeResultSet *resultset)
+{
+    g_return_if_fail (resultset != NULL);
+
+    if (resultset->data) {
+        g_free (resultset->data);
+        resultset->data = NULL;
+    }
+
+    resultset->data_size = resultset->allocated_memory = 0;
+
+    squale_resultset_free_columns (resultset);
+    squale_resultset_close_spill (resultset);
+    squale_resultset_account (resultset, FALSE);
+
+    resultset->num_rows = 0;
+    resultset->current_column = 0;
+}
@@ -0,0 +1,167 @@
+/*  SQuaLe
+ *
+ *  Copyright (C) 2005 Julien Moutte <julien@moutte.net>
+ *
+ *  squaleresultset.h : Header for SqualeResultSet structure.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __SQUALE_RESULTSET_H__
+#define __SQUALE_RESULTSET_H__
+
+#include <glib.h>
+
+typedef struct _SqualeResultSet SqualeResultSet;
+typedef struct _SqualeResultSetBuffer SqualeResultSetBuffer;
+typedef struct _SqualeResultSetColumn SqualeResultSetColumn;
+typedef struct _SqualeMemoryBudget SqualeMemoryBudget;
+
+/* How long a worker waits for memory to be released when packing a
+   resultset over budget before failing its job (ms) */
+#define SQUALE_MEMORY_BUDGET_WAIT 1000
+
+typedef enum
+{
+    /* Retryable, the client should send the order again later */
+    SQUALE_RESULTSET_ERROR_BUDGET
+} SqualeResultSetError;
+
+typedef enum
+{
+    SQUALE_RESULTSET_TEXT,
+    SQUALE_RESULTSET_BINARY,
+    SQUALE_RESULTSET_COLUMNAR
+} SqualeResultSetEncoding;
+
+/* Column types of the binary and columnar encodings. Each column name is followed by its
+   type and each row starts with a NULL bitmap, one bit per column. Non NULL
+   values are then packed natively: 8 bytes for INT64 and DOUBLE, microseconds
+   since the epoch as 8 bytes for TIMESTAMP, length prefixed text for TEXT */
+typedef enum
+{
+    SQUALE_COLUMN_TEXT = 0,
+    SQUALE_COLUMN_INT64 = 1,
+    SQUALE_COLUMN_DOUBLE = 2,
+    SQUALE_COLUMN_TIMESTAMP = 3
+} SqualeColumnType;
+
+/* The columnar encoding keeps the column names and types but then stores the
+   values column by column with the Arrow memory layout: a validity bitmap
+   (bit set means not NULL, least significant bit first), contiguous 8 bytes
+   values for fixed size columns and gint32 offsets followed by the
+   concatenated bytes for TEXT columns. Every buffer is 8 bytes aligned from
+   the start of the frame so that it can be mapped as is. While packing each
+   column grows its own buffers which get laid out when finishing. */
+struct _SqualeResultSetBuffer
+{
+    char *data;
+    gulong size;
+    gulong allocated;
+};
+
+struct _SqualeResultSetColumn
+{
+    SqualeResultSetBuffer validity;
+    SqualeResultSetBuffer offsets;
+    SqualeResultSetBuffer values;
+};
+
+/* Bytes held by packed resultsets, either globally or for a joblist. A limit
+   of 0 means no limit. Each resultset is charged to the global budget and to
+   the budget of its joblist, until it is freed. */
+struct _SqualeMemoryBudget
+{
+    gulong limit;
+    gulong used;
+    gulong high_water;
+};
+
+/* Every packed resultset starts with room for the assignation time, the
+   processing time and the result type char. Those are specific to each
+   client and are never written in the shared data block. */
+#define SQUALE_RESULTSET_HEADER_SIZE (2 * sizeof (gint32) + sizeof (char))
+
+/* A resultset is refcounted so that several jobs (and the clients sending
+   it) can share the same packed data block. The data is only freed when the
+   last reference is dropped. */
+struct _SqualeResultSet
+{
+    gint ref_count;
+
+    SqualeResultSetEncoding encoding;
+
+    char *data;
+    gulong data_size;
+    gulong allocated_memory;
+
+    /* Packing state */
+    gint32 num_fields;
+    gint32 current_column;
+    SqualeColumnType *types;
+    SqualeResultSetColumn *columns;
+    gulong num_rows;
+    gulong num_rows_offset;
+    gulong row_offset;
+
+    /* Above spill_threshold bytes the packed rows are moved to an unlinked
+       temporary file, spilled_size bytes of the frame are then in spill_fd
+       and data only holds what comes after them */
+    gulong spill_threshold;
+    gint spill_fd;
+    gulong spilled_size;
+
+    /* Memory accounting */
+    SqualeMemoryBudget *budget;
+    gulong columns_memory;
+    gulong accounted_memory;
+    gboolean over_budget;
+};
+
+GQuark squale_resultset_error_quark (void);
+
+void squale_memory_budget_init (void);
+SqualeMemoryBudget *squale_memory_budget_get_global (void);
+void squale_memory_budget_set_limit (SqualeMemoryBudget *budget, gulong limit);
+gboolean squale_memory_budget_exhausted (SqualeMemoryBudget *budget);
+void squale_memory_budget_get_usage (SqualeMemoryBudget *budget, gulong *used,
+                                     gulong *high_water);
+
+SqualeResultSet *squale_resultset_new (void);
+SqualeResultSet *squale_resultset_ref (SqualeResultSet *resultset);
+void squale_resultset_unref (SqualeResultSet *resultset);
+
+void squale_resultset_set_spill_threshold (SqualeResultSet *resultset,
+                                           gulong spill_threshold);
+void squale_resultset_set_budget (SqualeResultSet *resultset,
+                                  SqualeMemoryBudget *budget);
+void squale_resultset_update_budget (SqualeResultSet *resultset);
+GError *squale_resultset_get_error (SqualeResultSet *resultset);
+gboolean squale_resultset_has_data (SqualeResultSet *resultset);
+gulong squale_resultset_get_size (SqualeResultSet *resultset);
+
+gboolean squale_resultset_begin (SqualeResultSet *resultset,
+                                 SqualeResultSetEncoding encoding,
+                                 gint32 num_fields);
+gboolean squale_resultset_add_column (SqualeResultSet *resultset,
+                                      const char *name, gint32 length,
+                                      SqualeColumnType type);
+gboolean squale_resultset_add_value (SqualeResultSet *resultset,
+                                     const char *value, gint32 length);
+gboolean squale_resultset_end_row (SqualeResultSet *resultset);
+gboolean squale_resultset_finish (SqualeResultSet *resultset);
+void squale_resultset_abort (SqualeResultSet *resultset);
+
+#endif /* __SQUALE_RESULTSET_H__ */
@@ -0,0 +1,594 @@
+/*  SQuaLe
+ *
+ *  Copyright (C) 2005 Julien Moutte <julien@moutte.net>
+ *
+ *  squalespool.c : Source for SqualeSpool structure.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "squale.h"
+#include "squalespool.h"
+#include "squale-i18n.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_DMALLOC
+#include <dmalloc.h>
+#endif
+
+typedef struct _SqualeSpoolRecord SqualeSpoolRecord;
+
+struct _SqualeSpoolRecord
+{
+    gulong offset;
+    gulong size;
+    guint64 seq;
+    gboolean done;
+};
+
+static guint32 crc_table[256];
+static gboolean crc_table_ready = FALSE;
+
+/* ============================================================= */
+/*                                                               */
+/*                       Private Methods                         */
+/*                                                               */
+/* ============================================================= */
+
+/* CRC-32 as used by zlib, the table is built once from the main thread when
+   the first spool is opened */
+static void
+squale_spool_crc_init (void)
+{
+    guint32 i, j, c;
+
+    if (crc_table_ready)
+        return;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+
+    crc_table_ready = TRUE;
+}
+
+static guint32
+squale_spool_crc_update (guint32 crc, const char *data, gulong length)
+{
+    const guchar *walk = (const guchar *) data;
+
+    crc = ~crc;
+    while (length--) {
+        crc = crc_table[(crc ^ *walk++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+static guint32
+squale_spool_record_crc (SqualeSpoolRecordHeader *header, const char *order)
+{
+    SqualeSpoolRecordHeader copy = *header;
+    guint32 crc;
+
+    copy.crc = 0;
+    crc = squale_spool_crc_update (0, (const char *) &copy, sizeof (copy));
+    if (order && header->length != SQUALE_SPOOL_WRAP)
+        crc = squale_spool_crc_update (crc, order, header->length);
+
+    return crc;
+}
+
+static gulong
+squale_spool_record_size (gulong length)
+{
+    return (sizeof (SqualeSpoolRecordHeader) + length + 7) & ~((gulong) 7);
+}
+
+/* No room for a record header before the end, the reader goes on at the
+   beginning without a wrap record */
+static gulong
+squale_spool_wrap_offset (SqualeSpool *spool, gulong offset)
+{
+    if (offset + sizeof (SqualeSpoolRecordHeader) > spool->end)
+        return sizeof (SqualeSpoolHeader);
+
+    return offset;
+}
+
+static void
+squale_spool_reset (SqualeSpool *spool)
+{
+    memset (spool->map, 0, spool->end);
+    memcpy (spool->header->magic, SQUALE_SPOOL_MAGIC,
+            sizeof (spool->header->magic));
+    spool->header->head = sizeof (SqualeSpoolHeader);
+    spool->header->head_seq = 1;
+}
+
+/* Follow the records from head while their sequence numbers follow each
+   other and their checksum matches, the first one which does not is where
+   the next record goes. Returns the number of orders found. */
+static gulong
+squale_spool_scan (SqualeSpool *spool)
+{
+    gulong offset = spool->header->head;
+    guint64 seq = spool->header->head_seq;
+    gulong nb_orders = 0;
+
+    for (;;) {
+        gulong at = squale_spool_wrap_offset (spool, offset);
+        SqualeSpoolRecordHeader *record =
+            (SqualeSpoolRecordHeader *)(spool->map + at);
+
+        if (record->seq != seq)
+            break;
+
+        if (record->length == SQUALE_SPOOL_WRAP) {
+            if (record->crc != squale_spool_record_crc (record, NULL))
+                break;
+            offset = sizeof (SqualeSpoolHeader);
+            seq++;
+            continue;
+        }
+
+        if (at + squale_spool_record_size (record->length) > spool->end ||
+            record->crc != squale_spool_record_crc (record,
+                                                    spool->map + at +
+                                                    sizeof (SqualeSpoolRecordHeader)))
+            break;
+
+        offset = at + squale_spool_record_size (record->length);
+        seq++;
+        nb_orders++;
+    }
+
+    spool->tail = offset;
+    spool->next_seq = seq;
+
+    return nb_orders;
+}
+
+/* Offset where a record of that size can be written, a wrap record is
+   written first if it has to go at the beginning of the ring. Returns 0 when
+   it does not fit before the head of the last sync. The spool has to be
+   locked. */
+static gulong
+squale_spool_reserve (SqualeSpool *spool, gulong record_size)
+{
+    gulong start = sizeof (SqualeSpoolHeader);
+    gulong limit = spool->synced_head;
+    gulong tail = spool->tail;
+
+    /* tail never catches up with limit, tail == limit means nothing is kept */
+    if (tail >= limit) {
+        if (tail + record_size <= spool->end)
+            return tail;
+        if (start + record_size >= limit)
+            return 0;
+        if (tail + sizeof (SqualeSpoolRecordHeader) <= spool->end) {
+            SqualeSpoolRecordHeader *wrap =
+                (SqualeSpoolRecordHeader *)(spool->map + tail);
+
+            wrap->length = SQUALE_SPOOL_WRAP;
+            wrap->seq = spool->next_seq++;
+            wrap->crc = squale_spool_record_crc (wrap, NULL);
+        }
+        return start;
+    }
+
+    if (tail + record_size < limit)
+        return tail;
+
+    return 0;
+}
+
+/* Move head past the records which are all done. The spool has to be
+   locked. */
+static void
+squale_spool_advance (SqualeSpool *spool)
+{
+    while (spool->in_flight) {
+        SqualeSpoolRecord *record = spool->in_flight->data;
+
+        if (!record->done)
+            break;
+
+        spool->header->head = record->offset + record->size;
+        spool->header->head_seq = record->seq + 1;
+        spool->in_flight = g_list_delete_link (spool->in_flight,
+                                               spool->in_flight);
+        g_free (record);
+    }
+
+    if (!spool->in_flight) {
+        spool->header->head = spool->drain_offset;
+        spool->header->head_seq = spool->drain_seq;
+    }
+}
+
+static SqualeSpoolRecord *
+squale_spool_find (SqualeSpool *spool, gulong offset)
+{
+    GList *walk = spool->in_flight;
+
+    while (walk) {
+        SqualeSpoolRecord *record = walk->data;
+        if (record->offset == offset)
+            return record;
+        walk = g_list_next (walk);
+    }
+
+    return NULL;
+}
+
+/* ============================================================= */
+/*                                                               */
+/*                       Public Methods                          */
+/*                                                               */
+/* ============================================================= */
+
+GQuark
+squale_spool_error_quark (void)
+{
+    static GQuark quark = 0;
+    if (quark == 0)
+        quark = g_quark_from_static_string ("SQuaLe-spool");
+    return quark;
+}
+
+/* Open or create the spool file. An existing spool keeps its records which
+   will be drained again. The file is never shrunk. */
+SqualeSpool *
+squale_spool_open (const char *path, gulong size, GError **error)
+{
+    SqualeSpool *spool = NULL;
+    struct stat st;
+    gint fd;
+    char *map = NULL;
+    gulong nb_orders;
+
+    g_return_val_if_fail (path != NULL, NULL);
+
+    squale_spool_crc_init ();
+
+    if (size < sizeof (SqualeSpoolHeader) + 4096)
+        size = SQUALE_SPOOL_SIZE;
+
+    fd = open (path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        g_set_error (error, squale_spool_error_quark (), SQUALE_SPOOL_ERROR_OPEN,
+                     _("Failed opening spool %s: %s"), path, strerror (errno));
+        return NULL;
+    }
+
+    if (fstat (fd, &st) < 0) {
+        g_set_error (error, squale_spool_error_quark (), SQUALE_SPOOL_ERROR_OPEN,
+                     _("Failed opening spool %s: %s"), path, strerror (errno));
+        close (fd);
+        return NULL;
+    }
+
+    if ((gulong) st.st_size < size) {
+        if (ftruncate (fd, size) < 0) {
+            g_set_error (error, squale_spool_error_quark (), SQUALE_SPOOL_ERROR_OPEN,
+                         _("Failed growing spool %s: %s"), path, strerror (errno));
+            close (fd);
+            return NULL;
+        }
+    }
+    else {
+        size = st.st_size;
+    }
+
+    map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        g_set_error (error, squale_spool_error_quark (), SQUALE_SPOOL_ERROR_OPEN,
+                     _("Failed mapping spool %s: %s"), path, strerror (errno));
+        close (fd);
+        return NULL;
+    }
+
+    spool = g_new0 (SqualeSpool, 1);
+
+    spool->ref_count = 1;
+    spool->mutex = g_mutex_new ();
+    spool->path = g_strdup (path);
+    spool->fd = fd;
+    spool->map = map;
+    spool->size = size;
+    spool->header = (SqualeSpoolHeader *) map;
+    spool->end = size & ~((gulong) 7);
+    spool->in_flight = NULL;
+    spool->retry = NULL;
+    spool->nb_appended = 0;
+    spool->nb_drained = 0;
+    spool->nb_syncs = 0;
+
+    if (memcmp (spool->header->magic, SQUALE_SPOOL_MAGIC,
+                sizeof (spool->header->magic))) {
+        squale_spool_reset (spool);
+    }
+    else if (spool->header->head < sizeof (SqualeSpoolHeader) ||
+             spool->header->head > spool->end) {
+        g_warning (_("Spool %s is corrupted, dropping its content"), path);
+        squale_spool_reset (spool);
+    }
+
+    /* Replay stops at the first torn or stale record */
+    nb_orders = squale_spool_scan (spool);
+    if (nb_orders) {
+        g_message (_("Spool %s has %lu orders to replay"), path, nb_orders);
+    }
+
+    spool->synced_seq = spool->next_seq;
+    spool->synced_head = spool->header->head;
+    spool->drain_offset = spool->header->head;
+    spool->drain_seq = spool->header->head_seq;
+
+    return spool;
+}
+
+SqualeSpool *
+squale_spool_ref (SqualeSpool *spool)
+{
+    g_return_val_if_fail (spool != NULL, NULL);
+
+    g_atomic_int_inc (&(spool->ref_count));
+
+    return spool;
+}
+
+void
+squale_spool_unref (SqualeSpool *spool)
+{
+    GList *walk = NULL;
+
+    g_return_if_fail (spool != NULL);
+
+    if (!g_atomic_int_dec_and_test (&(spool->ref_count)))
+        return;
+
+    /* What was not done yet stays between head and tail */
+    msync (spool->map, spool->size, MS_SYNC);
+    munmap (spool->map, spool->size);
+    close (spool->fd);
+
+    walk = spool->in_flight;
+    while (walk) {
+        g_free (walk->data);
+        walk = g_list_next (walk);
+    }
+    g_list_free (spool->in_flight);
+    g_list_free (spool->retry);
+
+    g_mutex_free (spool->mutex);
+    g_free (spool->path);
+    g_free (spool);
+}
+
+/* Append an order at the tail of the spool. It is only durable once the
+   spool has been synced. */
+gboolean
+squale_spool_append (SqualeSpool *spool, const char *order, GError **error)
+{
+    SqualeSpoolRecordHeader *header = NULL;
+    gulong length, record_size, offset;
+
+    g_return_val_if_fail (spool != NULL, FALSE);
+    g_return_val_if_fail (order != NULL, FALSE);
+
+    length = strlen (order);
+    record_size = squale_spool_record_size (length);
+
+    g_mutex_lock (spool->mutex);
+
+    offset = length < SQUALE_SPOOL_WRAP ?
+        squale_spool_reserve (spool, record_size) : 0;
+
+    if (!offset) {
+        g_mutex_unlock (spool->mutex);
+        g_set_error (error, squale_spool_error_quark (), SQUALE_SPOOL_ERROR_FULL,
+                     _("Spool %s is full"), spool->path);
+        return FALSE;
+    }
+
+    header = (SqualeSpoolRecordHeader *)(spool->map + offset);
+    memcpy (spool->map + offset + sizeof (SqualeSpoolRecordHeader), order,
+            length);
+    header->length = (guint32) length;
+    header->seq = spool->next_seq++;
+    header->crc = squale_spool_record_crc (header, order);
+
+    spool->tail = offset + record_size;
+    spool->nb_appended++;
+
+    g_mutex_unlock (spool->mutex);
+
+    return TRUE;
+}
+
+/* Flush the spool to disk, every order appended before is then durable and
+   can be drained. That's one system call for all the orders appended since
+   the last sync. It blocks for the length of a disk flush, it is not meant
+   to be called from the main loop. */
+gboolean
+squale_spool_sync (SqualeSpool *spool, GError **error)
+{
+    guint64 seq;
+    gulong head;
+    gint ret;
+
+    g_return_val_if_fail (spool != NULL, FALSE);
+
+    g_mutex_lock (spool->mutex);
+    seq = spool->next_seq;
+    head = spool->header->head;
+    g_mutex_unlock (spool->mutex);
+
+    /* Only dirty pages get written */
+    ret = msync (spool->map, spool->size, MS_SYNC);
+
+    if (ret < 0) {
+        g_set_error (error, squale_spool_error_quark (), SQUALE_SPOOL_ERROR_SYNC,
+                     _("Failed syncing spool %s: %s"), spool->path,
+                     strerror (errno));
+        return FALSE;
+    }
+
+    g_mutex_lock (spool->mutex);
+    /* The rest might have been dropped as corrupted meanwhile */
+    spool->synced_seq = MIN (seq, spool->next_seq);
+    spool->synced_head = head;
+    spool->nb_syncs++;
+    g_mutex_unlock (spool->mutex);
+
+    return TRUE;
+}
+
+/* Hand the next order to a worker, records given back come first. Returns
+   FALSE when there is nothing synced to drain. */
+gboolean
+squale_spool_next (SqualeSpool *spool, char **order, gulong *record)
+{
+    SqualeSpoolRecord *next = NULL;
+    SqualeSpoolRecordHeader *header = NULL;
+
+    g_return_val_if_fail (spool != NULL, FALSE);
+    g_return_val_if_fail (order != NULL, FALSE);
+    g_return_val_if_fail (record != NULL, FALSE);
+
+    g_mutex_lock (spool->mutex);
+
+    if (spool->retry) {
+        next = spool->retry->data;
+        spool->retry = g_list_delete_link (spool->retry, spool->retry);
+    }
+
+    while (!next && spool->drain_seq < spool->synced_seq) {
+        gulong offset = squale_spool_wrap_offset (spool, spool->drain_offset);
+
+        header = (SqualeSpoolRecordHeader *)(spool->map + offset);
+
+        if (header->seq != spool->drain_seq) {
+            g_warning (_("Corrupted record at offset %lu in spool %s, " \
+                         "dropping the rest of the spool"),
+                       offset, spool->path);
+            spool->drain_offset = offset;
+            spool->tail = offset;
+            spool->next_seq = spool->drain_seq;
+            spool->synced_seq = spool->drain_seq;
+            squale_spool_advance (spool);
+            break;
+        }
+
+        if (header->length == SQUALE_SPOOL_WRAP) {
+            spool->drain_offset = sizeof (SqualeSpoolHeader);
+            spool->drain_seq++;
+            continue;
+        }
+
+        next = g_new0 (SqualeSpoolRecord, 1);
+        next->offset = offset;
+        next->size = squale_spool_record_size (header->length);
+        next->seq = header->seq;
+        next->done = FALSE;
+
+        spool->drain_offset = offset + next->size;
+        spool->drain_seq++;
+        spool->in_flight = g_list_append (spool->in_flight, next);
+    }
+
+    if (next) {
+        header = (SqualeSpoolRecordHeader *)(spool->map + next->offset);
+        *order = g_strndup (spool->map + next->offset +
+                            sizeof (SqualeSpoolRecordHeader), header->length);
+        *record = next->offset;
+        spool->nb_drained++;
+    }
+
+    g_mutex_unlock (spool->mutex);
+
+    return next != NULL;
+}
+
+/* The order of that record has been run */
+void
+squale_spool_done (SqualeSpool *spool, gulong record)
+{
+    SqualeSpoolRecord *done = NULL;
+
+    g_return_if_fail (spool != NULL);
+
+    g_mutex_lock (spool->mutex);
+
+    done = squale_spool_find (spool, record);
+    if (done) {
+        done->done = TRUE;
+        squale_spool_advance (spool);
+    }
+
+    g_mutex_unlock (spool->mutex);
+}
+
+/* The order of that record could not be run, hand it out again */
+void
+squale_spool_giveup (SqualeSpool *spool, gulong record)
+{
+    SqualeSpoolRecord *given = NULL;
+
+    g_return_if_fail (spool != NULL);
+
+    g_mutex_lock (spool->mutex);
+
+    given = squale_spool_find (spool, record);
+    if (given && !g_list_find (spool->retry, given)) {
+        spool->retry = g_list_append (spool->retry, given);
+    }
+
+    g_mutex_unlock (spool->mutex);
+}
+
+/* Bytes of orders not run yet */
+gulong
+squale_spool_get_pending (SqualeSpool *spool)
+{
+    gulong pending;
+
+    g_return_val_if_fail (spool != NULL, 0);
+
+    g_mutex_lock (spool->mutex);
+    if (spool->tail >= spool->header->head)
+        pending = spool->tail - spool->header->head;
+    else
+        pending = spool->end - spool->header->head +
+            spool->tail - sizeof (SqualeSpoolHeader);
+    g_mutex_unlock (spool->mutex);
+
+    return pending;
+}
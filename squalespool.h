@@ -0,0 +1,126 @@
+/*  SQuaLe
+ *
+ *  Copyright (C) 2005 Julien Moutte <julien@moutte.net>
+ *
+ *  squalespool.h : Header for SqualeSpool structure.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __SQUALE_SPOOL_H__
+#define __SQUALE_SPOOL_H__
+
+#include <glib.h>
+
+typedef struct _SqualeSpool SqualeSpool;
+typedef struct _SqualeSpoolHeader SqualeSpoolHeader;
+typedef struct _SqualeSpoolRecordHeader SqualeSpoolRecordHeader;
+
+#define SQUALE_SPOOL_MAGIC "SQSPOOL2"
+
+/* Length of the record telling the reader to go on at the beginning of the
+   ring */
+#define SQUALE_SPOOL_WRAP G_MAXUINT32
+
+/* Default size of the spool file */
+#define SQUALE_SPOOL_SIZE (16 * 1024 * 1024)
+
+typedef enum
+{
+    SQUALE_SPOOL_ERROR_OPEN,
+    SQUALE_SPOOL_ERROR_FULL,
+    SQUALE_SPOOL_ERROR_SYNC
+} SqualeSpoolError;
+
+/* The spool file starts with that header followed by a ring of records.
+   Records from head on have not been run yet and are replayed when the
+   spool is opened again, head_seq is the sequence number of the record at
+   head. Both share a sector so they reach the disk together. There is no
+   tail on disk, replay follows the records as long as their sequence
+   numbers follow each other and their checksum matches. Orders might thus
+   run twice after a crash, never zero times once they have been synced. */
+struct _SqualeSpoolHeader
+{
+    char magic[8];
+    guint64 head;
+    guint64 head_seq;
+};
+
+/* Each record starts with that header followed by the order, padded to 8
+   bytes. The crc covers the header with crc set to 0 and the order. */
+struct _SqualeSpoolRecordHeader
+{
+    guint32 length;
+    guint32 crc;
+    guint64 seq;
+};
+
+/* A spool is shared between the main thread appending orders, the thread
+   syncing it and the workers draining them, everything is protected by the
+   mutex. Records are never moved once written. They are handed to workers
+   in order once synced but can complete in any order, head only moves past
+   records which are all done. New records only overwrite what was before
+   head at the last sync, the head on disk might still point there. */
+struct _SqualeSpool
+{
+    gint ref_count;
+
+    GMutex *mutex;
+
+    char *path;
+    gint fd;
+    char *map;
+    gulong size;
+    SqualeSpoolHeader *header;
+    /* End of the ring, the file size rounded down to 8 bytes */
+    gulong end;
+
+    /* Where and with which sequence number the next record gets written */
+    gulong tail;
+    guint64 next_seq;
+    /* Records before synced_seq are durable, synced_head was head then */
+    guint64 synced_seq;
+    gulong synced_head;
+
+    /* Next record to hand to a worker */
+    gulong drain_offset;
+    guint64 drain_seq;
+    /* Records handed to workers, sorted by offset, and those given back */
+    GList *in_flight;
+    GList *retry;
+
+    /* Statistics */
+    gulong nb_appended;
+    gulong nb_drained;
+    gulong nb_syncs;
+};
+
+GQuark squale_spool_error_quark (void);
+
+SqualeSpool *squale_spool_open (const char *path, gulong size, GError **error);
+SqualeSpool *squale_spool_ref (SqualeSpool *spool);
+void squale_spool_unref (SqualeSpool *spool);
+
+gboolean squale_spool_append (SqualeSpool *spool, const char *order,
+                              GError **error);
+gboolean squale_spool_sync (SqualeSpool *spool, GError **error);
+
+gboolean squale_spool_next (SqualeSpool *spool, char **order, gulong *record);
+void squale_spool_done (SqualeSpool *spool, gulong record);
+void squale_spool_giveup (SqualeSpool *spool, gulong record);
+
+gulong squale_spool_get_pending (SqualeSpool *spool);
+
+#endif /* __SQUALE_SPOOL_H__ */
@@ -33,6 +33,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 enum
 {
@@ -42,12 +43,150 @@ enum
 
 static GObjectClass *parent_class = NULL;
 
+/* Threads interrupting statements, shared by all workers */
+static GThreadPool *cancel_pool = NULL;
+
+typedef struct
+{
+    SqualeWorker *worker;
+    SqualeJob *job;
+} SqualeWorkerCancel;
+
 /* ============================================================= */
 /*                                                               */
 /*                       Private Methods                         */
 /*                                                               */
 /* ============================================================= */
 
+static GQuark
+squale_worker_error_quark (void)
+{
+    static GQuark quark = 0;
+    if (quark == 0)
+        quark = g_quark_from_static_string ("SQuaLe-worker");
+    return quark;
+}
+
+/* Keep the worker for a client session, unless that would leave no worker
+   for the other clients of the joblist */
+static gboolean
+squale_worker_pin (SqualeWorker *worker)
+{
+    gboolean ret = FALSE;
+
+    g_mutex_lock (worker->joblist->list_mutex);
+
+    if (worker->joblist->nb_pinned + 1 < g_list_length (worker->joblist->workers)) {
+        worker->joblist->nb_pinned++;
+        worker->pinned = TRUE;
+        worker->session++;
+        worker->release_requested = FALSE;
+        timerclear (&(worker->idle_ts));
+        ret = TRUE;
+    }
+
+    g_mutex_unlock (worker->joblist->list_mutex);
+
+    return ret;
+}
+
+static void
+squale_worker_unpin (SqualeWorker *worker)
+{
+    g_mutex_lock (worker->joblist->list_mutex);
+
+    if (worker->pinned) {
+        worker->joblist->nb_pinned--;
+        worker->pinned = FALSE;
+        worker->release_requested = FALSE;
+    }
+
+    g_mutex_unlock (worker->joblist->list_mutex);
+}
+
+/* Runs in the cancel pool, interrupting a statement might block on the
+   database server. The job might have completed in the meantime, and the
+   worker does not start another one while we hold cancel_mutex so that we
+   never interrupt the wrong statement. */
+static void
+squale_worker_cancel_func (gpointer data, gpointer user_data)
+{
+    SqualeWorkerCancel *cancel = data;
+    SqualeWorker *worker = cancel->worker;
+    gboolean running;
+
+    g_mutex_lock (worker->cancel_mutex);
+
+    g_mutex_lock (worker->status_mutex);
+    running = worker->current_job == cancel->job && worker->cancel_reason;
+    g_mutex_unlock (worker->status_mutex);
+
+    if (running) {
+        SQUALE_WORKER_GET_CLASS (worker)->cancel (worker);
+    }
+
+    g_mutex_unlock (worker->cancel_mutex);
+
+    g_object_unref (cancel->job);
+    g_object_unref (cancel->worker);
+    g_free (cancel);
+}
+
+/* Cancel the statement of the current job once, status_mutex has to be
+   locked. Called from the main thread, the statement is interrupted from the
+   cancel pool. */
+static gboolean
+squale_worker_cancel_current_job (SqualeWorker *worker, const char *reason)
+{
+    SqualeWorkerClass *class = SQUALE_WORKER_GET_CLASS (worker);
+    SqualeWorkerCancel *cancel = NULL;
+
+    if (!worker->current_job || worker->cancel_reason || !class->cancel)
+        return FALSE;
+
+    g_message (_("Cancelling job %p in worker %p: %s"), worker->current_job,
+               worker, reason);
+
+    worker->cancel_reason = reason;
+    worker->nb_cancels++;
+
+    if (!cancel_pool) {
+        cancel_pool = g_thread_pool_new (squale_worker_cancel_func, NULL,
+                                         SQUALE_WORKER_CANCEL_THREADS, FALSE,
+                                         NULL);
+    }
+
+    cancel = g_new0 (SqualeWorkerCancel, 1);
+    cancel->worker = g_object_ref (worker);
+    cancel->job = g_object_ref (worker->current_job);
+    g_thread_pool_push (cancel_pool, cancel, NULL);
+
+    return TRUE;
+}
+
+/* Main loop timeout of a job deadline, the job might have completed in the
+   meantime in which case there is nothing to cancel anymore. The job might
+   even have completed while we were dispatched and another one been begun,
+   we only cancel if we are still the timeout of the running job. */
+static gboolean
+squale_worker_deadline_reached (gpointer data)
+{
+    SqualeWorker *worker = SQUALE_WORKER (data);
+    guint id = g_source_get_id (g_main_current_source ());
+
+    g_mutex_lock (worker->status_mutex);
+
+    if (worker->deadline_id && worker->deadline_id == id) {
+        worker->deadline_id = 0;
+        squale_worker_cancel_current_job (worker,
+                                          _("Deadline exceeded while the job was running"));
+    }
+
+    g_mutex_unlock (worker->status_mutex);
+
+    return FALSE;
+}
+
 static void
 squale_worker_set_property (GObject *object, guint prop_id,
                             const GValue *value, GParamSpec *pspec)
@@ -109,11 +248,21 @@ squale_worker_dispose (GObject *object)
         worker->status = NULL;
     }
 
+    if (worker->endpoint) {
+        g_free (worker->endpoint);
+        worker->endpoint = NULL;
+    }
+
     if (worker->status_mutex) {
         g_mutex_free (worker->status_mutex);
         worker->status_mutex = NULL;
     }
 
+    if (worker->cancel_mutex) {
+        g_mutex_free (worker->cancel_mutex);
+        worker->cancel_mutex = NULL;
+    }
+
     if (SQUALE_IS_JOBLIST (worker->joblist)) {
         g_object_unref (worker->joblist);
         worker->joblist = NULL;
@@ -129,15 +278,28 @@ squale_worker_init (SqualeWorker *worker)
     worker->thread = NULL;
     worker->joblist = NULL;
     worker->status = NULL;
+    worker->endpoint = NULL;
     worker->status_mutex = g_mutex_new ();
+    worker->cancel_mutex = g_mutex_new ();
     worker->shutdown_requested = FALSE;
     worker->shutdown_complete = FALSE;
     worker->running = FALSE;
     worker->cycle_after = 0;
     worker->cycle_counter = 0;
+    worker->pinned = FALSE;
+    worker->session = 0;
+    worker->release_requested = FALSE;
+    worker->in_transaction = FALSE;
+    timerclear (&(worker->idle_ts));
+    worker->in_flight = FALSE;
+    worker->slow_lane = FALSE;
+    worker->current_job = NULL;
+    worker->deadline_id = 0;
+    worker->cancel_reason = NULL;
     worker->nb_errors = 0;
     worker->nb_jobs_processed = 0;
     worker->nb_db_conn_cycles = 0;
+    worker->nb_cancels = 0;
 }
 
 static void
@@ -173,6 +335,13 @@ squale_worker_connect (SqualeWorker *worker)
 
     class = SQUALE_WORKER_GET_CLASS (worker);
 
+    /* A new connection has neither the cursor nor the transaction of our
+       session, its next orders will fail */
+    if (worker->pinned) {
+        worker->in_transaction = FALSE;
+        squale_worker_unpin (worker);
+    }
+
     if (class->connect)
         return class->connect (worker);
     else
@@ -219,6 +388,10 @@ squale_worker_cycle_connection (SqualeWorker *worker)
 {
     g_return_if_fail (SQUALE_IS_WORKER (worker));
 
+    /* That would close the cursor of the session */
+    if (worker->pinned)
+        return;
+
     if (worker->cycle_after) {
         worker->cycle_counter++;
         if (worker->cycle_counter >= worker->cycle_after) {
@@ -231,6 +404,359 @@ squale_worker_cycle_connection (SqualeWorker *worker)
     }
 }
 
+/* Close the cursor or roll back the transaction of the session and make
+   the worker available again */
+static void
+squale_worker_end_session (SqualeWorker *worker)
+{
+    SqualeWorkerClass *class = SQUALE_WORKER_GET_CLASS (worker);
+
+    if (worker->in_transaction) {
+        g_message (_("Worker %p rolling back transaction of session %u"),
+                   worker, worker->session);
+        if (class->rollback_transaction)
+            class->rollback_transaction (worker, NULL);
+        worker->in_transaction = FALSE;
+    }
+    else {
+        g_message (_("Worker %p closing cursor of session %u"), worker,
+                   worker->session);
+        if (class->close_cursor)
+            class->close_cursor (worker);
+    }
+
+    squale_worker_unpin (worker);
+}
+
+/* Run the job if it belongs to a client session: opening, fetching from or
+   closing a cursor and transaction control statements. Returns FALSE for any
+   other job, which the backend runs as usual. The job is complete when this
+   returns TRUE. */
+gboolean
+squale_worker_run_session_job (SqualeWorker *worker, SqualeJob *job)
+{
+    SqualeWorkerClass *class;
+    GError *error = NULL;
+    gboolean open = FALSE, end = FALSE;
+
+    g_return_val_if_fail (SQUALE_IS_WORKER (worker), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    class = SQUALE_WORKER_GET_CLASS (worker);
+
+    /* We are busy again */
+    timerclear (&(worker->idle_ts));
+
+    if (job->pinned_worker &&
+        (!worker->pinned || worker->session != job->session)) {
+        /* The session ended while the client was away: idle timeout,
+           connection lost... */
+        error = g_error_new (squale_worker_error_quark (), 0,
+                             _("Session is over, its cursor was closed or its " \
+                               "transaction rolled back"));
+    }
+    else {
+        switch (job->job_type) {
+            case SQUALE_JOB_NORMAL:
+                if (!job->cursor_rows) {
+                    /* Plain order, part of our transaction if any */
+                    if (worker->in_transaction) {
+                        job->session_open = TRUE;
+                        job->in_transaction = TRUE;
+                    }
+                    return FALSE;
+                }
+                if (!class->open_cursor || !class->fetch_cursor ||
+                    !class->close_cursor) {
+                    error = g_error_new (squale_worker_error_quark (), 0,
+                                         _("Cursors are not supported by the %s backend"),
+                                         worker->joblist->backend);
+                }
+                else if (job->nb_params) {
+                    error = g_error_new (squale_worker_error_quark (), 0,
+                                         _("Cursors can't be opened on parameterized orders"));
+                }
+                else if (worker->pinned) {
+                    error = g_error_new (squale_worker_error_quark (), 0,
+                                         _("Cursors can't be opened inside a transaction"));
+                }
+                else if (!squale_worker_pin (worker)) {
+                    error = g_error_new (squale_worker_error_quark (), 0,
+                                         _("Too many sessions open in joblist %s"),
+                                         worker->joblist->name);
+                }
+                else {
+                    g_message (_("Worker %p opening cursor for job %p (session %u)"),
+                               worker, job, worker->session);
+                    open = class->open_cursor (worker, job);
+                    end = !open;
+                }
+                break;
+            case SQUALE_JOB_CURSOR_FETCH:
+                if (!worker->pinned || worker->in_transaction) {
+                    error = g_error_new (squale_worker_error_quark (), 0,
+                                         _("No cursor open on that session"));
+                }
+                else {
+                    open = class->fetch_cursor (worker, job);
+                    end = !open;
+                }
+                break;
+            case SQUALE_JOB_CURSOR_CLOSE:
+                job->affected_rows = 0;
+                end = worker->pinned && !worker->in_transaction;
+                break;
+            case SQUALE_JOB_TRANSACTION_BEGIN:
+                if (!class->begin_transaction || !class->commit_transaction ||
+                    !class->rollback_transaction) {
+                    error = g_error_new (squale_worker_error_quark (), 0,
+                                         _("Transactions are not supported by the %s backend"),
+                                         worker->joblist->backend);
+                }
+                else if (worker->pinned) {
+                    /* Keep the session as it is, nested transactions would
+                       commit the current one with most backends */
+                    error = g_error_new (squale_worker_error_quark (), 0,
+                                         _("A transaction is already open"));
+                    open = TRUE;
+                }
+                else if (!squale_worker_pin (worker)) {
+                    error = g_error_new (squale_worker_error_quark (), 0,
+                                         _("Too many sessions open in joblist %s"),
+                                         worker->joblist->name);
+                }
+                else if (!class->begin_transaction (worker, &error)) {
+                    end = TRUE;
+                }
+                else {
+                    g_message (_("Worker %p opening transaction for job %p (session %u)"),
+                               worker, job, worker->session);
+                    worker->in_transaction = TRUE;
+                    job->affected_rows = 0;
+                    open = TRUE;
+                }
+                break;
+            case SQUALE_JOB_TRANSACTION_COMMIT:
+            case SQUALE_JOB_TRANSACTION_ROLLBACK:
+                if (!worker->in_transaction) {
+                    error = g_error_new (squale_worker_error_quark (), 0,
+                                         _("No transaction open on that session"));
+                    /* A cursor might be open */
+                    open = worker->pinned;
+                    break;
+                }
+                /* Whatever happens the transaction is over */
+                worker->in_transaction = FALSE;
+                end = TRUE;
+                if (job->job_type == SQUALE_JOB_TRANSACTION_COMMIT) {
+                    if (class->commit_transaction (worker, &error))
+                        job->affected_rows = 0;
+                }
+                else {
+                    if (class->rollback_transaction (worker, &error))
+                        job->affected_rows = 0;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (error) {
+        squale_job_set_error (job, error);
+        worker->nb_errors++;
+    }
+
+    if (open) {
+        job->session_open = TRUE;
+        job->in_transaction = worker->in_transaction;
+        job->session = worker->session;
+        if (!job->pinned_worker)
+            job->pinned_worker = g_object_ref (worker);
+    }
+    else if (end) {
+        squale_worker_end_session (worker);
+    }
+
+    squale_job_set_status_if_match (job, SQUALE_JOB_COMPLETE,
+                                    SQUALE_JOB_PROCESSING);
+
+    worker->nb_jobs_processed++;
+
+    return TRUE;
+}
+
+/* The backend found its connection silently replaced while a session was
+   open: the cursor or transaction are gone with the old connection. The
+   session ends and the job fails instead of running outside of it. */
+void
+squale_worker_session_lost (SqualeWorker *worker, SqualeJob *job)
+{
+    g_return_if_fail (SQUALE_IS_WORKER (worker));
+    g_return_if_fail (SQUALE_IS_JOB (job));
+
+    g_warning (_("Worker %p lost the connection of session %u"), worker,
+               worker->session);
+
+    worker->in_transaction = FALSE;
+    squale_worker_unpin (worker);
+
+    squale_job_set_error (job, g_error_new (squale_worker_error_quark (), 0,
+                                            _("Session is over, its cursor was closed or its " \
+                               "transaction rolled back")));
+    worker->nb_errors++;
+
+    squale_job_set_status_if_match (job, SQUALE_JOB_COMPLETE,
+                                    SQUALE_JOB_PROCESSING);
+}
+
+/* Called from the main thread when a client leaves a session open, the
+   worker closes the cursor or rolls back the transaction as soon as it is
+   waiting for jobs */
+void
+squale_worker_release (SqualeWorker *worker, guint session)
+{
+    g_return_if_fail (SQUALE_IS_WORKER (worker));
+    g_return_if_fail (SQUALE_IS_JOBLIST (worker->joblist));
+
+    g_mutex_lock (worker->joblist->list_mutex);
+
+    if (worker->pinned && worker->session == session) {
+        worker->release_requested = TRUE;
+        g_cond_broadcast (worker->joblist->cond);
+    }
+
+    g_mutex_unlock (worker->joblist->list_mutex);
+}
+
+/* Called by the worker before running a plain job. A job whose deadline
+   passed since it was assigned is completed with an error and FALSE is
+   returned. Otherwise the statement gets cancelled at the deadline if the
+   worker knows how to do it. */
+gboolean
+squale_worker_begin_job (SqualeWorker *worker, SqualeJob *job)
+{
+    SqualeWorkerClass *class;
+    gint32 time_left;
+
+    g_return_val_if_fail (SQUALE_IS_WORKER (worker), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    class = SQUALE_WORKER_GET_CLASS (worker);
+
+    time_left = squale_job_get_time_left (job);
+
+    if (time_left == 0) {
+        squale_job_set_error (job, g_error_new (squale_worker_error_quark (), 0,
+                                                _("Deadline exceeded before the job was run")));
+        squale_job_set_status_if_match (job, SQUALE_JOB_COMPLETE,
+                                        SQUALE_JOB_PROCESSING);
+        return FALSE;
+    }
+
+    /* Wait for an interruption of our previous statement to be over */
+    g_mutex_lock (worker->cancel_mutex);
+    g_mutex_lock (worker->status_mutex);
+
+    worker->current_job = job;
+    worker->cancel_reason = NULL;
+
+    if (time_left != G_MAXINT32 && class->cancel) {
+        worker->deadline_id = g_timeout_add_full (G_PRIORITY_DEFAULT, time_left,
+                                                  squale_worker_deadline_reached,
+                                                  g_object_ref (worker),
+                                                  g_object_unref);
+    }
+
+    g_mutex_unlock (worker->status_mutex);
+    g_mutex_unlock (worker->cancel_mutex);
+
+    return TRUE;
+}
+
+/* Called by the worker once the job has run, before completing it. Returns
+   FALSE if the job failed with its connection and was given back to the
+   joblist to be retried, the worker then just drops its reference. */
+gboolean
+squale_worker_end_job (SqualeWorker *worker, SqualeJob *job)
+{
+    SqualeWorkerClass *class;
+    gboolean cancelled;
+
+    g_return_val_if_fail (SQUALE_IS_WORKER (worker), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    class = SQUALE_WORKER_GET_CLASS (worker);
+
+    g_mutex_lock (worker->status_mutex);
+
+    cancelled = worker->cancel_reason != NULL;
+
+    if (worker->deadline_id) {
+        g_source_remove (worker->deadline_id);
+        worker->deadline_id = 0;
+    }
+
+    /* The database error of an interrupted statement is not very helpful */
+    if (worker->cancel_reason) {
+        squale_job_set_error (job, g_error_new (squale_worker_error_quark (), 0,
+                                                "%s", worker->cancel_reason));
+        worker->cancel_reason = NULL;
+    }
+
+    worker->current_job = NULL;
+
+    g_mutex_unlock (worker->status_mutex);
+
+    if (!cancelled && job->error && class->connection_lost &&
+        class->connection_lost (worker) &&
+        squale_joblist_retry_job (worker->joblist, job)) {
+        return FALSE;
+    }
+
+    squale_joblist_sample_latency (worker->joblist, job);
+
+    return TRUE;
+}
+
+/* Called from the main thread when nobody wants the result of a job anymore,
+   returns TRUE if the worker was running it and cancelled its statement */
+gboolean
+squale_worker_cancel_job (SqualeWorker *worker, SqualeJob *job)
+{
+    gboolean ret = FALSE;
+
+    g_return_val_if_fail (SQUALE_IS_WORKER (worker), FALSE);
+    g_return_val_if_fail (SQUALE_IS_JOB (job), FALSE);
+
+    g_mutex_lock (worker->status_mutex);
+
+    if (worker->current_job == job) {
+        ret = squale_worker_cancel_current_job (worker,
+                                                _("Job cancelled as its client went away"));
+    }
+
+    g_mutex_unlock (worker->status_mutex);
+
+    return ret;
+}
+
+/* Tells if the statement of the current job has been cancelled, a worker
+   must not run it again then */
+gboolean
+squale_worker_is_cancelled (SqualeWorker *worker)
+{
+    gboolean cancelled;
+
+    g_return_val_if_fail (SQUALE_IS_WORKER (worker), FALSE);
+
+    g_mutex_lock (worker->status_mutex);
+    cancelled = worker->cancel_reason != NULL;
+    g_mutex_unlock (worker->status_mutex);
+
+    return cancelled;
+}
+
 gboolean
 squale_worker_check_shutdown (SqualeWorker *worker)
 {
@@ -310,6 +836,17 @@ squale_worker_get_joblist (SqualeWorker *worker)
     }
 }
 
+/* Only called while configuring, before the worker thread is started */
+void
+squale_worker_set_endpoint (SqualeWorker *worker, const char *endpoint)
+{
+    g_return_if_fail (SQUALE_IS_WORKER (worker));
+
+    if (worker->endpoint)
+        g_free (worker->endpoint);
+    worker->endpoint = g_strdup (endpoint);
+}
+
 void
 squale_worker_set_joblist (SqualeWorker *worker, SqualeJobList *joblist)
 {
@@ -373,18 +910,78 @@ squale_worker_wait (SqualeWorker *worker)
     g_return_val_if_fail (SQUALE_IS_WORKER (worker), NULL);
 
     /* We get a job and keep locking the joblist to block the main thread */
-    job = squale_joblist_assign_pending_job (worker->joblist, TRUE);
+    job = squale_joblist_assign_pending_job (worker->joblist, worker, TRUE);
 
     /* Atomic unlock of the joblist mutex, we are sure that no signal can be sent
        before we are actually waiting on the cond. */
     if (job == NULL) {
         /* Before waiting we make sure a shutdown has not been requested */
-        if (!worker->shutdown_requested) {
-            g_cond_wait (worker->joblist->cond, worker->joblist->list_mutex);
+        if (!worker->shutdown_requested && !worker->release_requested) {
+            GTimeVal wakeup;
+            gboolean timed = FALSE;
+
+            if (timerisset (&(worker->joblist->batch_wakeup_ts))) {
+                /* Some jobs are held for batching, wake up when they are due */
+                wakeup.tv_sec = worker->joblist->batch_wakeup_ts.tv_sec;
+                wakeup.tv_usec = worker->joblist->batch_wakeup_ts.tv_usec;
+                timed = TRUE;
+            }
+
+            if (worker->in_transaction && worker->joblist->transaction_timeout) {
+                /* An idle transaction holds locks, roll it back when the
+                   client takes too long to send its next order */
+                struct timeval now, idle_end;
+
+                gettimeofday (&now, NULL);
+                if (!timerisset (&(worker->idle_ts)))
+                    worker->idle_ts = now;
+
+                idle_end.tv_sec = worker->idle_ts.tv_sec +
+                    worker->joblist->transaction_timeout / 1000;
+                idle_end.tv_usec = worker->idle_ts.tv_usec +
+                    (worker->joblist->transaction_timeout % 1000) * 1000;
+                if (idle_end.tv_usec >= 1000000) {
+                    idle_end.tv_sec++;
+                    idle_end.tv_usec -= 1000000;
+                }
+
+                if (!timercmp (&now, &idle_end, <)) {
+                    g_warning (_("Worker %p: transaction of session %u idle for " \
+                                 "more than %u ms"), worker, worker->session,
+                               worker->joblist->transaction_timeout);
+                    worker->joblist->nb_transaction_timeouts++;
+                    worker->release_requested = TRUE;
+                }
+                else if (!timed || idle_end.tv_sec < wakeup.tv_sec ||
+                         (idle_end.tv_sec == wakeup.tv_sec &&
+                          idle_end.tv_usec < wakeup.tv_usec)) {
+                    wakeup.tv_sec = idle_end.tv_sec;
+                    wakeup.tv_usec = idle_end.tv_usec;
+                    timed = TRUE;
+                }
+            }
+
+            if (worker->release_requested) {
+                /* Nothing to wait for */
+            }
+            else if (timed) {
+                g_cond_timed_wait (worker->joblist->cond,
+                                   worker->joblist->list_mutex, &wakeup);
+            }
+            else {
+                g_cond_wait (worker->joblist->cond, worker->joblist->list_mutex);
+            }
         }
         g_mutex_unlock (worker->joblist->list_mutex);
     }
 
+    /* The client of our session went away without closing its cursor or
+       transaction, or let the transaction idle for too long */
+    if (job == NULL && worker->release_requested) {
+        g_message (_("Worker %p releasing session %u"), worker, worker->session);
+        squale_worker_end_session (worker);
+    }
+
     return job;
 }
 
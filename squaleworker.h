@@ -36,6 +36,9 @@ typedef struct _SqualeWorkerClass SqualeWorkerClass;
 #define SQUALE_IS_WORKER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), SQUALE_TYPE_WORKER))
 #define SQUALE_WORKER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), SQUALE_TYPE_WORKER, SqualeWorkerClass))
 
+/* Threads interrupting the statements of all workers */
+#define SQUALE_WORKER_CANCEL_THREADS 4
+
 struct _SqualeWorker
 {
     GObject object;
@@ -47,6 +50,11 @@ struct _SqualeWorker
     GMutex *status_mutex;
     char *status;
 
+    /* Database server the worker talks to, set by the subclasses from their
+       configuration. Workers of a joblist with different endpoints are
+       equivalent replicas */
+    char *endpoint;
+
     /* States and requests */
     gboolean running;
     gboolean shutdown_requested;
@@ -56,10 +64,37 @@ struct _SqualeWorker
     gulong cycle_after;
     gulong cycle_counter;
 
+    /* A client session keeps that worker, its cursor stays open between
+       jobs. The session number changes each time the worker gets pinned. All
+       of that is protected by the joblist mutex */
+    gboolean pinned;
+    guint session;
+    gboolean release_requested;
+
+    /* The session is a transaction, idle since idle_ts when waiting */
+    gboolean in_transaction;
+    struct timeval idle_ts;
+
+    /* The last job assigned counts in the joblist in flight jobs until we
+       ask for the next one. Protected by the joblist mutex */
+    gboolean in_flight;
+    /* Same for the slow lane of the joblist */
+    gboolean slow_lane;
+
+    /* The job being run and the main loop timeout cancelling it at its
+       deadline, protected by status_mutex. cancel_reason is set once the
+       statement has been cancelled. cancel_mutex is held while the cancel
+       pool interrupts the statement */
+    SqualeJob *current_job;
+    guint deadline_id;
+    const char *cancel_reason;
+    GMutex *cancel_mutex;
+
     /* Statistics */
     gulong nb_jobs_processed;
     gulong nb_errors;
     gulong nb_db_conn_cycles;
+    gulong nb_cancels;
 };
 
 struct _SqualeWorkerClass
@@ -69,6 +104,25 @@ struct _SqualeWorkerClass
     gboolean (*connect) (SqualeWorker *worker);
     gboolean (*disconnect) (SqualeWorker *worker);
     gpointer (*run) (gpointer worker);
+
+    /* Server side cursors. open_cursor and fetch_cursor pack a page of
+       job->cursor_rows rows and return TRUE if more rows might follow */
+    gboolean (*open_cursor) (SqualeWorker *worker, SqualeJob *job);
+    gboolean (*fetch_cursor) (SqualeWorker *worker, SqualeJob *job);
+    void (*close_cursor) (SqualeWorker *worker);
+
+    /* Transactions of a client session */
+    gboolean (*begin_transaction) (SqualeWorker *worker, GError **error);
+    gboolean (*commit_transaction) (SqualeWorker *worker, GError **error);
+    gboolean (*rollback_transaction) (SqualeWorker *worker, GError **error);
+
+    /* Interrupt the statement running on the connection, called from a
+       cancel thread while the worker is blocked in the database */
+    void (*cancel) (SqualeWorker *worker);
+
+    /* Tells if the last statement failed because the connection to the
+       database went away, a read can then be retried */
+    gboolean (*connection_lost) (SqualeWorker *worker);
 };
 
 GType squale_worker_get_type (void);
@@ -79,6 +133,13 @@ gboolean squale_worker_connect (SqualeWorker *worker);
 gboolean squale_worker_disconnect (SqualeWorker *worker);
 gpointer squale_worker_run (gpointer worker);
 void squale_worker_cycle_connection (SqualeWorker *worker);
+gboolean squale_worker_run_session_job (SqualeWorker *worker, SqualeJob *job);
+void squale_worker_session_lost (SqualeWorker *worker, SqualeJob *job);
+void squale_worker_release (SqualeWorker *worker, guint session);
+gboolean squale_worker_begin_job (SqualeWorker *worker, SqualeJob *job);
+gboolean squale_worker_end_job (SqualeWorker *worker, SqualeJob *job);
+gboolean squale_worker_cancel_job (SqualeWorker *worker, SqualeJob *job);
+gboolean squale_worker_is_cancelled (SqualeWorker *worker);
 
 void squale_worker_shutdown (SqualeWorker *worker);
 gboolean squale_worker_check_shutdown (SqualeWorker *worker);
@@ -90,6 +151,8 @@ gboolean squale_worker_is_running (SqualeWorker *worker);
 void squale_worker_set_joblist (SqualeWorker *worker, SqualeJobList *joblist);
 SqualeJobList *squale_worker_get_joblist (SqualeWorker *worker);
 
+void squale_worker_set_endpoint (SqualeWorker *worker, const char *endpoint);
+
 void squale_worker_set_status (SqualeWorker *worker, const char *status);
 char *squale_worker_get_status (SqualeWorker *worker);
 
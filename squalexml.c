@@ -57,6 +57,54 @@ squale_xml_set_properties (gpointer key, gpointer value, gpointer user_data)
         g_object_set (xml->worker, (char *) key, (char *) value, NULL);
 }
 
+static gboolean
+squale_xml_parse_boolean (const char *value)
+{
+    if (!g_ascii_strcasecmp (value, "true") || !g_ascii_strcasecmp (value, "yes") ||
+        !g_ascii_strcasecmp (value, "on") || atoi (value) > 0)
+        return TRUE;
+    else
+        return FALSE;
+}
+
+/* Tenant settings look like "reports:1 frontend:4", separated by spaces or
+   commas. The tenant "*" stands for those not listed where it makes sense. */
+static void
+squale_xml_parse_tenant_settings (SqualeJobList *joblist, const char *name,
+                                  const char *value)
+{
+    char **settings = NULL, *copy = NULL, *colon = NULL;
+    guint i;
+
+    copy = g_strdelimit (g_strdup (value), ",", ' ');
+    settings = g_strsplit (copy, " ", 0);
+    g_free (copy);
+
+    for (i = 0; settings[i]; i++) {
+        colon = strrchr (settings[i], ':');
+        if (!colon || colon == settings[i]) {
+            if (*settings[i])
+                g_warning ("Invalid %s entry %s", name, settings[i]);
+            continue;
+        }
+        *colon = '\0';
+        if (!strcmp (name, "tenant-weights")) {
+            squale_joblist_set_tenant_weight (joblist, settings[i],
+                                              atoi (colon + 1));
+        }
+        else if (!strcmp (name, "tenant-rates")) {
+            squale_joblist_set_tenant_rate (joblist, settings[i],
+                                            g_ascii_strtod (colon + 1, NULL));
+        }
+        else if (!strcmp (name, "tenant-concurrency")) {
+            squale_joblist_set_tenant_concurrency (joblist, settings[i],
+                                                   atoi (colon + 1));
+        }
+    }
+
+    g_strfreev (settings);
+}
+
 static gboolean
 squale_xml_dummy_true_func (gpointer key, gpointer value, gpointer user_data)
 {
@@ -141,6 +189,9 @@ squale_xml_start_element (SqualeXML *xml, const xmlChar *xml_name,
                         else if (!strcmp (attrs[i+1], "socket_name")) {
                             xml->setting = SQUALE_SETTING_SOCKETNAME;
                         }
+                        else if (!strcmp (attrs[i+1], "memory_budget")) {
+                            xml->setting = SQUALE_SETTING_MEMORYBUDGET;
+                        }
                         else {
                             g_warning ("squale_xml_start_element : Unknown setting name %s",
                                        attrs[i+1]);
@@ -157,6 +208,10 @@ squale_xml_start_element (SqualeXML *xml, const xmlChar *xml_name,
                             case SQUALE_SETTING_SOCKETNAME:
                                 squale_set_socket_name (xml->squale, attrs[i+1]);
                                 break;
+                            case SQUALE_SETTING_MEMORYBUDGET:
+                                squale_memory_budget_set_limit (squale_memory_budget_get_global (),
+                                                                strtoul (attrs[i+1], NULL, 10));
+                                break;
                             default:
                                 break;
                         }
@@ -186,8 +241,10 @@ squale_xml_start_element (SqualeXML *xml, const xmlChar *xml_name,
                             xml->joblist_backend = SQUALE_BACKEND_ORACLE;
 
               if (!backend_initialized) {
-                /* One cursor per connection, max number connection allowed */
-                if (SQLO_SUCCESS != sqlo_init (SQLO_ON, 32767, 1)) {
+                /* Room for the cached cursors of parameterized orders, max
+                   number connection allowed */
+                if (SQLO_SUCCESS != sqlo_init (SQLO_ON, 32767,
+                                               SQUALE_ORACLE_MAX_CURSORS)) {
                   g_warning ("Failed initing libsqlora8");
                 }
                 else {
@@ -237,6 +294,161 @@ squale_xml_start_element (SqualeXML *xml, const xmlChar *xml_name,
                                                                         atoi (attrs[i+1]));
                         }
                     }
+                    else if (!strcmp(attrs[i], "coalesce-reads")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_coalesce_reads (xml->joblist,
+                                                               squale_xml_parse_boolean (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "insert-batch-size")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_insert_batching (xml->joblist,
+                                                                atoi (attrs[i+1]),
+                                                                xml->joblist->insert_batch_linger);
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "insert-batch-linger")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_insert_batching (xml->joblist,
+                                                                xml->joblist->insert_batch_size,
+                                                                atoi (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "queue-discipline")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist) &&
+                            !squale_joblist_set_queue_discipline (xml->joblist,
+                                                                  attrs[i+1])) {
+                            g_warning (_("Unknown queue discipline '%s'"), attrs[i+1]);
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "adaptive-concurrency")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_adaptive_concurrency (xml->joblist,
+                                                                     squale_xml_parse_boolean (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "codel-target")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_codel (xml->joblist, atoi (attrs[i+1]),
+                                                      xml->joblist->codel_interval);
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "codel-interval")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_codel (xml->joblist,
+                                                      xml->joblist->codel_target,
+                                                      atoi (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "reserved-workers")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_reserved_workers (xml->joblist,
+                                                                 atoi (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "lifo-threshold")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_lifo_threshold (xml->joblist,
+                                                               atoi (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "tenant-weights") ||
+                             !strcmp(attrs[i], "tenant-rates") ||
+                             !strcmp(attrs[i], "tenant-concurrency")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_xml_parse_tenant_settings (xml->joblist,
+                                                              attrs[i],
+                                                              attrs[i+1]);
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "mirror")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_mirror (xml->joblist, attrs[i+1],
+                                                       xml->joblist->mirror_percent);
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "mirror-percent")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_mirror (xml->joblist,
+                                                       xml->joblist->mirror,
+                                                       atoi (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "affinity-wait")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_affinity_wait (xml->joblist,
+                                                              atoi (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "retry-percent")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_retry_budget (xml->joblist,
+                                                             atoi (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "hedge-percent")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_hedging (xml->joblist,
+                                                        atoi (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "slow-threshold")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_slow_lane (xml->joblist,
+                                                          atoi (attrs[i+1]),
+                                                          xml->joblist->slow_lane_workers);
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "slow-lane-workers")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_slow_lane (xml->joblist,
+                                                          xml->joblist->slow_threshold,
+                                                          atoi (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "counter-batch-size")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_counter_batching (xml->joblist,
+                                                                 atoi (attrs[i+1]),
+                                                                 xml->joblist->counter_batch_linger);
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "counter-batch-linger")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_counter_batching (xml->joblist,
+                                                                 xml->joblist->counter_batch_size,
+                                                                 atoi (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "spill-threshold")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_spill_threshold (xml->joblist,
+                                                                strtoul (attrs[i+1], NULL, 10));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "memory-budget")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_memory_budget (xml->joblist,
+                                                              strtoul (attrs[i+1], NULL, 10));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "transaction-timeout")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_transaction_timeout (xml->joblist,
+                                                                    atoi (attrs[i+1]));
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "spool")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_spool (xml->joblist, attrs[i+1]);
+                        }
+                    }
+                    else if (!strcmp(attrs[i], "spool-size")) {
+                        if (SQUALE_IS_JOBLIST (xml->joblist)) {
+                            squale_joblist_set_spool_size (xml->joblist,
+                                                           strtoul (attrs[i+1], NULL, 10));
+                        }
+                    }
                     else if (!strcmp(attrs[i], "name")) {
                         if (SQUALE_IS_JOBLIST (xml->joblist)) {
                             squale_joblist_set_name (xml->joblist, attrs[i+1]);
@@ -302,6 +514,45 @@ squale_xml_start_element (SqualeXML *xml, const xmlChar *xml_name,
                     }
                 }
             }
+            else if (!strcmp (name, "batch")) {
+                const char *query = NULL, *key_column = NULL;
+                guint i, window = 0, max_size = 0;
+                xml->state = PARSER_BATCH;
+
+                for (i = 0; attrs && attrs[i] != NULL; i += 2) {
+                    if (!strcmp (attrs[i], "query"))
+                        query = attrs[i+1];
+                    else if (!strcmp (attrs[i], "key-column"))
+                        key_column = attrs[i+1];
+                    else if (!strcmp (attrs[i], "window"))
+                        window = atoi (attrs[i+1]);
+                    else if (!strcmp (attrs[i], "max-size"))
+                        max_size = atoi (attrs[i+1]);
+                    else
+                        g_warning (_("Unknown batch attribute '%s'"), attrs[i]);
+                }
+
+                if (query && key_column && SQUALE_IS_JOBLIST (xml->joblist)) {
+                    GError *error = NULL;
+                    SqualeBatchTemplate *template = NULL;
+
+                    template = squale_batch_template_new (query, key_column, &error);
+                    if (template) {
+                        if (window)
+                            template->window = window;
+                        if (max_size)
+                            template->max_size = max_size;
+                        squale_joblist_add_batch_template (xml->joblist, template);
+                    }
+                    else if (error) {
+                        g_warning ("%s", error->message);
+                        g_error_free (error);
+                    }
+                }
+                else {
+                    g_warning (_("<batch> needs a query and a key-column attribute"));
+                }
+            }
             else {
                 g_warning ("squale_xml_start_element : Unexpected element <%s>" \
             " inside <connection>.", name);
@@ -360,6 +611,14 @@ squale_xml_end_element (SqualeXML *xml, const xmlChar *xml_name)
                         g_object_unref (xml->joblist);
                     }
                     else {
+                        GError *error = NULL;
+
+                        if (!squale_joblist_open_spool (xml->joblist, &error)) {
+                            /* No reply orders will get a normal reply */
+                            g_warning ("%s", error->message);
+                            g_error_free (error);
+                        }
+
                         /* We insert that joblist in our joblist list :-) */
                         xml->joblists = g_list_prepend (xml->joblists, xml->joblist);
                     }
@@ -381,6 +640,11 @@ squale_xml_end_element (SqualeXML *xml, const xmlChar *xml_name)
             }
             xml->state = PARSER_CONNECTION;
             break;
+        case PARSER_BATCH:
+            if (strcmp(name, "batch") != 0)
+                g_warning("should find </batch> here.  Found </%s>", name);
+            xml->state = PARSER_CONNECTION;
+            break;
         case PARSER_START:
         case PARSER_FINISH:
         case PARSER_UNKNOWN:
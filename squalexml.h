@@ -37,6 +37,7 @@ typedef enum
     PARSER_CONNECTIONS,
     PARSER_CONNECTION,
     PARSER_WORKER,
+    PARSER_BATCH,
     PARSER_FINISH,
     PARSER_UNKNOWN
 } ParserState;
@@ -54,7 +55,8 @@ typedef enum
 {
     SQUALE_SETTING_LOGLEVEL,
     SQUALE_SETTING_LOGFILE,
-    SQUALE_SETTING_SOCKETNAME
+    SQUALE_SETTING_SOCKETNAME,
+    SQUALE_SETTING_MEMORYBUDGET
 } Setting;
 
 struct _SqualeXML